@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loopback stand-in for a download server. It serves one file with Range
+// and multi-range support and can add latency, cap bandwidth, limit
+// connections and inject errors, so that changes to the HTTP reader can be
+// compared without depending on a real CDN.
+
+#define BENCH_MAX_RANGES 256
+#define BENCH_MAX_HEADER 16384
+#define BENCH_SEND_CHUNK (64 * 1024)
+#define BENCH_BOUNDARY "payload_dumper_bench_boundary"
+
+typedef struct {
+  uint64_t start;
+  uint64_t end; // inclusive
+} bench_range_t;
+
+typedef struct {
+  // Configuration
+  const char *path;
+  char url_path[512];
+  int fd;
+  uint64_t size;
+  char etag[64];
+  int rtt_ms;
+  uint64_t bandwidth;
+  int max_connections;
+  double error_rate;
+  double reset_rate;
+  int no_range;
+  int no_multirange;
+  int listen_fd;
+
+  // Shared state
+  pthread_mutex_t lock;
+  int connections;
+  double next_send_time;
+
+  // Statistics
+  uint64_t total_connections;
+  uint64_t connections_refused;
+  uint64_t requests;
+  uint64_t range_requests;
+  uint64_t multirange_requests;
+  uint64_t errors_injected;
+  uint64_t resets_injected;
+  uint64_t bytes_sent;
+  double *ttfb;
+  size_t ttfb_count;
+  size_t ttfb_capacity;
+} bench_server_t;
+
+typedef struct {
+  bench_server_t *server;
+  int fd;
+  unsigned int seed;
+} bench_conn_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void sleep_seconds(double seconds) {
+  if (seconds <= 0.0) {
+    return;
+  }
+  struct timespec ts;
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
+static double random_unit(unsigned int *seed) {
+  return (double)rand_r(seed) / ((double)RAND_MAX + 1.0);
+}
+
+// Parses a byte count with an optional K, M or G suffix.
+static uint64_t parse_size(const char *str) {
+  char *end;
+  unsigned long long value = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value *= 1024ULL;
+    break;
+  case 'm':
+  case 'M':
+    value *= 1024ULL * 1024;
+    break;
+  case 'g':
+  case 'G':
+    value *= 1024ULL * 1024 * 1024;
+    break;
+  }
+  return (uint64_t)value;
+}
+
+static char *format_rate(double bytes, char *buffer, size_t size) {
+  const char *units[] = {"B", "KB", "MB", "GB"};
+  int unit_idx = 0;
+  while (bytes >= 1024.0 && unit_idx < 3) {
+    bytes /= 1024.0;
+    unit_idx++;
+  }
+  snprintf(buffer, size, "%.2f %s", bytes, units[unit_idx]);
+  return buffer;
+}
+
+static int send_all(int fd, const void *data, size_t size) {
+  const char *ptr = data;
+  while (size > 0) {
+    ssize_t sent = send(fd, ptr, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    ptr += sent;
+    size -= (size_t)sent;
+  }
+  return 0;
+}
+
+// All connections share one bandwidth budget. Each chunk reserves the next
+// free slot on a virtual wire and the sender sleeps until it has passed.
+static void throttle(bench_server_t *server, size_t bytes) {
+  if (server->bandwidth == 0) {
+    return;
+  }
+  pthread_mutex_lock(&server->lock);
+  double now = now_seconds();
+  if (server->next_send_time < now) {
+    server->next_send_time = now;
+  }
+  server->next_send_time += (double)bytes / (double)server->bandwidth;
+  double until = server->next_send_time;
+  pthread_mutex_unlock(&server->lock);
+  sleep_seconds(until - now_seconds());
+}
+
+static void record_ttfb(bench_server_t *server, double ttfb) {
+  pthread_mutex_lock(&server->lock);
+  if (server->ttfb_count == server->ttfb_capacity) {
+    size_t capacity = server->ttfb_capacity ? server->ttfb_capacity * 2 : 256;
+    double *grown = realloc(server->ttfb, capacity * sizeof(double));
+    if (grown) {
+      server->ttfb = grown;
+      server->ttfb_capacity = capacity;
+    }
+  }
+  if (server->ttfb_count < server->ttfb_capacity) {
+    server->ttfb[server->ttfb_count++] = ttfb;
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+// Sends [start, end] of the file. With `reset` set the connection is
+// dropped halfway through, like a flaky link would.
+static int send_file_range(bench_conn_t *conn, uint64_t start, uint64_t end,
+                           int reset, double request_time, int *first_byte) {
+  bench_server_t *server = conn->server;
+  uint8_t *chunk = malloc(BENCH_SEND_CHUNK);
+  if (!chunk) {
+    return -1;
+  }
+
+  uint64_t cut = reset ? start + (end - start + 1) / 2 : end + 1;
+  uint64_t pos = start;
+  int result = 0;
+  while (pos <= end) {
+    size_t to_send = BENCH_SEND_CHUNK;
+    if (to_send > end - pos + 1) {
+      to_send = (size_t)(end - pos + 1);
+    }
+    if (pos < cut && pos + to_send > cut) {
+      to_send = (size_t)(cut - pos);
+    }
+    if (pos >= cut) {
+      result = -1;
+      break;
+    }
+
+    ssize_t got = pread(server->fd, chunk, to_send, (off_t)pos);
+    if (got <= 0) {
+      result = -1;
+      break;
+    }
+    throttle(server, (size_t)got);
+    if (!*first_byte) {
+      record_ttfb(server, now_seconds() - request_time);
+      *first_byte = 1;
+    }
+    if (send_all(conn->fd, chunk, (size_t)got) != 0) {
+      result = -1;
+      break;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->bytes_sent += (uint64_t)got;
+    pthread_mutex_unlock(&server->lock);
+    pos += (uint64_t)got;
+  }
+
+  free(chunk);
+  return result;
+}
+
+static int send_text(bench_conn_t *conn, const char *text, int *first_byte,
+                     double request_time) {
+  if (!*first_byte) {
+    record_ttfb(conn->server, now_seconds() - request_time);
+    *first_byte = 1;
+  }
+  return send_all(conn->fd, text, strlen(text));
+}
+
+// Parses "bytes=a-b,c-,-n". Returns the number of satisfiable ranges, 0 if
+// none is, or -1 if the header is not a byte range at all.
+static int parse_ranges(const char *value, uint64_t size,
+                        bench_range_t *ranges) {
+  while (*value == ' ') {
+    value++;
+  }
+  if (strncmp(value, "bytes=", 6) != 0) {
+    return -1;
+  }
+  value += 6;
+
+  int count = 0;
+  while (*value && count < BENCH_MAX_RANGES) {
+    while (*value == ' ' || *value == ',') {
+      value++;
+    }
+    if (!*value) {
+      break;
+    }
+
+    char *end;
+    uint64_t start, last;
+    if (*value == '-') {
+      uint64_t suffix = strtoull(value + 1, &end, 10);
+      if (suffix == 0) {
+        return -1;
+      }
+      start = (suffix > size) ? 0 : size - suffix;
+      last = size - 1;
+    } else {
+      start = strtoull(value, &end, 10);
+      if (*end != '-') {
+        return -1;
+      }
+      value = end + 1;
+      if (*value >= '0' && *value <= '9') {
+        last = strtoull(value, &end, 10);
+      } else {
+        last = size - 1;
+        end = (char *)value;
+      }
+    }
+    value = end;
+
+    if (start < size && start <= last) {
+      ranges[count].start = start;
+      ranges[count].end = (last >= size) ? size - 1 : last;
+      count++;
+    }
+  }
+  return count;
+}
+
+static const char *find_header(const char *headers, const char *name,
+                               char *value, size_t value_size) {
+  size_t name_len = strlen(name);
+  const char *line = strstr(headers, "\r\n");
+  while (line && line[2] != '\r' && line[2] != '\0') {
+    line += 2;
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *start = line + name_len + 1;
+      while (*start == ' ') {
+        start++;
+      }
+      const char *end = strstr(start, "\r\n");
+      size_t len = end ? (size_t)(end - start) : strlen(start);
+      if (len >= value_size) {
+        len = value_size - 1;
+      }
+      memcpy(value, start, len);
+      value[len] = '\0';
+      return value;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return NULL;
+}
+
+// Handles one request. Returns 0 to keep the connection open.
+static int handle_request(bench_conn_t *conn, const char *request,
+                          double request_time) {
+  bench_server_t *server = conn->server;
+  char method[16], path[1024];
+  if (sscanf(request, "%15s %1023s", method, path) != 2) {
+    return -1;
+  }
+
+  int head = (strcmp(method, "HEAD") == 0);
+  int first_byte = 0;
+  char header[1024];
+
+  pthread_mutex_lock(&server->lock);
+  server->requests++;
+  pthread_mutex_unlock(&server->lock);
+
+  sleep_seconds(server->rtt_ms / 1000.0);
+
+  if (!head && strcmp(method, "GET") != 0) {
+    send_text(conn,
+              "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n",
+              &first_byte, request_time);
+    return 0;
+  }
+  if (strcmp(path, server->url_path) != 0) {
+    send_text(conn, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n",
+              &first_byte, request_time);
+    return 0;
+  }
+
+  if (server->error_rate > 0.0 && random_unit(&conn->seed) < server->error_rate) {
+    pthread_mutex_lock(&server->lock);
+    server->errors_injected++;
+    pthread_mutex_unlock(&server->lock);
+    send_text(conn,
+              "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+              "Content-Length: 0\r\n\r\n",
+              &first_byte, request_time);
+    return 0;
+  }
+  int reset = (!head && server->reset_rate > 0.0 &&
+               random_unit(&conn->seed) < server->reset_rate);
+  if (reset) {
+    pthread_mutex_lock(&server->lock);
+    server->resets_injected++;
+    pthread_mutex_unlock(&server->lock);
+  }
+
+  bench_range_t ranges[BENCH_MAX_RANGES];
+  int num_ranges = 0;
+  char value[4096];
+  if (!server->no_range &&
+      find_header(request, "Range", value, sizeof(value))) {
+    num_ranges = parse_ranges(value, server->size, ranges);
+    if (num_ranges == 0) {
+      snprintf(header, sizeof(header),
+               "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: "
+               "bytes */%" PRIu64 "\r\nContent-Length: 0\r\n\r\n",
+               server->size);
+      send_text(conn, header, &first_byte, request_time);
+      return 0;
+    }
+    if (num_ranges < 0) {
+      num_ranges = 0;
+    }
+  }
+  // If-Range with a stale validator means the whole object
+  if (num_ranges > 0 && find_header(request, "If-Range", value, sizeof(value)) &&
+      strcmp(value, server->etag) != 0) {
+    num_ranges = 0;
+  }
+  if (num_ranges > 1 && server->no_multirange) {
+    ranges[0].end = ranges[num_ranges - 1].end;
+    for (int i = 1; i < num_ranges; i++) {
+      if (ranges[i].start < ranges[0].start) {
+        ranges[0].start = ranges[i].start;
+      }
+      if (ranges[i].end > ranges[0].end) {
+        ranges[0].end = ranges[i].end;
+      }
+    }
+    num_ranges = 1;
+  }
+
+  const char *accept = server->no_range ? "none" : "bytes";
+  if (num_ranges == 0) {
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 200 OK\r\nContent-Length: %" PRIu64
+             "\r\nAccept-Ranges: %s\r\nETag: %s\r\n"
+             "Content-Type: application/zip\r\n\r\n",
+             server->size, accept, server->etag);
+    if (send_text(conn, header, &first_byte, request_time) != 0) {
+      return -1;
+    }
+    return head ? 0
+                : send_file_range(conn, 0, server->size - 1, reset,
+                                  request_time, &first_byte);
+  }
+
+  pthread_mutex_lock(&server->lock);
+  server->range_requests++;
+  if (num_ranges > 1) {
+    server->multirange_requests++;
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  if (num_ranges == 1) {
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 206 Partial Content\r\nContent-Length: %" PRIu64
+             "\r\nContent-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64
+             "\r\nAccept-Ranges: bytes\r\nETag: %s\r\n"
+             "Content-Type: application/zip\r\n\r\n",
+             ranges[0].end - ranges[0].start + 1, ranges[0].start,
+             ranges[0].end, server->size, server->etag);
+    if (send_text(conn, header, &first_byte, request_time) != 0) {
+      return -1;
+    }
+    return head ? 0
+                : send_file_range(conn, ranges[0].start, ranges[0].end, reset,
+                                  request_time, &first_byte);
+  }
+
+  // The body length has to be known up front, so the part headers are
+  // formatted twice: once to measure, once to send.
+  uint64_t body_length = strlen("\r\n--" BENCH_BOUNDARY "--\r\n");
+  for (int i = 0; i < num_ranges; i++) {
+    body_length += (uint64_t)snprintf(
+        header, sizeof(header),
+        "\r\n--" BENCH_BOUNDARY "\r\nContent-Type: application/zip\r\n"
+        "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n\r\n",
+        ranges[i].start, ranges[i].end, server->size);
+    body_length += ranges[i].end - ranges[i].start + 1;
+  }
+
+  snprintf(header, sizeof(header),
+           "HTTP/1.1 206 Partial Content\r\nContent-Length: %" PRIu64
+           "\r\nAccept-Ranges: bytes\r\nETag: %s\r\nContent-Type: "
+           "multipart/byteranges; boundary=" BENCH_BOUNDARY "\r\n\r\n",
+           body_length, server->etag);
+  if (send_text(conn, header, &first_byte, request_time) != 0) {
+    return -1;
+  }
+  if (head) {
+    return 0;
+  }
+  for (int i = 0; i < num_ranges; i++) {
+    snprintf(header, sizeof(header),
+             "\r\n--" BENCH_BOUNDARY "\r\nContent-Type: application/zip\r\n"
+             "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64
+             "\r\n\r\n",
+             ranges[i].start, ranges[i].end, server->size);
+    if (send_all(conn->fd, header, strlen(header)) != 0 ||
+        send_file_range(conn, ranges[i].start, ranges[i].end,
+                        reset && i == num_ranges / 2, request_time,
+                        &first_byte) != 0) {
+      return -1;
+    }
+  }
+  return send_all(conn->fd, "\r\n--" BENCH_BOUNDARY "--\r\n",
+                  strlen("\r\n--" BENCH_BOUNDARY "--\r\n"));
+}
+
+static void *connection_thread(void *arg) {
+  bench_conn_t *conn = arg;
+  bench_server_t *server = conn->server;
+  char *buffer = malloc(BENCH_MAX_HEADER + 1);
+  size_t used = 0;
+
+  // Connection setup costs one round trip
+  sleep_seconds(server->rtt_ms / 1000.0);
+
+  while (buffer) {
+    char *end = NULL;
+    while (!(end = strstr(buffer, "\r\n\r\n"))) {
+      if (used == BENCH_MAX_HEADER) {
+        goto done;
+      }
+      ssize_t got = recv(conn->fd, buffer + used, BENCH_MAX_HEADER - used, 0);
+      if (got <= 0) {
+        goto done;
+      }
+      used += (size_t)got;
+      buffer[used] = '\0';
+    }
+
+    double request_time = now_seconds();
+    end[2] = '\0';
+    size_t request_len = (size_t)(end - buffer) + 4;
+    if (handle_request(conn, buffer, request_time) != 0) {
+      break;
+    }
+    memmove(buffer, buffer + request_len, used - request_len);
+    used -= request_len;
+    buffer[used] = '\0';
+  }
+
+done:
+  free(buffer);
+  close(conn->fd);
+  pthread_mutex_lock(&server->lock);
+  server->connections--;
+  pthread_mutex_unlock(&server->lock);
+  free(conn);
+  return NULL;
+}
+
+// Connections over the limit get a 503 and are closed, the way servers
+// with a per-client connection limit answer. Making them wait instead
+// would deadlock clients that keep idle connections open.
+static void *accept_thread(void *arg) {
+  bench_server_t *server = arg;
+  unsigned int seed = (unsigned int)time(NULL);
+
+  for (;;) {
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_mutex_lock(&server->lock);
+    int refuse = (server->max_connections > 0 &&
+                  server->connections >= server->max_connections);
+    if (refuse) {
+      server->connections_refused++;
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (refuse) {
+      const char *busy = "HTTP/1.1 503 Service Unavailable\r\n"
+                         "Connection: close\r\nContent-Length: 0\r\n\r\n";
+      send_all(fd, busy, strlen(busy));
+      shutdown(fd, SHUT_WR);
+      close(fd);
+      continue;
+    }
+
+    bench_conn_t *conn = malloc(sizeof(bench_conn_t));
+    if (!conn) {
+      close(fd);
+      continue;
+    }
+    conn->server = server;
+    conn->fd = fd;
+    conn->seed = seed = seed * 1103515245u + 12345u;
+
+    pthread_mutex_lock(&server->lock);
+    server->connections++;
+    server->total_connections++;
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connection_thread, conn) != 0) {
+      close(fd);
+      free(conn);
+      pthread_mutex_lock(&server->lock);
+      server->connections--;
+      pthread_mutex_unlock(&server->lock);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_report(bench_server_t *server, double elapsed,
+                         int exit_status) {
+  char rate[32], sent[32];
+  pthread_mutex_lock(&server->lock);
+  printf("\n- Benchmark results\n");
+  printf("  Exit status:      %d\n", exit_status);
+  printf("  Wall time:        %.3f s\n", elapsed);
+  printf("  Requests:         %" PRIu64 " (%" PRIu64 " ranged, %" PRIu64
+         " multi-range)\n",
+         server->requests, server->range_requests,
+         server->multirange_requests);
+  printf("  Connections:      %" PRIu64 " (%" PRIu64 " refused)\n",
+         server->total_connections, server->connections_refused);
+  printf("  Injected:         %" PRIu64 " errors, %" PRIu64 " resets\n",
+         server->errors_injected, server->resets_injected);
+  printf("  Bytes served:     %s\n",
+         format_rate((double)server->bytes_sent, sent, sizeof(sent)));
+  printf("  Throughput:       %s/s\n",
+         format_rate(elapsed > 0.0 ? (double)server->bytes_sent / elapsed : 0.0,
+                     rate, sizeof(rate)));
+  if (server->ttfb_count > 0) {
+    qsort(server->ttfb, server->ttfb_count, sizeof(double), compare_doubles);
+    double sum = 0.0;
+    for (size_t i = 0; i < server->ttfb_count; i++) {
+      sum += server->ttfb[i];
+    }
+    printf("  TTFB:             avg %.1f ms, p50 %.1f ms, p95 %.1f ms, max "
+           "%.1f ms\n",
+           sum * 1000.0 / (double)server->ttfb_count,
+           server->ttfb[server->ttfb_count / 2] * 1000.0,
+           server->ttfb[server->ttfb_count * 95 / 100] * 1000.0,
+           server->ttfb[server->ttfb_count - 1] * 1000.0);
+  }
+  pthread_mutex_unlock(&server->lock);
+}
+
+static void print_usage(const char *program_name) {
+  printf("Usage: %s [options] <file.zip> [<payload_dumper> [args...]]\n",
+         program_name);
+  printf("Serves <file.zip> on loopback and runs <payload_dumper> against it.\n"
+         "Without <payload_dumper> the server runs until interrupted.\n");
+  printf("Options:\n");
+  printf("  --port <num>            Port to listen on (default: any free port)\n");
+  printf("  --rtt <ms>              Delay added per request and per connection\n");
+  printf("  --bandwidth <size>      Total bandwidth cap in bytes/s (K/M/G)\n");
+  printf("  --max-connections <n>   Concurrent connections served\n");
+  printf("  --error-rate <0..1>     Fraction of requests answered with 503\n");
+  printf("  --reset-rate <0..1>     Fraction of responses cut off mid-body\n");
+  printf("  --no-range              Ignore Range headers\n");
+  printf("  --no-multirange         Merge multi-range requests into one range\n");
+  printf("  --help                  Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+  bench_server_t server;
+  memset(&server, 0, sizeof(server));
+  int port = 0;
+
+  int i = 1;
+  for (; i < argc; i++) {
+    if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rtt") == 0 && i + 1 < argc) {
+      server.rtt_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bandwidth") == 0 && i + 1 < argc) {
+      server.bandwidth = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+      server.max_connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--error-rate") == 0 && i + 1 < argc) {
+      server.error_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--reset-rate") == 0 && i + 1 < argc) {
+      server.reset_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--no-range") == 0) {
+      server.no_range = 1;
+    } else if (strcmp(argv[i], "--no-multirange") == 0) {
+      server.no_multirange = 1;
+    } else if (strcmp(argv[i], "--help") == 0) {
+      print_usage(argv[0]);
+      return 0;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "- Error: Unknown option '%s'\n", argv[i]);
+      print_usage(argv[0]);
+      return -1;
+    } else {
+      break;
+    }
+  }
+  if (i >= argc) {
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  server.path = argv[i++];
+  server.fd = open(server.path, O_RDONLY);
+  struct stat st;
+  if (server.fd < 0 || fstat(server.fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "- Error: Cannot open %s\n", server.path);
+    return -1;
+  }
+  server.size = (uint64_t)st.st_size;
+  snprintf(server.etag, sizeof(server.etag), "\"%" PRIx64 "-%" PRIx64 "\"",
+           server.size, (uint64_t)st.st_mtime);
+  const char *name = strrchr(server.path, '/');
+  snprintf(server.url_path, sizeof(server.url_path), "/%s",
+           name ? name + 1 : server.path);
+  pthread_mutex_init(&server.lock, NULL);
+
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons((uint16_t)port);
+  socklen_t addr_len = sizeof(addr);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 128) != 0 ||
+      getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    fprintf(stderr, "- Error: Cannot listen on port %d: %s\n", port,
+            strerror(errno));
+    return -1;
+  }
+
+  char url[640];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", ntohs(addr.sin_port),
+           server.url_path);
+  printf("- Serving %s at %s\n", server.path, url);
+  fflush(stdout);
+
+  signal(SIGPIPE, SIG_IGN);
+  server.listen_fd = listen_fd;
+  pthread_t acceptor;
+  if (pthread_create(&acceptor, NULL, accept_thread, &server) != 0) {
+    return -1;
+  }
+
+  if (i >= argc) {
+    pthread_join(acceptor, NULL);
+    return 0;
+  }
+
+  // Run the dumper as `<payload_dumper> <url> [args...]`
+  char **child_argv = calloc((size_t)(argc - i + 2), sizeof(char *));
+  if (!child_argv) {
+    return -1;
+  }
+  child_argv[0] = argv[i];
+  child_argv[1] = url;
+  for (int j = i + 1; j < argc; j++) {
+    child_argv[j - i + 1] = argv[j];
+  }
+
+  double start = now_seconds();
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(child_argv[0], child_argv);
+    fprintf(stderr, "- Error: Cannot run %s: %s\n", child_argv[0],
+            strerror(errno));
+    _exit(127);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    fprintf(stderr, "- Error: Failed to run %s\n", child_argv[0]);
+    return -1;
+  }
+  double elapsed = now_seconds() - start;
+
+  int exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  print_report(&server, elapsed, exit_status);
+  free(child_argv);
+  return exit_status;
+}
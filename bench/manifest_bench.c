@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "manifest_scan.h"
+#include "update_metadata.pb-c.h"
+
+// Times unpacking and releasing a synthetic manifest with protobuf-c, with
+// and without an arena, and with the manifest scanner payload_dumper uses,
+// so changes to manifest handling can be measured without a large real
+// payload.
+
+#define BENCH_DEFAULT_OPS 100000
+#define BENCH_PARTITIONS 16
+#define BENCH_ROUNDS 10
+#define BENCH_ARENA_RATIO 6 // As MANIFEST_ARENA_RATIO in payload_dumper
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+} bench_buf_t;
+
+static void put_byte(bench_buf_t *buf, uint8_t byte) {
+  if (buf->len == buf->capacity) {
+    buf->capacity = buf->capacity ? buf->capacity * 2 : 4096;
+    buf->data = realloc(buf->data, buf->capacity);
+    if (!buf->data) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  buf->data[buf->len++] = byte;
+}
+
+static void put_varint(bench_buf_t *buf, uint64_t value) {
+  while (value >= 0x80) {
+    put_byte(buf, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  put_byte(buf, (uint8_t)value);
+}
+
+static void put_uint_field(bench_buf_t *buf, uint32_t field, uint64_t value) {
+  put_varint(buf, (uint64_t)field << 3);
+  put_varint(buf, value);
+}
+
+static void put_bytes_field(bench_buf_t *buf, uint32_t field,
+                            const uint8_t *data, size_t len) {
+  put_varint(buf, ((uint64_t)field << 3) | 2);
+  put_varint(buf, len);
+  for (size_t i = 0; i < len; i++) {
+    put_byte(buf, data[i]);
+  }
+}
+
+// Encodes a manifest shaped like a full OTA: REPLACE_XZ operations with
+// one destination extent and a data hash each, spread over a few
+// partitions. Written out by hand so that only unpacking is needed from
+// protobuf-c.
+static uint8_t *build_manifest(size_t num_ops, size_t *size) {
+  static const uint8_t hash[32] = {0};
+  size_t per_partition = (num_ops + BENCH_PARTITIONS - 1) / BENCH_PARTITIONS;
+  bench_buf_t manifest = {0};
+  uint64_t data_offset = 0;
+  size_t op_index = 0;
+
+  for (int p = 0; p < BENCH_PARTITIONS && op_index < num_ops; p++) {
+    bench_buf_t partition = {0};
+    char name[16];
+    int name_len = snprintf(name, sizeof(name), "part%d", p);
+    put_bytes_field(&partition, 1, (const uint8_t *)name, (size_t)name_len);
+
+    for (size_t i = 0; i < per_partition && op_index < num_ops;
+         i++, op_index++) {
+      bench_buf_t extent = {0};
+      put_uint_field(&extent, 1, i * 512);
+      put_uint_field(&extent, 2, 512);
+
+      bench_buf_t op = {0};
+      uint64_t data_length = 300000 + (op_index * 7919) % 200000;
+      put_uint_field(&op, 1,
+                     CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE_XZ);
+      put_uint_field(&op, 2, data_offset);
+      put_uint_field(&op, 3, data_length);
+      put_bytes_field(&op, 6, extent.data, extent.len);
+      put_bytes_field(&op, 8, hash, sizeof(hash));
+      put_bytes_field(&partition, 8, op.data, op.len);
+      data_offset += data_length;
+      free(extent.data);
+      free(op.data);
+    }
+    put_bytes_field(&manifest, 13, partition.data, partition.len);
+    free(partition.data);
+  }
+  put_uint_field(&manifest, 3, 4096);
+
+  *size = manifest.len;
+  return manifest.data;
+}
+
+typedef enum {
+  BENCH_MALLOC,     // protobuf-c with its default allocator
+  BENCH_ARENA,      // protobuf-c into an arena
+  BENCH_SCAN_ALL,   // manifest_scan into an op table, every partition
+  BENCH_SCAN_ONE,   // manifest_scan into an op table, one partition
+  BENCH_NUM_MODES
+} bench_mode_t;
+
+static const char *const bench_mode_names[BENCH_NUM_MODES] = {
+    "malloc", "arena", "scan", "scan one"};
+
+typedef struct {
+  double unpack_ms;
+  double free_ms;
+  size_t memory; // Bytes taken from the arena, where there is one
+} bench_sample_t;
+
+static int decode_scanned(bench_mode_t mode, const uint8_t *packed,
+                          size_t size, op_table_t *table) {
+  manifest_scan_t scan;
+  if (manifest_scan(packed, size, &scan) != 0) {
+    return -1;
+  }
+  int ret = manifest_build_op_table(
+      &scan, packed, (mode == BENCH_SCAN_ONE) ? "part0" : NULL, table);
+  manifest_scan_free(&scan);
+  return ret;
+}
+
+// Unpacks and releases the manifest once in the given way
+static int measure(bench_mode_t mode, const uint8_t *packed, size_t size,
+                   bench_sample_t *sample) {
+  arena_t arena;
+  ProtobufCAllocator allocator;
+  op_table_t table;
+  ChromeosUpdateEngine__DeltaArchiveManifest *manifest = NULL;
+  double t0 = now_ms();
+  int ok;
+  if (mode == BENCH_MALLOC) {
+    manifest = chromeos_update_engine__delta_archive_manifest__unpack(
+        NULL, size, packed);
+    ok = manifest != NULL;
+  } else if (mode == BENCH_ARENA) {
+    if (arena_init(&arena, size * BENCH_ARENA_RATIO) != 0) {
+      return -1;
+    }
+    allocator = arena_protobuf_allocator(&arena);
+    manifest = chromeos_update_engine__delta_archive_manifest__unpack(
+        &allocator, size, packed);
+    ok = manifest != NULL;
+  } else {
+    ok = decode_scanned(mode, packed, size, &table) == 0;
+  }
+  double t1 = now_ms();
+
+  sample->memory = 0;
+  if (mode == BENCH_MALLOC) {
+    chromeos_update_engine__delta_archive_manifest__free_unpacked(manifest,
+                                                                  NULL);
+  } else if (mode == BENCH_ARENA) {
+    sample->memory = arena.allocated;
+    arena_free(&arena);
+  } else if (ok) {
+    sample->memory = table.arena.allocated;
+    op_table_free(&table);
+  }
+  double t2 = now_ms();
+  sample->unpack_ms = t1 - t0;
+  sample->free_ms = t2 - t1;
+  return ok ? 0 : -1;
+}
+
+// payload_dumper unpacks the manifest once into a fresh heap, so each
+// sample runs in a child process rather than reusing memory the previous
+// round freed
+static int measure_in_child(bench_mode_t mode, const uint8_t *packed, size_t size,
+                            bench_sample_t *sample) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    bench_sample_t child_sample;
+    int ok = measure(mode, packed, size, &child_sample) == 0 &&
+             write(fds[1], &child_sample, sizeof(child_sample)) ==
+                 (ssize_t)sizeof(child_sample);
+    _exit(ok ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t got = read(fds[0], sample, sizeof(*sample));
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return (got == (ssize_t)sizeof(*sample) && WIFEXITED(status) &&
+          WEXITSTATUS(status) == 0)
+             ? 0
+             : -1;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_ops = BENCH_DEFAULT_OPS;
+  if (argc > 1) {
+    num_ops = (size_t)strtoull(argv[1], NULL, 10);
+  }
+  if (num_ops < BENCH_PARTITIONS) {
+    fprintf(stderr, "usage: %s [operations >= %d]\n", argv[0],
+            BENCH_PARTITIONS);
+    return 2;
+  }
+
+  size_t size;
+  uint8_t *packed = build_manifest(num_ops, &size);
+  if (!packed) {
+    fprintf(stderr, "failed to build the manifest\n");
+    return 1;
+  }
+  printf("manifest: %zu operations, %zu bytes packed\n", num_ops, size);
+
+  bench_sample_t totals[BENCH_NUM_MODES];
+  memset(totals, 0, sizeof(totals));
+  size_t memory[BENCH_NUM_MODES] = {0};
+  for (int round = 0; round < BENCH_ROUNDS; round++) {
+    for (int mode = 0; mode < BENCH_NUM_MODES; mode++) {
+      bench_sample_t sample;
+      if (measure_in_child((bench_mode_t)mode, packed, size, &sample) != 0) {
+        fprintf(stderr, "unpacking the manifest failed\n");
+        free(packed);
+        return 1;
+      }
+      totals[mode].unpack_ms += sample.unpack_ms;
+      totals[mode].free_ms += sample.free_ms;
+      memory[mode] = sample.memory;
+    }
+  }
+
+  printf("%-8s %10s %10s %10s %10s\n", "", "decode ms", "free ms",
+         "total ms", "arena MB");
+  for (int i = 0; i < BENCH_NUM_MODES; i++) {
+    printf("%-8s %10.2f %10.2f %10.2f %10.2f\n", bench_mode_names[i],
+           totals[i].unpack_ms / BENCH_ROUNDS, totals[i].free_ms / BENCH_ROUNDS,
+           (totals[i].unpack_ms + totals[i].free_ms) / BENCH_ROUNDS,
+           (double)memory[i] / (1024.0 * 1024.0));
+  }
+  free(packed);
+  return 0;
+}
@@ -0,0 +1,93 @@
+#define _DEFAULT_SOURCE
+#include "arena.h"
+#include <stdlib.h>
+#ifdef __linux__
+    #include <sys/mman.h>
+#endif
+
+#define ARENA_HEADER_SIZE                                                      \
+  ((sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Large blocks are aligned for transparent huge pages, so a big manifest
+// takes a few page faults instead of one for every 4 KiB it fills
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+static arena_block_t *arena_new_block(size_t size) {
+  arena_block_t *block = NULL;
+#ifdef __linux__
+  if (size >= ARENA_HUGE_PAGE) {
+    size_t total = (ARENA_HEADER_SIZE + size + ARENA_HUGE_PAGE - 1) &
+                   ~(size_t)(ARENA_HUGE_PAGE - 1);
+    if (posix_memalign((void **)&block, ARENA_HUGE_PAGE, total) == 0) {
+      madvise(block, total, MADV_HUGEPAGE);
+    }
+  }
+#endif
+  if (!block) {
+    block = malloc(ARENA_HEADER_SIZE + size);
+  }
+  if (!block) {
+    return NULL;
+  }
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+int arena_init(arena_t *arena, size_t initial_size) {
+  arena->allocated = 0;
+  arena->head = arena_new_block(
+      (initial_size < ARENA_MIN_BLOCK) ? ARENA_MIN_BLOCK : initial_size);
+  return arena->head ? 0 : -1;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  arena_block_t *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    size_t block_size = block ? block->size * 2 : ARENA_MIN_BLOCK;
+    if (block_size < size) {
+      block_size = size;
+    }
+    arena_block_t *next = arena_new_block(block_size);
+    if (!next) {
+      return NULL;
+    }
+    next->next = block;
+    arena->head = next;
+    block = next;
+  }
+  void *ptr = (uint8_t *)block + ARENA_HEADER_SIZE + block->used;
+  block->used += size;
+  arena->allocated += size;
+  return ptr;
+}
+
+void arena_free(arena_t *arena) {
+  arena_block_t *block = arena->head;
+  while (block) {
+    arena_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+  arena->allocated = 0;
+}
+
+static void *protobuf_arena_alloc(void *allocator_data, size_t size) {
+  return arena_alloc((arena_t *)allocator_data, size);
+}
+
+static void protobuf_arena_free(void *allocator_data, void *pointer) {
+  (void)allocator_data;
+  (void)pointer;
+}
+
+ProtobufCAllocator arena_protobuf_allocator(arena_t *arena) {
+  ProtobufCAllocator allocator;
+  allocator.alloc = protobuf_arena_alloc;
+  allocator.free = protobuf_arena_free;
+  allocator.allocator_data = arena;
+  return allocator;
+}
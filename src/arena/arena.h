@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <protobuf-c/protobuf-c.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK (64 * 1024)
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+} arena_block_t;
+
+// Bump allocator for data that is all released at once, such as an
+// unpacked manifest. Allocations come from the current block, and a new
+// block at least twice the size is chained on when it runs out, so a
+// well-sized first block serves everything with one malloc.
+typedef struct {
+  arena_block_t *head;
+  size_t allocated; // Bytes handed out, over all blocks
+} arena_t;
+
+int arena_init(arena_t *arena, size_t initial_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_free(arena_t *arena);
+
+// A protobuf-c allocator over the arena. Its free does nothing: everything
+// unpacked through it goes away with arena_free instead of free_unpacked.
+ProtobufCAllocator arena_protobuf_allocator(arena_t *arena);
+
+#endif
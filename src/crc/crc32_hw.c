@@ -0,0 +1,234 @@
+#include "crc32_hw.h"
+#include <string.h>
+#include <zlib.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__))
+    #define CRC32_HW_PCLMUL
+    #include <immintrin.h>
+#endif
+#if defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+    #define CRC32_HW_ARMV8
+    #include <arm_acle.h>
+    #ifdef __linux__
+        #include <sys/auxv.h>
+        #ifndef HWCAP_CRC32
+            #define HWCAP_CRC32 (1 << 7)
+        #endif
+    #endif
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+static uint32_t crc32_zlib(uint32_t crc, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    uInt chunk = (size > (1u << 30)) ? (1u << 30) : (uInt)size;
+    crc = (uint32_t)crc32(crc, data, chunk);
+    data += chunk;
+    size -= chunk;
+  }
+  return crc;
+}
+
+#ifdef CRC32_HW_PCLMUL
+static int have_pclmul(void) {
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+// Folds four 128-bit lanes at a time, then down to one lane and finally
+// to 32 bits with a Barrett reduction, as described in Intel's "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction". `size`
+// must be a multiple of 16 and at least 64. Works on the uninverted CRC.
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_fold(uint32_t crc, const uint8_t *data, size_t size) {
+  static const uint64_t k1k2[2] __attribute__((aligned(16))) = {
+      0x0154442bd4, 0x01c6e41596};
+  static const uint64_t k3k4[2] __attribute__((aligned(16))) = {
+      0x01751997d0, 0x00ccaa009e};
+  static const uint64_t k5k0[2] __attribute__((aligned(16))) = {
+      0x0163cd6124, 0x0000000000};
+  static const uint64_t poly[2] __attribute__((aligned(16))) = {
+      0x01db710641, 0x01f7011641};
+
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  __m128i k = _mm_load_si128((const __m128i *)k1k2);
+  data += 64;
+  size -= 64;
+
+  while (size >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i *)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i *)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i *)(data + 0x30)));
+    data += 64;
+    size -= 64;
+  }
+
+  // Fold the four lanes into one
+  k = _mm_load_si128((const __m128i *)k3k4);
+  __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (size >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)),
+                       x5);
+    data += 16;
+    size -= 16;
+  }
+
+  // 128 bits to 64
+  __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  k = _mm_loadl_epi64((const __m128i *)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  k = _mm_load_si128((const __m128i *)poly);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t size) {
+  if (size >= 64) {
+    size_t folded = size & ~(size_t)15;
+    crc = ~crc32_fold(~crc, data, folded);
+    data += folded;
+    size -= folded;
+  }
+  return crc32_zlib(crc, data, size);
+}
+#endif
+
+#ifdef CRC32_HW_ARMV8
+static int have_armv8_crc(void) {
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+  return 1;
+#elif defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+  return 0;
+#endif
+}
+
+#ifdef __clang__
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *data, size_t size) {
+  crc = ~crc;
+  while (size > 0 && ((uintptr_t)data & 7) != 0) {
+    crc = __crc32b(crc, *data++);
+    size--;
+  }
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = __crc32d(crc, word);
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    crc = __crc32b(crc, *data++);
+    size--;
+  }
+  return ~crc;
+}
+#endif
+
+uint32_t crc32_hw(uint32_t crc, const uint8_t *data, size_t size) {
+#ifdef CRC32_HW_PCLMUL
+  if (have_pclmul()) {
+    return crc32_pclmul(crc, data, size);
+  }
+#endif
+#ifdef CRC32_HW_ARMV8
+  if (have_armv8_crc()) {
+    return crc32_armv8(crc, data, size);
+  }
+#endif
+  return crc32_zlib(crc, data, size);
+}
+
+const char *crc32_hw_name(void) {
+#ifdef CRC32_HW_PCLMUL
+  if (have_pclmul()) {
+    return "PCLMULQDQ";
+  }
+#endif
+#ifdef CRC32_HW_ARMV8
+  if (have_armv8_crc()) {
+    return "ARMv8 CRC32";
+  }
+#endif
+  return "zlib";
+}
+
+// a * b modulo the CRC polynomial, with bit 31 holding x^0
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1u << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+  }
+  return p;
+}
+
+// x^(2^n) modulo the CRC polynomial
+static const uint32_t x2n_table[32] = {
+    0x40000000, 0x20000000, 0x08000000, 0x00800000,
+    0x00008000, 0xedb88320, 0xb1e6b092, 0xa06a2517,
+    0xed627dae, 0x88d14467, 0xd7bbfe6a, 0xec447f11,
+    0x8e7ea170, 0x6427800e, 0x4d47bae0, 0x09fe548f,
+    0x83852d0f, 0x30362f1a, 0x7b5a9cc3, 0x31fec169,
+    0x9fec022a, 0x6c8dedc4, 0x15d6874d, 0x5fde7a4e,
+    0xbad90e37, 0x2e4e5eef, 0x4eaba214, 0xa8a472c0,
+    0x429a969e, 0x148d302a, 0xc40ba6d0, 0xc4e22c3c};
+
+uint32_t crc32_hw_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  // Shifting crc1 past len2 bytes multiplies it by x^(8 * len2)
+  uint32_t p = 1u << 31;
+  for (unsigned k = 3; len2 > 0; len2 >>= 1, k++) {
+    if (len2 & 1) {
+      p = multmodp(x2n_table[k & 31], p);
+    }
+  }
+  return multmodp(p, crc1) ^ crc2;
+}
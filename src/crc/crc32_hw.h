@@ -0,0 +1,19 @@
+#ifndef CRC32_HW_H
+#define CRC32_HW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as used by ZIP (reflected, polynomial 0xEDB88320). Uses carry-less
+// multiplication on x86 CPUs with PCLMULQDQ and the CRC32 instructions on
+// ARMv8 CPUs that have them, picked at run time, and zlib otherwise.
+uint32_t crc32_hw(uint32_t crc, const uint8_t *data, size_t size);
+
+// CRC-32 of two consecutive pieces of data, given the CRC-32 of each and
+// the length of the second
+uint32_t crc32_hw_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// Name of the implementation crc32_hw uses on this CPU
+const char *crc32_hw_name(void);
+
+#endif
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#include "follow_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #define strdup _strdup
+#else
+    #include <unistd.h>
+#endif
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/inotify.h>
+#endif
+
+#define EOCD_MIN_SIZE 22
+#define EOCD_MAX_COMMENT 65535
+
+static uint64_t file_size_now(const follow_reader_t *reader) {
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64(reader->path, &st) != 0) {
+    return 0;
+  }
+#else
+  struct stat st;
+  if (stat(reader->path, &st) != 0) {
+    return 0;
+  }
+#endif
+  return (uint64_t)st.st_size;
+}
+
+// Sleeps until the file is modified, or for a short while when change
+// notifications are not available.
+static void wait_for_change(follow_reader_t *reader) {
+#ifdef __linux__
+  if (reader->inotify_fd >= 0) {
+    struct pollfd pfd = {reader->inotify_fd, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) > 0) {
+      char events[4096];
+      while (read(reader->inotify_fd, events, sizeof(events)) > 0) {
+      }
+    }
+    return;
+  }
+#endif
+#ifdef _WIN32
+  Sleep(FOLLOW_POLL_MS);
+#else
+  usleep(FOLLOW_POLL_MS * 1000);
+#endif
+}
+
+// Waits until the file holds at least `end` bytes. Fails if the writer
+// makes no progress for FOLLOW_STALL_TIMEOUT seconds.
+static int wait_for_data(follow_reader_t *reader, uint64_t end) {
+  if (reader->expected_size > 0 && end > reader->expected_size) {
+    end = reader->expected_size;
+  }
+
+  time_t last_growth = time(NULL);
+  while (reader->available < end) {
+    uint64_t size = file_size_now(reader);
+    if (size > reader->available) {
+      reader->available = size;
+      last_growth = time(NULL);
+      continue;
+    }
+    if (time(NULL) - last_growth > FOLLOW_STALL_TIMEOUT) {
+      fprintf(stderr, "- Error: %s stopped growing at %llu bytes\n",
+              reader->path, (unsigned long long)reader->available);
+      return -1;
+    }
+    wait_for_change(reader);
+  }
+  return 0;
+}
+
+static int file_seek(FILE *file, uint64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+  return fseek(file, (long)offset, SEEK_SET);
+#endif
+}
+
+// Looks for an end-of-central-directory record that ends exactly at the
+// current end of the file, which means the writer is done.
+static int tail_is_complete(follow_reader_t *reader) {
+  uint64_t size = reader->available;
+  if (size < EOCD_MIN_SIZE) {
+    return 0;
+  }
+
+  size_t window = EOCD_MIN_SIZE + EOCD_MAX_COMMENT;
+  if (window > size) {
+    window = (size_t)size;
+  }
+  uint8_t *buffer = malloc(window);
+  if (!buffer) {
+    return 0;
+  }
+
+  int complete = 0;
+  if (file_seek(reader->file, size - window) == 0 &&
+      fread(buffer, 1, window, reader->file) == window) {
+    for (size_t i = window - EOCD_MIN_SIZE + 1; i-- > 0;) {
+      if (buffer[i] == 0x50 && buffer[i + 1] == 0x4B && buffer[i + 2] == 0x05 &&
+          buffer[i + 3] == 0x06) {
+        size_t comment_len = buffer[i + 20] | (buffer[i + 21] << 8);
+        if (i + EOCD_MIN_SIZE + comment_len == window) {
+          complete = 1;
+          break;
+        }
+      }
+    }
+  }
+  free(buffer);
+  return complete;
+}
+
+int follow_reader_init(follow_reader_t *reader, const char *path,
+                       uint64_t expected_size) {
+  memset(reader, 0, sizeof(follow_reader_t));
+  reader->inotify_fd = -1;
+  reader->expected_size = expected_size;
+
+  reader->path = strdup(path);
+  if (!reader->path) {
+    return -1;
+  }
+
+  // The writer may not have created the file yet
+  time_t start = time(NULL);
+  while (!(reader->file = fopen(path, "rb"))) {
+    if (time(NULL) - start > FOLLOW_STALL_TIMEOUT) {
+      follow_reader_cleanup(reader);
+      return -1;
+    }
+#ifdef _WIN32
+    Sleep(FOLLOW_POLL_MS);
+#else
+    usleep(FOLLOW_POLL_MS * 1000);
+#endif
+  }
+
+#ifdef __linux__
+  reader->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (reader->inotify_fd >= 0 &&
+      inotify_add_watch(reader->inotify_fd, path,
+                        IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+    close(reader->inotify_fd);
+    reader->inotify_fd = -1;
+  }
+#endif
+
+  reader->available = file_size_now(reader);
+  return 0;
+}
+
+void follow_reader_cleanup(follow_reader_t *reader) {
+  if (reader->file) {
+    fclose(reader->file);
+    reader->file = NULL;
+  }
+#ifdef __linux__
+  if (reader->inotify_fd >= 0) {
+    close(reader->inotify_fd);
+    reader->inotify_fd = -1;
+  }
+#endif
+  free(reader->path);
+  reader->path = NULL;
+}
+
+int follow_reader_seek(follow_reader_t *reader, uint64_t offset) {
+  reader->current_pos = offset;
+  return 0;
+}
+
+int follow_reader_read_at(follow_reader_t *reader, uint64_t offset,
+                          uint8_t *buffer, size_t size, size_t *bytes_read) {
+  *bytes_read = 0;
+  if (wait_for_data(reader, offset + size) != 0) {
+    return -1;
+  }
+  if (offset >= reader->available) {
+    return 0;
+  }
+
+  uint64_t remaining = reader->available - offset;
+  size_t to_read = (size < remaining) ? size : (size_t)remaining;
+  // Seeking also drops stdio's idea of where the file ended
+  if (file_seek(reader->file, offset) != 0) {
+    return -1;
+  }
+  *bytes_read = fread(buffer, 1, to_read, reader->file);
+  return (*bytes_read == to_read) ? 0 : -1;
+}
+
+int follow_reader_read(follow_reader_t *reader, uint8_t *buffer, size_t size,
+                       size_t *bytes_read) {
+  int result = follow_reader_read_at(reader, reader->current_pos, buffer, size,
+                                     bytes_read);
+  if (result == 0) {
+    reader->current_pos += *bytes_read;
+  }
+  return result;
+}
+
+// Without a given size, waits for the writer to reach the end of the ZIP.
+// A file that stops growing without one is taken as complete.
+uint64_t follow_reader_get_size(follow_reader_t *reader) {
+  time_t last_growth = time(NULL);
+  while (reader->expected_size == 0) {
+    uint64_t size = file_size_now(reader);
+    if (size > reader->available) {
+      reader->available = size;
+      last_growth = time(NULL);
+    }
+    if (tail_is_complete(reader) ||
+        time(NULL) - last_growth > FOLLOW_STALL_TIMEOUT) {
+      reader->expected_size = reader->available;
+      break;
+    }
+    wait_for_change(reader);
+  }
+  return reader->expected_size;
+}
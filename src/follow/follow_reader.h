@@ -0,0 +1,34 @@
+#ifndef FOLLOW_READER_H
+#define FOLLOW_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define FOLLOW_POLL_MS 200
+#define FOLLOW_STALL_TIMEOUT 300
+
+// Reads a file that another process is still writing. Reads past the
+// current end of the file wait until the data shows up. The final size is
+// either given up front or taken from the ZIP end-of-central-directory
+// record once the writer has got that far.
+typedef struct {
+  char *path;
+  FILE *file;
+  uint64_t expected_size;
+  uint64_t available;
+  uint64_t current_pos;
+  int inotify_fd;
+} follow_reader_t;
+
+int follow_reader_init(follow_reader_t *reader, const char *path,
+                       uint64_t expected_size);
+void follow_reader_cleanup(follow_reader_t *reader);
+int follow_reader_seek(follow_reader_t *reader, uint64_t offset);
+int follow_reader_read_at(follow_reader_t *reader, uint64_t offset,
+                          uint8_t *buffer, size_t size, size_t *bytes_read);
+int follow_reader_read(follow_reader_t *reader, uint8_t *buffer, size_t size,
+                       size_t *bytes_read);
+uint64_t follow_reader_get_size(follow_reader_t *reader);
+
+#endif
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include "http_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+    #include <direct.h>
+    #define mkdir(path, mode) _mkdir(path)
+    #define strdup _strdup
+#endif
+
+static uint64_t fnv1a_64(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static void put_u16_le(uint8_t *out, uint16_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32_le(uint8_t *out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static void put_u64_le(uint8_t *out, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint32_t get_u32_le(const uint8_t *data) {
+  return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+         ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint64_t get_u64_le(const uint8_t *data) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static int cache_seek(FILE *file, uint64_t offset) {
+#ifdef _WIN32
+  return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+  return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t len = strlen(dir) + strlen(name) + 2;
+  char *path = malloc(len);
+  if (path) {
+    snprintf(path, len, "%s/%s", dir, name);
+  }
+  return path;
+}
+
+// Loads an existing map. A map written for a different object (or a
+// different chunk size) is ignored and the cache starts out empty.
+static void load_map(http_cache_t *cache, const char *validator) {
+  FILE *map = fopen(cache->map_path, "rb");
+  if (!map) {
+    return;
+  }
+
+  uint8_t header[22];
+  size_t validator_len = strlen(validator);
+  char *stored = malloc(validator_len + 1);
+  if (stored && fread(header, 1, sizeof(header), map) == sizeof(header) &&
+      memcmp(header, HTTP_CACHE_MAP_MAGIC, 4) == 0 &&
+      get_u32_le(&header[4]) == HTTP_CACHE_MAP_VERSION &&
+      get_u32_le(&header[8]) == HTTP_CACHE_CHUNK_SIZE &&
+      get_u64_le(&header[12]) == cache->content_length &&
+      (size_t)(header[20] | (header[21] << 8)) == validator_len &&
+      fread(stored, 1, validator_len, map) == validator_len &&
+      memcmp(stored, validator, validator_len) == 0) {
+    size_t map_bytes = (size_t)((cache->num_chunks + 7) / 8);
+    if (fread(cache->bitmap, 1, map_bytes, map) != map_bytes) {
+      memset(cache->bitmap, 0, map_bytes);
+    }
+  }
+  free(stored);
+  fclose(map);
+
+  for (uint64_t i = 0; i < cache->num_chunks; i++) {
+    if (http_cache_has_chunk(cache, i)) {
+      cache->chunks_present++;
+    }
+  }
+}
+
+// Opens the data and map files once their paths are set.
+static int open_paths(http_cache_t *cache, const char *validator,
+                      uint64_t content_length) {
+  cache->content_length = content_length;
+  cache->num_chunks =
+      (content_length + HTTP_CACHE_CHUNK_SIZE - 1) / HTTP_CACHE_CHUNK_SIZE;
+  cache->bitmap = calloc(1, (size_t)((cache->num_chunks + 7) / 8) + 1);
+
+  if (!cache->data_path || !cache->map_path || !cache->bitmap) {
+    http_cache_close(cache);
+    return -1;
+  }
+
+  load_map(cache, validator);
+
+  // Without a usable map the data file is started over, which also drops
+  // whatever an unrelated file at that path contained
+  if (cache->chunks_present > 0) {
+    cache->data_file = fopen(cache->data_path, "r+b");
+  }
+  if (!cache->data_file) {
+    cache->data_file = fopen(cache->data_path, "w+b");
+    memset(cache->bitmap, 0, (size_t)((cache->num_chunks + 7) / 8));
+    cache->chunks_present = 0;
+  }
+  if (!cache->data_file) {
+    http_cache_close(cache);
+    return -1;
+  }
+
+  // Keep the validator in the map header so that a stale map is detected
+  // even when the key happens to collide.
+  cache->map_file = fopen(cache->map_path, "r+b");
+  if (!cache->map_file) {
+    cache->map_file = fopen(cache->map_path, "w+b");
+  }
+  if (!cache->map_file) {
+    http_cache_close(cache);
+    return -1;
+  }
+  uint8_t header[22];
+  memcpy(header, HTTP_CACHE_MAP_MAGIC, 4);
+  put_u32_le(&header[4], HTTP_CACHE_MAP_VERSION);
+  put_u32_le(&header[8], HTTP_CACHE_CHUNK_SIZE);
+  put_u64_le(&header[12], content_length);
+  put_u16_le(&header[20], (uint16_t)strlen(validator));
+  fwrite(header, 1, sizeof(header), cache->map_file);
+  fwrite(validator, 1, strlen(validator), cache->map_file);
+  cache->bitmap_pos = sizeof(header) + strlen(validator);
+
+  return http_cache_flush(cache);
+}
+
+int http_cache_open(http_cache_t *cache, const char *cache_dir,
+                    const char *url, const char *validator,
+                    uint64_t content_length) {
+  memset(cache, 0, sizeof(http_cache_t));
+  if (!validator) {
+    validator = "";
+  }
+  if (strlen(validator) > 0xFFFF) {
+    return -1;
+  }
+
+  char length_str[32];
+  snprintf(length_str, sizeof(length_str), "%llu",
+           (unsigned long long)content_length);
+
+  uint64_t key = 0xCBF29CE484222325ULL;
+  key = fnv1a_64(key, url, strlen(url));
+  key = fnv1a_64(key, "\n", 1);
+  key = fnv1a_64(key, validator, strlen(validator));
+  key = fnv1a_64(key, "\n", 1);
+  key = fnv1a_64(key, length_str, strlen(length_str));
+
+  char name[64];
+  mkdir(cache_dir, 0755);
+
+  snprintf(name, sizeof(name), "%016llx.data", (unsigned long long)key);
+  cache->data_path = join_path(cache_dir, name);
+  snprintf(name, sizeof(name), "%016llx.map", (unsigned long long)key);
+  cache->map_path = join_path(cache_dir, name);
+
+  return open_paths(cache, validator, content_length);
+}
+
+// Uses `path` itself as the data file, with the map next to it as
+// `<path>.map`. Once every chunk is present the data file is a complete
+// copy of the remote object.
+int http_cache_open_file(http_cache_t *cache, const char *path,
+                         const char *validator, uint64_t content_length) {
+  memset(cache, 0, sizeof(http_cache_t));
+  if (!validator) {
+    validator = "";
+  }
+  if (strlen(validator) > 0xFFFF) {
+    return -1;
+  }
+
+  size_t len = strlen(path) + sizeof(".map");
+  cache->data_path = strdup(path);
+  cache->map_path = malloc(len);
+  if (cache->map_path) {
+    snprintf(cache->map_path, len, "%s.map", path);
+  }
+
+  return open_paths(cache, validator, content_length);
+}
+
+void http_cache_close(http_cache_t *cache) {
+  if (cache->data_file && cache->map_file) {
+    http_cache_flush(cache);
+  }
+  if (cache->data_file) {
+    fclose(cache->data_file);
+    cache->data_file = NULL;
+  }
+  if (cache->map_file) {
+    fclose(cache->map_file);
+    cache->map_file = NULL;
+  }
+  free(cache->data_path);
+  free(cache->map_path);
+  free(cache->bitmap);
+  cache->data_path = NULL;
+  cache->map_path = NULL;
+  cache->bitmap = NULL;
+}
+
+int http_cache_complete(const http_cache_t *cache) {
+  return cache->chunks_present == cache->num_chunks;
+}
+
+// Drops the map once it is no longer needed, e.g. after a saved copy is
+// complete. The cache must not be stored to afterwards.
+void http_cache_remove_map(http_cache_t *cache) {
+  if (cache->map_file) {
+    fclose(cache->map_file);
+    cache->map_file = NULL;
+  }
+  if (cache->map_path) {
+    remove(cache->map_path);
+  }
+}
+
+int http_cache_has_chunk(const http_cache_t *cache, uint64_t chunk) {
+  if (chunk >= cache->num_chunks) {
+    return 0;
+  }
+  return (cache->bitmap[chunk / 8] >> (chunk % 8)) & 1;
+}
+
+// Finds the first run of missing chunks overlapping [offset, end). The gap
+// is returned chunk-aligned and clamped to the object size, so that it can
+// be fetched with a single range request and stored as whole chunks.
+int http_cache_next_gap(const http_cache_t *cache, uint64_t offset,
+                        uint64_t end, uint64_t *gap_start, uint64_t *gap_end) {
+  if (end > cache->content_length) {
+    end = cache->content_length;
+  }
+  if (offset >= end) {
+    return -1;
+  }
+
+  uint64_t first = offset / HTTP_CACHE_CHUNK_SIZE;
+  uint64_t last = (end - 1) / HTTP_CACHE_CHUNK_SIZE;
+
+  uint64_t chunk = first;
+  while (chunk <= last && http_cache_has_chunk(cache, chunk)) {
+    chunk++;
+  }
+  if (chunk > last) {
+    return -1;
+  }
+
+  uint64_t run_end = chunk;
+  while (run_end <= last && !http_cache_has_chunk(cache, run_end)) {
+    run_end++;
+  }
+
+  *gap_start = chunk * HTTP_CACHE_CHUNK_SIZE;
+  *gap_end = run_end * HTTP_CACHE_CHUNK_SIZE;
+  if (*gap_end > cache->content_length) {
+    *gap_end = cache->content_length;
+  }
+  return 0;
+}
+
+int http_cache_store(http_cache_t *cache, uint64_t offset, const uint8_t *data,
+                     size_t size) {
+  if (cache_seek(cache->data_file, offset) != 0 ||
+      fwrite(data, 1, size, cache->data_file) != size ||
+      fflush(cache->data_file) != 0) {
+    return -1;
+  }
+
+  // Only chunks covered completely are marked; the last chunk of the object
+  // counts as complete once the data reaches the end of the object.
+  uint64_t end = offset + size;
+  uint64_t chunk = (offset + HTTP_CACHE_CHUNK_SIZE - 1) / HTTP_CACHE_CHUNK_SIZE;
+  uint64_t first_marked = cache->num_chunks;
+  uint64_t last_marked = 0;
+  for (; chunk < cache->num_chunks; chunk++) {
+    uint64_t chunk_end = (chunk + 1) * HTTP_CACHE_CHUNK_SIZE;
+    if (chunk_end > cache->content_length) {
+      chunk_end = cache->content_length;
+    }
+    if (chunk_end > end) {
+      break;
+    }
+    if (!http_cache_has_chunk(cache, chunk)) {
+      cache->bitmap[chunk / 8] |= (uint8_t)(1u << (chunk % 8));
+      cache->chunks_present++;
+      if (first_marked == cache->num_chunks) {
+        first_marked = chunk;
+      }
+      last_marked = chunk;
+    }
+  }
+  if (first_marked == cache->num_chunks || !cache->map_file) {
+    return 0;
+  }
+
+  // Only the bitmap bytes that changed are written
+  size_t first_byte = (size_t)(first_marked / 8);
+  size_t num_bytes = (size_t)(last_marked / 8) - first_byte + 1;
+  if (cache_seek(cache->map_file, cache->bitmap_pos + first_byte) != 0 ||
+      fwrite(&cache->bitmap[first_byte], 1, num_bytes, cache->map_file) !=
+          num_bytes ||
+      fflush(cache->map_file) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int http_cache_read(http_cache_t *cache, uint64_t offset, uint8_t *buffer,
+                    size_t size) {
+  if (cache_seek(cache->data_file, offset) != 0 ||
+      fread(buffer, 1, size, cache->data_file) != size) {
+    return -1;
+  }
+  return 0;
+}
+
+// Rewrites the whole bitmap in place. Stores write just the bytes they
+// change, after flushing the data, so a crash can lose chunks from the map
+// but never mark unwritten chunks as present.
+int http_cache_flush(http_cache_t *cache) {
+  if (!cache->map_file) {
+    return -1;
+  }
+  size_t map_bytes = (size_t)((cache->num_chunks + 7) / 8);
+  if (cache_seek(cache->map_file, cache->bitmap_pos) != 0 ||
+      fwrite(cache->bitmap, 1, map_bytes, cache->map_file) != map_bytes ||
+      fflush(cache->map_file) != 0) {
+    return -1;
+  }
+  return 0;
+}
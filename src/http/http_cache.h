@@ -0,0 +1,44 @@
+#ifndef HTTP_CACHE_H
+#define HTTP_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HTTP_CACHE_CHUNK_SIZE (64 * 1024)
+#define HTTP_CACHE_MAP_MAGIC "PDRC"
+#define HTTP_CACHE_MAP_VERSION 1
+
+// Sparse on-disk copy of a remote object. The data file holds fetched bytes
+// at their original offsets, the map file records which chunks are valid.
+// Both stay open while the cache is in use.
+typedef struct {
+  FILE *data_file;
+  FILE *map_file;
+  uint64_t bitmap_pos; // Offset of the bitmap in the map file
+  char *data_path;
+  char *map_path;
+  uint8_t *bitmap;
+  uint64_t num_chunks;
+  uint64_t chunks_present;
+  uint64_t content_length;
+} http_cache_t;
+
+int http_cache_open(http_cache_t *cache, const char *cache_dir,
+                    const char *url, const char *validator,
+                    uint64_t content_length);
+int http_cache_open_file(http_cache_t *cache, const char *path,
+                         const char *validator, uint64_t content_length);
+void http_cache_close(http_cache_t *cache);
+int http_cache_complete(const http_cache_t *cache);
+void http_cache_remove_map(http_cache_t *cache);
+int http_cache_has_chunk(const http_cache_t *cache, uint64_t chunk);
+int http_cache_next_gap(const http_cache_t *cache, uint64_t offset,
+                        uint64_t end, uint64_t *gap_start, uint64_t *gap_end);
+int http_cache_store(http_cache_t *cache, uint64_t offset, const uint8_t *data,
+                     size_t size);
+int http_cache_read(http_cache_t *cache, uint64_t offset, uint8_t *buffer,
+                    size_t size);
+int http_cache_flush(http_cache_t *cache);
+
+#endif
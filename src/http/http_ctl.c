@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#define _DEFAULT_SOURCE
+#include "http_ctl.h"
+#include "units.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+    #include <signal.h>
+    #include <unistd.h>
+#endif
+#ifdef _WIN32
+    #define strdup _strdup
+#endif
+
+static http_ctl_t g_ctl;
+static int g_ctl_initialized = 0;
+#ifndef _WIN32
+static volatile sig_atomic_t g_rate_file_changed = 0;
+#endif
+
+void http_mutex_init(http_mutex_t *mutex) {
+#ifdef _WIN32
+  InitializeCriticalSection(mutex);
+#else
+  pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void http_mutex_destroy(http_mutex_t *mutex) {
+#ifdef _WIN32
+  DeleteCriticalSection(mutex);
+#else
+  pthread_mutex_destroy(mutex);
+#endif
+}
+
+void http_mutex_lock(http_mutex_t *mutex) {
+#ifdef _WIN32
+  EnterCriticalSection(mutex);
+#else
+  pthread_mutex_lock(mutex);
+#endif
+}
+
+void http_mutex_unlock(http_mutex_t *mutex) {
+#ifdef _WIN32
+  LeaveCriticalSection(mutex);
+#else
+  pthread_mutex_unlock(mutex);
+#endif
+}
+
+void http_cond_init(http_cond_t *cond) {
+#ifdef _WIN32
+  InitializeConditionVariable(cond);
+#else
+  pthread_cond_init(cond, NULL);
+#endif
+}
+
+void http_cond_destroy(http_cond_t *cond) {
+#ifdef _WIN32
+  (void)cond;
+#else
+  pthread_cond_destroy(cond);
+#endif
+}
+
+void http_cond_wait(http_cond_t *cond, http_mutex_t *mutex) {
+#ifdef _WIN32
+  SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+  pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void http_cond_broadcast(http_cond_t *cond) {
+#ifdef _WIN32
+  WakeAllConditionVariable(cond);
+#else
+  pthread_cond_broadcast(cond);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI http_thread_wrapper(LPVOID arg) {
+  void *(*start_routine)(void *) = (void *(*)(void *))((void **)arg)[0];
+  void *thread_arg = ((void **)arg)[1];
+  free(arg);
+  start_routine(thread_arg);
+  return 0;
+}
+#endif
+
+int http_thread_create(http_thread_t *thread, void *(*start_routine)(void *),
+                       void *arg) {
+#ifdef _WIN32
+  void **wrapper_args = malloc(2 * sizeof(void *));
+  if (!wrapper_args) {
+    return -1;
+  }
+  wrapper_args[0] = (void *)start_routine;
+  wrapper_args[1] = arg;
+  *thread = CreateThread(NULL, 0, http_thread_wrapper, wrapper_args, 0, NULL);
+  if (*thread == NULL) {
+    free(wrapper_args);
+    return -1;
+  }
+  return 0;
+#else
+  return pthread_create(thread, NULL, start_routine, arg);
+#endif
+}
+
+void http_thread_join(http_thread_t thread) {
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+double http_now(void) {
+#ifdef _WIN32
+  return (double)GetTickCount64() / 1000.0;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+void http_sleep_ms(unsigned int ms) {
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+#endif
+}
+
+// The controller must exist before worker threads start; http_reader_init
+// calls this from the main thread.
+http_ctl_t *http_ctl_get(void) {
+  if (!g_ctl_initialized) {
+    http_mutex_init(&g_ctl.lock);
+    http_cond_init(&g_ctl.slot_free);
+    g_ctl.window = HTTP_INITIAL_INFLIGHT;
+    g_ctl.in_flight = 0;
+    g_ctl.range_size = HTTP_INITIAL_RANGE_SIZE;
+    g_ctl.last_decrease = 0.0;
+    g_ctl.latency_ewma = 0.0;
+    g_ctl.throughput_ewma = 0.0;
+    g_ctl.rng_state = (uint64_t)time(NULL) ^ 0x9E3779B97F4A7C15ULL;
+    g_ctl_initialized = 1;
+  }
+  return &g_ctl;
+}
+
+void http_ctl_acquire(http_ctl_t *ctl) {
+  http_mutex_lock(&ctl->lock);
+  while (ctl->in_flight >= (int)ctl->window) {
+    http_cond_wait(&ctl->slot_free, &ctl->lock);
+  }
+  ctl->in_flight++;
+  ctl->requests++;
+  http_mutex_unlock(&ctl->lock);
+}
+
+int http_ctl_try_acquire(http_ctl_t *ctl) {
+  http_mutex_lock(&ctl->lock);
+  int acquired = (ctl->in_flight < (int)ctl->window);
+  if (acquired) {
+    ctl->in_flight++;
+    ctl->requests++;
+  }
+  http_mutex_unlock(&ctl->lock);
+  return acquired;
+}
+
+int http_ctl_idle(http_ctl_t *ctl) {
+  http_mutex_lock(&ctl->lock);
+  int idle = (ctl->in_flight == 0);
+  http_mutex_unlock(&ctl->lock);
+  return idle;
+}
+
+void http_ctl_release(http_ctl_t *ctl, http_result_t result, size_t bytes,
+                      double ttfb, double seconds) {
+  http_mutex_lock(&ctl->lock);
+  ctl->in_flight--;
+
+  if (result == HTTP_RESULT_OK) {
+    ctl->latency_ewma = (ctl->latency_ewma == 0.0)
+                            ? ttfb
+                            : 0.8 * ctl->latency_ewma + 0.2 * ttfb;
+    if (seconds > 0.0) {
+      double throughput = (double)bytes / seconds;
+      ctl->throughput_ewma = (ctl->throughput_ewma == 0.0)
+                                 ? throughput
+                                 : 0.8 * ctl->throughput_ewma +
+                                       0.2 * throughput;
+    }
+
+    // Additive increase: one more request per window of successes
+    ctl->window += 1.0 / ctl->window;
+    if (ctl->window > HTTP_MAX_INFLIGHT) {
+      ctl->window = HTTP_MAX_INFLIGHT;
+    }
+
+    // Only full-sized requests say anything about larger ranges. Grow while
+    // the time to first byte is still a noticeable part of each request.
+    if (bytes >= ctl->range_size && seconds < 4.0 * ttfb + 1.0) {
+      ctl->range_size += HTTP_RANGE_SIZE_STEP;
+      if (ctl->range_size > HTTP_MAX_RANGE_SIZE) {
+        ctl->range_size = HTTP_MAX_RANGE_SIZE;
+      }
+    }
+  } else if (result == HTTP_RESULT_THROTTLED) {
+    ctl->throttled++;
+
+    // Requests that were already in flight when the server started pushing
+    // back fail together; treat them as a single congestion event.
+    double now = http_now();
+    double hold = (ctl->latency_ewma > 0.5) ? ctl->latency_ewma : 0.5;
+    if (now - ctl->last_decrease > hold) {
+      ctl->window /= 2.0;
+      if (ctl->window < 1.0) {
+        ctl->window = 1.0;
+      }
+      ctl->range_size /= 2;
+      if (ctl->range_size < HTTP_MIN_RANGE_SIZE) {
+        ctl->range_size = HTTP_MIN_RANGE_SIZE;
+      }
+      ctl->last_decrease = now;
+    }
+  }
+
+  http_cond_broadcast(&ctl->slot_free);
+  http_mutex_unlock(&ctl->lock);
+}
+
+size_t http_ctl_range_size(http_ctl_t *ctl) {
+  http_mutex_lock(&ctl->lock);
+  size_t range_size = ctl->range_size;
+  http_mutex_unlock(&ctl->lock);
+  return range_size;
+}
+
+// Counts connections that had to be opened (rather than reused) and the
+// time spent connecting and in the TLS handshake.
+void http_ctl_add_connections(http_ctl_t *ctl, long count, double seconds) {
+  if (count <= 0) {
+    return;
+  }
+  http_mutex_lock(&ctl->lock);
+  ctl->connections += (uint64_t)count;
+  ctl->connect_seconds += seconds;
+  http_mutex_unlock(&ctl->lock);
+}
+
+// Exponential backoff with jitter in [cap/2, cap], so that requests which
+// failed together do not retry together. A Retry-After from the server is
+// used as the lower bound.
+unsigned int http_ctl_backoff_ms(http_ctl_t *ctl, int attempt,
+                                 long retry_after) {
+  unsigned int cap = HTTP_BACKOFF_BASE_MS;
+  for (int i = 0; i < attempt && cap < HTTP_BACKOFF_MAX_MS; i++) {
+    cap *= 2;
+  }
+  if (cap > HTTP_BACKOFF_MAX_MS) {
+    cap = HTTP_BACKOFF_MAX_MS;
+  }
+
+  http_mutex_lock(&ctl->lock);
+  ctl->rng_state ^= ctl->rng_state << 13;
+  ctl->rng_state ^= ctl->rng_state >> 7;
+  ctl->rng_state ^= ctl->rng_state << 17;
+  uint64_t random = ctl->rng_state;
+  http_mutex_unlock(&ctl->lock);
+
+  unsigned int delay = cap / 2 + (unsigned int)(random % (cap / 2 + 1));
+  if (retry_after > 0 && (unsigned long)retry_after * 1000UL > delay) {
+    delay = (retry_after > HTTP_BACKOFF_MAX_MS / 1000)
+                ? HTTP_BACKOFF_MAX_MS
+                : (unsigned int)retry_after * 1000;
+  }
+  return delay;
+}
+
+// Must be called with the controller lock held.
+static void apply_max_rate(http_ctl_t *ctl, double bytes_per_second) {
+  ctl->max_rate = bytes_per_second;
+  ctl->tokens = 0.0;
+  ctl->last_refill = http_now();
+}
+
+void http_ctl_set_max_rate(http_ctl_t *ctl, double bytes_per_second) {
+  http_mutex_lock(&ctl->lock);
+  apply_max_rate(ctl, bytes_per_second);
+  http_mutex_unlock(&ctl->lock);
+}
+
+// Re-reads the control file. Must be called with the controller lock
+// held. A missing or unreadable file leaves the current rate alone.
+static void read_rate_file(http_ctl_t *ctl) {
+  FILE *file = fopen(ctl->rate_file, "r");
+  if (!file) {
+    return;
+  }
+  // The rate takes the same suffixes as --max-rate; 0 turns the limit off
+  char line[64];
+  if (fgets(line, sizeof(line), file)) {
+    size_t len = strlen(line);
+    while (len > 0 && strchr(" \t\r\n", line[len - 1])) {
+      line[--len] = '\0';
+    }
+    uint64_t rate;
+    if (parse_size(line, &rate) != 0) {
+      fprintf(stderr, "\n- Warning: Ignoring invalid rate in %s\n",
+              ctl->rate_file);
+    } else if ((double)rate != ctl->max_rate) {
+      apply_max_rate(ctl, (double)rate);
+    }
+  }
+  fclose(file);
+}
+
+#ifndef _WIN32
+static void rate_file_signal(int sig) {
+  (void)sig;
+  g_rate_file_changed = 1;
+}
+#endif
+
+// The file holds one rate and is checked every HTTP_RATE_FILE_INTERVAL
+// seconds while data is flowing; SIGHUP makes the next check immediate.
+int http_ctl_set_rate_file(http_ctl_t *ctl, const char *path) {
+  char *copy = strdup(path);
+  if (!copy) {
+    return -1;
+  }
+  http_mutex_lock(&ctl->lock);
+  free(ctl->rate_file);
+  ctl->rate_file = copy;
+  read_rate_file(ctl);
+  ctl->rate_file_checked = http_now();
+  http_mutex_unlock(&ctl->lock);
+#ifndef _WIN32
+  signal(SIGHUP, rate_file_signal);
+#endif
+  return 0;
+}
+
+// Whether transfers may be held back, now or once the rate file sets a
+// limit. Their time spent waiting then says nothing about the server.
+int http_ctl_rate_limited(http_ctl_t *ctl) {
+  http_mutex_lock(&ctl->lock);
+  int limited = ctl->max_rate > 0.0 || ctl->rate_file != NULL;
+  http_mutex_unlock(&ctl->lock);
+  return limited;
+}
+
+// Takes `bytes` from the bucket and sleeps off any debt. Callers are the
+// write callbacks of the transfers, so while the network is held back the
+// threads that already have their data keep decompressing it.
+void http_ctl_throttle(http_ctl_t *ctl, size_t bytes) {
+  http_mutex_lock(&ctl->lock);
+  double now = http_now();
+  if (ctl->rate_file) {
+    int signalled = 0;
+#ifndef _WIN32
+    signalled = g_rate_file_changed;
+    g_rate_file_changed = 0;
+#endif
+    if (signalled || now - ctl->rate_file_checked >= HTTP_RATE_FILE_INTERVAL) {
+      read_rate_file(ctl);
+      ctl->rate_file_checked = now;
+    }
+  }
+  if (ctl->max_rate <= 0.0) {
+    http_mutex_unlock(&ctl->lock);
+    return;
+  }
+
+  double burst = ctl->max_rate * HTTP_RATE_BURST_SECONDS;
+  ctl->tokens += (now - ctl->last_refill) * ctl->max_rate;
+  ctl->last_refill = now;
+  if (ctl->tokens > burst) {
+    ctl->tokens = burst;
+  }
+  ctl->tokens -= (double)bytes;
+  double wait = (ctl->tokens < 0.0) ? -ctl->tokens / ctl->max_rate : 0.0;
+  ctl->throttled_seconds += wait;
+  http_mutex_unlock(&ctl->lock);
+
+  if (wait > 0.0) {
+    http_sleep_ms((unsigned int)(wait * 1000.0) + 1);
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef HTTP_CTL_H
+#define HTTP_CTL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION http_mutex_t;
+typedef CONDITION_VARIABLE http_cond_t;
+typedef HANDLE http_thread_t;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t http_mutex_t;
+typedef pthread_cond_t http_cond_t;
+typedef pthread_t http_thread_t;
+#endif
+
+#define HTTP_MAX_INFLIGHT 16
+#define HTTP_INITIAL_INFLIGHT 4
+#define HTTP_MIN_RANGE_SIZE (256 * 1024)
+#define HTTP_INITIAL_RANGE_SIZE (4 * 1024 * 1024)
+#define HTTP_MAX_RANGE_SIZE (64 * 1024 * 1024)
+#define HTTP_RANGE_SIZE_STEP (1024 * 1024)
+#define HTTP_BACKOFF_BASE_MS 500
+#define HTTP_BACKOFF_MAX_MS 30000
+#define HTTP_RATE_BURST_SECONDS 0.25
+#define HTTP_RATE_FILE_INTERVAL 1.0
+
+typedef enum {
+  HTTP_RESULT_OK,
+  HTTP_RESULT_THROTTLED, // 429/503 or a transport failure: back off
+  HTTP_RESULT_FAILED     // Other errors: retry without shrinking the window
+} http_result_t;
+
+// Process-wide AIMD controller shared by all HTTP transfers. The window is
+// the number of requests allowed in flight; it grows by about one request
+// per round of successful requests and halves on throttling. The range
+// size follows the same rule so that large ranges are only used while the
+// server keeps up with them.
+typedef struct {
+  http_mutex_t lock;
+  http_cond_t slot_free;
+  double window;
+  int in_flight;
+  size_t range_size;
+  double last_decrease;
+  double latency_ewma;
+  double throughput_ewma;
+  uint64_t requests;
+  uint64_t throttled;
+  uint64_t connections;
+  double connect_seconds;
+  uint64_t rng_state;
+  // Token bucket shared by every transfer; a max_rate of 0 means no limit
+  double max_rate;
+  double tokens;
+  double last_refill;
+  double throttled_seconds;
+  char *rate_file;
+  double rate_file_checked;
+} http_ctl_t;
+
+void http_mutex_init(http_mutex_t *mutex);
+void http_mutex_destroy(http_mutex_t *mutex);
+void http_mutex_lock(http_mutex_t *mutex);
+void http_mutex_unlock(http_mutex_t *mutex);
+void http_cond_init(http_cond_t *cond);
+void http_cond_destroy(http_cond_t *cond);
+void http_cond_wait(http_cond_t *cond, http_mutex_t *mutex);
+void http_cond_broadcast(http_cond_t *cond);
+int http_thread_create(http_thread_t *thread, void *(*start_routine)(void *),
+                       void *arg);
+void http_thread_join(http_thread_t thread);
+
+double http_now(void);
+void http_sleep_ms(unsigned int ms);
+
+http_ctl_t *http_ctl_get(void);
+void http_ctl_acquire(http_ctl_t *ctl);
+int http_ctl_try_acquire(http_ctl_t *ctl);
+int http_ctl_idle(http_ctl_t *ctl);
+void http_ctl_release(http_ctl_t *ctl, http_result_t result, size_t bytes,
+                      double ttfb, double seconds);
+size_t http_ctl_range_size(http_ctl_t *ctl);
+void http_ctl_add_connections(http_ctl_t *ctl, long count, double seconds);
+unsigned int http_ctl_backoff_ms(http_ctl_t *ctl, int attempt,
+                                 long retry_after);
+void http_ctl_set_max_rate(http_ctl_t *ctl, double bytes_per_second);
+int http_ctl_set_rate_file(http_ctl_t *ctl, const char *path);
+void http_ctl_throttle(http_ctl_t *ctl, size_t bytes);
+int http_ctl_rate_limited(http_ctl_t *ctl);
+
+#endif
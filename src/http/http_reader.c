@@ -1,17 +1,22 @@
 #define _GNU_SOURCE
 #define _DEFAULT_SOURCE
 #include "http_reader.h"
+#include "units.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#ifdef _WIN32
-    #include <windows.h>
-    #define sleep(seconds) Sleep((seconds) * 1000)
-#else
+#ifndef _WIN32
+    #include <errno.h>
+    #include <signal.h>
     #include <unistd.h>
 #endif
 #ifdef _WIN32
+    #include <fcntl.h>
+    #include <io.h>
     #define strdup _strdup
+    #define strncasecmp _strnicmp
+#else
+    #include <strings.h>
 #endif
 #ifdef _WIN32
     #define PRIu64 "llu"
@@ -22,6 +27,13 @@
 static int g_curl_initialized = 0;
 static int g_size_info_shown = 0;
 static int g_ranges_warning_shown = 0;
+static char *g_cache_dir = NULL;
+static char *g_save_source = NULL;
+static size_t g_stripe_size = HTTP_DEFAULT_STRIPE_SIZE;
+static char *g_mirror_urls[HTTP_MAX_MIRRORS - 1];
+static int g_num_mirror_urls = 0;
+static CURLSH *g_share = NULL;
+static http_mutex_t g_share_locks[CURL_LOCK_DATA_LAST];
 
 size_t http_write_callback(void *contents, size_t size, size_t nmemb,
                            http_response_t *response) {
@@ -48,19 +60,109 @@ size_t http_write_callback(void *contents, size_t size, size_t nmemb,
   return total_size;
 }
 
-char *format_size(uint64_t bytes) {
-  static char buffer[32];
-  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
-  int unit_idx = 0;
-  double size = (double)bytes;
+static char *header_value(const char *line, size_t len, const char *name) {
+  size_t name_len = strlen(name);
+  if (len <= name_len || strncasecmp(line, name, name_len) != 0 ||
+      line[name_len] != ':') {
+    return NULL;
+  }
+
+  const char *start = line + name_len + 1;
+  const char *end = line + len;
+  while (start < end && (*start == ' ' || *start == '\t')) {
+    start++;
+  }
+  while (end > start &&
+         (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) {
+    end--;
+  }
+
+  char *value = malloc((size_t)(end - start) + 1);
+  if (value) {
+    memcpy(value, start, (size_t)(end - start));
+    value[end - start] = '\0';
+  }
+  return value;
+}
+
+size_t http_header_callback(char *buffer, size_t size, size_t nitems,
+                            http_reader_t *reader) {
+  size_t len = size * nitems;
+
+  // A new status line means a redirect was followed; only the validators
+  // of the final response describe the object.
+  if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    free(reader->etag);
+    free(reader->last_modified);
+    reader->etag = NULL;
+    reader->last_modified = NULL;
+    return len;
+  }
+
+  char *value;
+  if ((value = header_value(buffer, len, "ETag")) != NULL) {
+    free(reader->etag);
+    reader->etag = value;
+  } else if ((value = header_value(buffer, len, "Last-Modified")) != NULL) {
+    free(reader->last_modified);
+    reader->last_modified = value;
+  }
+  return len;
+}
+
+void http_set_cache_dir(const char *cache_dir) {
+  free(g_cache_dir);
+  g_cache_dir = cache_dir ? strdup(cache_dir) : NULL;
+}
+
+// Writes into a caller-provided buffer. Anything past its capacity aborts
+// the transfer, which also stops a server that ignored the Range header
+// from sending the whole file.
+size_t http_buffer_write_callback(char *contents, size_t size, size_t nmemb,
+                                  void *userdata) {
+  http_buffer_t *buffer = userdata;
+  size_t total_size = size * nmemb;
+  http_ctl_throttle(http_ctl_get(), total_size);
+
+  if (total_size > buffer->capacity - buffer->size) {
+    size_t fits = buffer->capacity - buffer->size;
+    memcpy(buffer->data + buffer->size, contents, fits);
+    buffer->size += fits;
+    return 0;
+  }
+
+  memcpy(buffer->data + buffer->size, contents, total_size);
+  buffer->size += total_size;
+  return total_size;
+}
+
+void http_set_save_source(const char *path) {
+  free(g_save_source);
+  g_save_source = path ? strdup(path) : NULL;
+}
 
-  while (size >= 1024.0 && unit_idx < 4) {
-    size /= 1024.0;
-    unit_idx++;
+int http_add_mirror(const char *url) {
+  if (g_num_mirror_urls >= HTTP_MAX_MIRRORS - 1) {
+    return -1;
+  }
+  g_mirror_urls[g_num_mirror_urls] = strdup(url);
+  if (!g_mirror_urls[g_num_mirror_urls]) {
+    return -1;
   }
+  g_num_mirror_urls++;
+  return 0;
+}
+
+void http_set_max_rate(uint64_t bytes_per_second) {
+  http_ctl_set_max_rate(http_ctl_get(), (double)bytes_per_second);
+}
+
+int http_set_rate_file(const char *path) {
+  return http_ctl_set_rate_file(http_ctl_get(), path);
+}
 
-  snprintf(buffer, sizeof(buffer), "%.2f %s", size, units[unit_idx]);
-  return buffer;
+void http_set_stripe_size(size_t stripe_size) {
+  g_stripe_size = (stripe_size > 0) ? stripe_size : HTTP_DEFAULT_STRIPE_SIZE;
 }
 
 void http_reader_set_user_agent(http_reader_t *reader, const char *user_agent) {
@@ -70,29 +172,508 @@ void http_reader_set_user_agent(http_reader_t *reader, const char *user_agent) {
   reader->user_agent = user_agent ? strdup(user_agent) : NULL;
 }
 
+static void share_lock(CURL *handle, curl_lock_data data,
+                       curl_lock_access access, void *userptr) {
+  (void)handle;
+  (void)access;
+  (void)userptr;
+  http_mutex_lock(&g_share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+  (void)handle;
+  (void)userptr;
+  http_mutex_unlock(&g_share_locks[data]);
+}
+
+// One share object for every handle in the process, so that new handles
+// and retries reuse resolved addresses, TLS sessions and idle connections
+// instead of starting from scratch. Without it each handle would still
+// work, just with its own DNS lookup and full handshake.
+static void http_share_init(void) {
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    http_mutex_init(&g_share_locks[i]);
+  }
+
+  g_share = curl_share_init();
+  if (!g_share) {
+    return;
+  }
+  curl_share_setopt(g_share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(g_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+}
+
+// Records whether a finished transfer had to open a new connection.
+static void note_connections(http_ctl_t *ctl, CURL *curl) {
+  long connects = 0;
+  curl_off_t connect_us = 0, appconnect_us = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect_us);
+  curl_off_t setup_us = (appconnect_us > connect_us) ? appconnect_us
+                                                     : connect_us;
+  http_ctl_add_connections(ctl, connects, (double)setup_us / 1e6);
+}
+
+// The Retry-After of a finished transfer in seconds, or 0 if it had none
+static long retry_after_of(CURL *curl) {
+  long retry_after = 0;
+#if LIBCURL_VERSION_NUM >= 0x074200
+  curl_off_t retry_after_t = 0;
+  if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after_t) ==
+      CURLE_OK) {
+    retry_after = (long)retry_after_t;
+  }
+#else
+  (void)curl;
+#endif
+  return retry_after;
+}
+
+// Runs a one-off request such as a probe, retrying it with backoff while
+// it fails in a way that says nothing about the server: a transport error,
+// 408, 429 or 5xx. `response` is emptied before each attempt. A write
+// error is the callback stopping a response that ignored Range, which is
+// an answer in itself.
+static CURLcode perform_with_retries(CURL *curl, http_buffer_t *response,
+                                     long *response_code) {
+  http_ctl_t *ctl = http_ctl_get();
+  CURLcode res;
+  for (int attempt = 0;; attempt++) {
+    if (response) {
+      response->size = 0;
+    }
+    res = curl_easy_perform(curl);
+    note_connections(ctl, curl);
+    *response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, response_code);
+    int transient = (res != CURLE_OK && res != CURLE_WRITE_ERROR) ||
+                    *response_code == 408 || *response_code == 429 ||
+                    (*response_code >= 500 && *response_code < 600);
+    if (!transient) {
+      return res;
+    }
+    if (attempt + 1 >= HTTP_MAX_RETRIES) {
+      return (res != CURLE_OK) ? res : CURLE_HTTP_RETURNED_ERROR;
+    }
+    http_sleep_ms(http_ctl_backoff_ms(ctl, attempt, retry_after_of(curl)));
+  }
+}
+
+void http_print_stats(void) {
+  http_ctl_t *ctl = http_ctl_get();
+  http_mutex_lock(&ctl->lock);
+  printf("- HTTP: %" PRIu64 " requests, %" PRIu64 " throttled, %" PRIu64
+         " connections opened (%.0f ms connecting)\n",
+         ctl->requests, ctl->throttled, ctl->connections,
+         ctl->connect_seconds * 1000.0);
+  if (ctl->max_rate > 0.0 || ctl->rate_file) {
+    printf("- HTTP: rate limit %s%s, transfers held back %.1f s in total\n",
+           (ctl->max_rate > 0.0)
+               ? format_size((uint64_t)ctl->max_rate)
+               : "off",
+           (ctl->max_rate > 0.0) ? "/s" : "", ctl->throttled_seconds);
+  }
+  http_mutex_unlock(&ctl->lock);
+}
+
+// If-Range needs a strong validator: a weak ETag or no validator at all
+// means a resumed transfer could splice together two versions of the file.
+static const char *resume_validator(const char *etag,
+                                    const char *last_modified) {
+  if (etag && strncmp(etag, "W/", 2) != 0) {
+    return etag;
+  }
+  return last_modified;
+}
+
+static int http_fetch_range(http_reader_t *reader, uint64_t offset,
+                            uint8_t *buffer, size_t to_read,
+                            size_t *bytes_read);
+static struct curl_slist *range_headers(uint64_t offset, size_t size,
+                                        const char *if_range);
+
+// Waits out a fill backoff in short steps, so closing the reader is not
+// held up by it.
+static void fill_backoff(http_reader_t *reader, unsigned int delay_ms) {
+  for (unsigned int waited = 0; waited < delay_ms; waited += 50) {
+    http_mutex_lock(&reader->lock);
+    int stop = reader->fill_stop;
+    http_mutex_unlock(&reader->lock);
+    if (stop) {
+      return;
+    }
+    http_sleep_ms(50);
+  }
+}
+
+// Fills the gaps of a saved source in the background. Gaps are only
+// fetched while no other transfer is in flight, so the copy uses idle
+// bandwidth, until http_reader_finish_source asks for the rest urgently.
+// A gap that fails is backed off from and tried again on the next pass;
+// only once the rest is urgent do HTTP_FILL_MAX_FAILURES failures in a row
+// end the fill, so an unreachable server cannot hold up the caller forever.
+static void *fill_thread(void *arg) {
+  http_reader_t *reader = arg;
+  http_ctl_t *ctl = http_ctl_get();
+  uint8_t *buffer = malloc(HTTP_FILL_CHUNK_SIZE);
+  uint64_t cursor = 0;
+  int failures = 0;
+  int was_urgent = 0;
+
+  while (buffer) {
+    http_mutex_lock(&reader->lock);
+    int stop = reader->fill_stop;
+    int urgent = reader->fill_urgent;
+    uint64_t gap_start = 0, gap_end = 0;
+    int found = http_cache_next_gap(reader->cache, cursor,
+                                    reader->content_length, &gap_start,
+                                    &gap_end);
+    if (found != 0 && cursor > 0) {
+      cursor = 0;
+      found = http_cache_next_gap(reader->cache, 0, reader->content_length,
+                                  &gap_start, &gap_end);
+    }
+
+    if (found == 0 && gap_end - gap_start > HTTP_FILL_CHUNK_SIZE) {
+      gap_end = gap_start + HTTP_FILL_CHUNK_SIZE;
+    }
+    int idle = urgent || http_ctl_idle(ctl);
+    if (!stop && found == 0 && idle) {
+      // Readers wanting these bytes wait for us instead of fetching them too
+      reader->fill_start = gap_start;
+      reader->fill_end = gap_end;
+    }
+    http_mutex_unlock(&reader->lock);
+
+    if (stop || found != 0) {
+      break;
+    }
+    if (urgent && !was_urgent) {
+      was_urgent = 1;
+      failures = 0;
+    }
+    if (!idle) {
+      http_sleep_ms(50);
+      continue;
+    }
+
+    size_t gap_size = (size_t)(gap_end - gap_start);
+    size_t fetched;
+    int fetch_result =
+        http_fetch_range(reader, gap_start, buffer, gap_size, &fetched);
+
+    http_mutex_lock(&reader->lock);
+    int stored = (fetch_result == 0)
+                     ? http_cache_store(reader->cache, gap_start, buffer,
+                                        gap_size)
+                     : 0;
+    reader->fill_start = reader->fill_end = 0;
+    http_cond_broadcast(&reader->fill_done);
+    http_mutex_unlock(&reader->lock);
+
+    if (fetch_result != 0) {
+      if (++failures >= HTTP_FILL_MAX_FAILURES && urgent) {
+        break;
+      }
+      fill_backoff(reader, http_ctl_backoff_ms(ctl, failures, 0));
+      cursor = gap_end;
+      continue;
+    }
+    failures = 0;
+    if (stored != 0) {
+      break;
+    }
+    cursor = gap_end;
+  }
+
+  free(buffer);
+  http_mutex_lock(&reader->lock);
+  reader->fill_failed = !http_cache_complete(reader->cache);
+  http_mutex_unlock(&reader->lock);
+  return NULL;
+}
+
+// The saved source doubles as the range cache: every range fetched for
+// extraction is written into it, and a background thread fetches the rest.
+static int open_saved_source(http_reader_t *reader, int silent) {
+  const char *validator =
+      resume_validator(reader->etag, reader->last_modified);
+  if (!validator) {
+    // Nothing to tell whether a leftover partial copy is still current
+    char *map_path = malloc(strlen(g_save_source) + sizeof(".map"));
+    if (map_path) {
+      sprintf(map_path, "%s.map", g_save_source);
+      remove(map_path);
+      free(map_path);
+    }
+  }
+
+  reader->cache = malloc(sizeof(http_cache_t));
+  if (!reader->cache ||
+      http_cache_open_file(reader->cache, g_save_source, validator,
+                           reader->content_length) != 0) {
+    free(reader->cache);
+    reader->cache = NULL;
+    return -1;
+  }
+  reader->saving_source = 1;
+
+  if (!silent) {
+    uint64_t saved = reader->cache->chunks_present * HTTP_CACHE_CHUNK_SIZE;
+    if (saved > reader->content_length) {
+      saved = reader->content_length;
+    }
+    fprintf(stderr, "- Saving source to %s (%s already present)\n",
+            g_save_source, format_size(saved));
+  }
+
+  if (http_thread_create(&reader->fill_thread, fill_thread, reader) == 0) {
+    reader->fill_started = 1;
+  }
+  return 0;
+}
+
+// Fetches whatever the saved source is still missing at full speed and
+// waits for it. Returns 0 once the local copy is complete. Without a
+// background thread, the fill runs here instead.
+int http_reader_finish_source(http_reader_t *reader) {
+  if (!reader->saving_source) {
+    return -1;
+  }
+  http_mutex_lock(&reader->lock);
+  reader->fill_urgent = 1;
+  http_mutex_unlock(&reader->lock);
+  if (reader->fill_started) {
+    http_thread_join(reader->fill_thread);
+    reader->fill_started = 0;
+  } else {
+    fill_thread(reader);
+  }
+
+  http_mutex_lock(&reader->lock);
+  int complete = http_cache_complete(reader->cache);
+  http_mutex_unlock(&reader->lock);
+  if (!complete) {
+    return -1;
+  }
+  http_cache_flush(reader->cache);
+  http_cache_remove_map(reader->cache);
+  return 0;
+}
+
+typedef struct {
+  long status;
+  char *etag;
+  char *last_modified;
+  char *content_range;
+} mirror_probe_t;
+
+static size_t mirror_probe_header_callback(char *buffer, size_t size,
+                                           size_t nitems, void *userdata) {
+  mirror_probe_t *probe = userdata;
+  size_t len = size * nitems;
+
+  if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    const char *code = memchr(buffer, ' ', len);
+    probe->status = code ? strtol(code + 1, NULL, 10) : 0;
+    free(probe->etag);
+    free(probe->last_modified);
+    free(probe->content_range);
+    probe->etag = NULL;
+    probe->last_modified = NULL;
+    probe->content_range = NULL;
+    return len;
+  }
+
+  char *value;
+  if ((value = header_value(buffer, len, "ETag")) != NULL) {
+    free(probe->etag);
+    probe->etag = value;
+  } else if ((value = header_value(buffer, len, "Last-Modified")) != NULL) {
+    free(probe->last_modified);
+    probe->last_modified = value;
+  } else if ((value = header_value(buffer, len, "Content-Range")) != NULL) {
+    free(probe->content_range);
+    probe->content_range = value;
+  }
+  return len;
+}
+
+static void mirror_probe_free(mirror_probe_t *probe) {
+  free(probe->etag);
+  free(probe->last_modified);
+  free(probe->content_range);
+  memset(probe, 0, sizeof(mirror_probe_t));
+}
+
+// Reads the last `size` bytes of `url` with a range request, retrying
+// transient failures. Returns 0 if the server honours the range and
+// reports the same total length, 1 if it answers with a different total
+// or without honouring the range, and -1 if it cannot be reached.
+static int probe_tail(http_reader_t *reader, const char *url, uint8_t *tail,
+                      size_t size, mirror_probe_t *probe) {
+  CURL *curl = curl_easy_duphandle(reader->curl);
+  struct curl_slist *headers =
+      range_headers(reader->content_length - size, size, NULL);
+  if (!curl || !headers) {
+    if (curl) {
+      curl_easy_cleanup(curl);
+    }
+    curl_slist_free_all(headers);
+    return -1;
+  }
+
+  http_buffer_t response = {tail, 0, size};
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_buffer_write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, mirror_probe_header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, probe);
+
+  long response_code;
+  CURLcode res = perform_with_retries(curl, &response, &response_code);
+  curl_easy_cleanup(curl);
+  curl_slist_free_all(headers);
+
+  unsigned long long first, last, total;
+  if (res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+    return -1;
+  }
+  if (res != CURLE_OK || probe->status != 206 || response.size != size ||
+      !probe->content_range ||
+      sscanf(probe->content_range, "bytes %llu-%llu/%llu", &first, &last,
+             &total) != 3 ||
+      total != reader->content_length) {
+    return 1;
+  }
+  return 0;
+}
+
+// Checks the URLs given with http_add_mirror against the primary one and
+// keeps those that serve the same object: the total length must match, and
+// so must either the ETag or the last HTTP_MIRROR_PROBE_SIZE bytes. For a
+// ZIP those hold the central directory with the CRC of every entry.
+static void add_mirrors(http_reader_t *reader, int silent) {
+  size_t size = HTTP_MIRROR_PROBE_SIZE;
+  if (size > reader->content_length) {
+    size = (size_t)reader->content_length;
+  }
+  uint8_t *expected = malloc(size);
+  uint8_t *tail = malloc(size);
+  mirror_probe_t probe = {0};
+
+  if (!expected || !tail ||
+      probe_tail(reader, reader->url, expected, size, &probe) != 0) {
+    fprintf(stderr, "- Warning: Could not probe %s, mirrors not used\n",
+            reader->url);
+    mirror_probe_free(&probe);
+    free(expected);
+    free(tail);
+    return;
+  }
+  mirror_probe_free(&probe);
+
+  const char *validator =
+      resume_validator(reader->etag, reader->last_modified);
+  reader->mirrors[0].url = strdup(reader->url);
+  reader->mirrors[0].validator = validator ? strdup(validator) : NULL;
+  reader->num_mirrors = 1;
+
+  for (int i = 0; i < g_num_mirror_urls; i++) {
+    const char *url = g_mirror_urls[i];
+    int probed = probe_tail(reader, url, tail, size, &probe);
+    if (probed < 0) {
+      fprintf(stderr, "- Warning: Mirror %s could not be reached, skipped\n",
+              url);
+    } else if (probed > 0) {
+      fprintf(stderr, "- Warning: Mirror %s has a different size or does "
+                      "not support range requests, skipped\n",
+              url);
+    } else if (!(probe.etag && reader->etag &&
+                 strcmp(probe.etag, reader->etag) == 0) &&
+               memcmp(tail, expected, size) != 0) {
+      fprintf(stderr, "- Warning: Mirror %s serves different content, "
+                      "skipped\n",
+              url);
+    } else {
+      http_mirror_t *mirror = &reader->mirrors[reader->num_mirrors++];
+      validator = resume_validator(probe.etag, probe.last_modified);
+      mirror->url = strdup(url);
+      mirror->validator = validator ? strdup(validator) : NULL;
+    }
+    mirror_probe_free(&probe);
+  }
+  free(expected);
+  free(tail);
+
+  // A mirror that stalls should fail over instead of holding up the read.
+  // Under a rate limit every transfer can fall below the limit while it
+  // waits for the bucket, so there is no telling a stall apart.
+  if (!http_ctl_rate_limited(http_ctl_get())) {
+    curl_easy_setopt(reader->curl, CURLOPT_LOW_SPEED_LIMIT,
+                     HTTP_LOW_SPEED_LIMIT);
+    curl_easy_setopt(reader->curl, CURLOPT_LOW_SPEED_TIME,
+                     HTTP_LOW_SPEED_TIME);
+  }
+  if (!silent) {
+    fprintf(stderr, "- Mirrors: %d of %d usable\n", reader->num_mirrors - 1,
+            g_num_mirror_urls);
+  }
+}
+
+void http_print_mirror_stats(const http_reader_t *reader) {
+  for (int i = 0; i < reader->num_mirrors; i++) {
+    const http_mirror_t *mirror = &reader->mirrors[i];
+    printf("- Mirror %s: %" PRIu64 " requests, %s, %.1f MB/s%s\n",
+           mirror->url, mirror->requests, format_size(mirror->bytes),
+           mirror->throughput_ewma / (1024.0 * 1024.0),
+           mirror->disabled ? " (dropped)" : "");
+  }
+}
+
 int http_reader_init(http_reader_t *reader, const char *url, int silent) {
   if (!g_curl_initialized) {
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    http_share_init();
     g_curl_initialized = 1;
   }
 
   memset(reader, 0, sizeof(http_reader_t));
+  http_mutex_init(&reader->lock);
+  http_cond_init(&reader->fill_done);
+  http_ctl_t *ctl = http_ctl_get();
 
   reader->url = strdup(url);
   if (!reader->url) {
+    http_reader_cleanup(reader);
     return -1;
   }
 
   reader->curl = curl_easy_init();
   if (!reader->curl) {
-    free(reader->url);
+    http_reader_cleanup(reader);
     return -1;
   }
 
+  // Transfers run on worker threads, where curl must not use signals
+  curl_easy_setopt(reader->curl, CURLOPT_NOSIGNAL, 1L);
   curl_easy_setopt(reader->curl, CURLOPT_URL, reader->url);
-  curl_easy_setopt(reader->curl, CURLOPT_TIMEOUT, HTTP_TIMEOUT);
+  // Rate-limited transfers take as long as the limit makes them
+  if (!http_ctl_rate_limited(ctl)) {
+    curl_easy_setopt(reader->curl, CURLOPT_TIMEOUT, HTTP_TIMEOUT);
+  }
   curl_easy_setopt(reader->curl, CURLOPT_FOLLOWLOCATION, 1L);
   curl_easy_setopt(reader->curl, CURLOPT_MAXREDIRS, 10L);
+  if (g_share) {
+    curl_easy_setopt(reader->curl, CURLOPT_SHARE, g_share);
+  }
   const char *ua = reader->user_agent
                        ? reader->user_agent
                        : "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
@@ -101,79 +682,144 @@ int http_reader_init(http_reader_t *reader, const char *url, int silent) {
 
   curl_easy_setopt(reader->curl, CURLOPT_NOBODY, 1L);
   curl_easy_setopt(reader->curl, CURLOPT_WRITEFUNCTION, NULL);
+  curl_easy_setopt(reader->curl, CURLOPT_HEADERFUNCTION, http_header_callback);
+  curl_easy_setopt(reader->curl, CURLOPT_HEADERDATA, reader);
 
-  int retry_count = 0;
-  CURLcode res;
+  long response_code;
+  CURLcode res = perform_with_retries(reader->curl, NULL, &response_code);
 
-  while (retry_count < HTTP_MAX_RETRIES) {
-    res = curl_easy_perform(reader->curl);
-    if (res == CURLE_OK) {
-      break;
-    }
-    retry_count++;
-    if (retry_count < HTTP_MAX_RETRIES) {
-      sleep((unsigned int)(2 * retry_count));
-    }
-  }
+  curl_easy_setopt(reader->curl, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(reader->curl, CURLOPT_HEADERDATA, NULL);
 
   if (res != CURLE_OK) {
     fprintf(stderr, "Failed to connect after %d retries: %s\n",
             HTTP_MAX_RETRIES, curl_easy_strerror(res));
-    curl_easy_cleanup(reader->curl);
-    free(reader->url);
+    http_reader_cleanup(reader);
     return -1;
   }
 
   curl_off_t content_length_t;
   curl_easy_getinfo(reader->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
                     &content_length_t);
-  if (content_length_t < 0) {
-    fprintf(stderr, "Could not determine content length\n");
-    curl_easy_cleanup(reader->curl);
-    free(reader->url);
-    return -1;
-  }
-  reader->content_length = (uint64_t)content_length_t;
-
-  long response_code;
-  curl_easy_getinfo(reader->curl, CURLINFO_RESPONSE_CODE, &response_code);
+  // Without a length only a single streamed download can work
+  reader->content_length =
+      (content_length_t < 0) ? 0 : (uint64_t)content_length_t;
 
   curl_easy_setopt(reader->curl, CURLOPT_NOBODY, 0L);
-  curl_easy_setopt(reader->curl, CURLOPT_WRITEFUNCTION, http_write_callback);
+  curl_easy_setopt(reader->curl, CURLOPT_WRITEFUNCTION,
+                   http_buffer_write_callback);
 
   struct curl_slist *headers = NULL;
   headers = curl_slist_append(headers, "Range: bytes=0-1023");
   curl_easy_setopt(reader->curl, CURLOPT_HTTPHEADER, headers);
 
-  http_response_t test_response = {0};
+  // A server that ignores the Range header would send the whole file; the
+  // callback stops the probe once the buffer is full. Only such an answer,
+  // or a missing length, means ranges cannot be used: a probe that keeps
+  // failing is an error, not a reason to download everything.
+  uint8_t probe[1024];
+  http_buffer_t test_response = {probe, 0, sizeof(probe)};
   curl_easy_setopt(reader->curl, CURLOPT_WRITEDATA, &test_response);
 
-  res = curl_easy_perform(reader->curl);
-  curl_easy_getinfo(reader->curl, CURLINFO_RESPONSE_CODE, &response_code);
+  res = perform_with_retries(reader->curl, &test_response, &response_code);
 
-  reader->supports_ranges = (res == CURLE_OK && response_code == 206);
+  curl_easy_setopt(reader->curl, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(reader->curl, CURLOPT_WRITEFUNCTION, http_write_callback);
+  curl_easy_setopt(reader->curl, CURLOPT_WRITEDATA, NULL);
+  curl_slist_free_all(headers);
 
-  if (test_response.data) {
-    free(test_response.data);
+  if (res != CURLE_OK && res != CURLE_WRITE_ERROR) {
+    fprintf(stderr, "Failed to probe range support after %d retries: %s\n",
+            HTTP_MAX_RETRIES, curl_easy_strerror(res));
+    http_reader_cleanup(reader);
+    return -1;
   }
-  curl_slist_free_all(headers);
+  reader->supports_ranges =
+      (res == CURLE_OK && response_code == 206 && reader->content_length > 0);
 
   if (!reader->supports_ranges && !g_ranges_warning_shown) {
-    fprintf(stderr, "- Warning: Server doesn't support range requests. The "
-                    "process may fail.\n");
+    fprintf(stderr, "- Warning: Server doesn't support range requests, "
+                    "falling back to a single download.\n");
     g_ranges_warning_shown = 1;
   }
 
   if (!silent && !g_size_info_shown) {
-    fprintf(stderr, "- File size: %s\n", format_size(reader->content_length));
+    fprintf(stderr, "- File size: %s\n",
+            format_size(reader->content_length));
     g_size_info_shown = 1;
   }
 
+  if (g_num_mirror_urls > 0 && reader->supports_ranges) {
+    add_mirrors(reader, silent);
+  }
+
+  if (g_save_source) {
+    if (!reader->supports_ranges) {
+      fprintf(stderr, "- Warning: Server doesn't support range requests, "
+                      "source will not be saved.\n");
+    } else if (open_saved_source(reader, silent) != 0) {
+      fprintf(stderr, "- Warning: Failed to open %s, source will not be "
+                      "saved.\n",
+              g_save_source);
+    }
+  }
+
+  if (g_cache_dir && !reader->cache && reader->supports_ranges) {
+    // Without a validator a changed object with the same size would be
+    // served from stale chunks, so such servers are not cached.
+    const char *validator =
+        reader->etag ? reader->etag : reader->last_modified;
+    if (!validator) {
+      if (!silent) {
+        fprintf(stderr, "- Warning: Server sent no ETag or Last-Modified, "
+                        "range cache disabled.\n");
+      }
+    } else {
+      reader->cache = malloc(sizeof(http_cache_t));
+      if (reader->cache &&
+          http_cache_open(reader->cache, g_cache_dir, reader->url, validator,
+                          reader->content_length) != 0) {
+        fprintf(stderr, "- Warning: Failed to open range cache in %s\n",
+                g_cache_dir);
+        free(reader->cache);
+        reader->cache = NULL;
+      }
+      if (reader->cache && !silent) {
+        uint64_t cached = reader->cache->chunks_present * HTTP_CACHE_CHUNK_SIZE;
+        if (cached > reader->content_length) {
+          cached = reader->content_length;
+        }
+        fprintf(stderr, "- Range cache: %s already cached\n",
+                format_size(cached));
+      }
+    }
+  }
+
   reader->current_pos = 0;
   return 0;
 }
 
 void http_reader_cleanup(http_reader_t *reader) {
+  if (reader->fill_started) {
+    http_mutex_lock(&reader->lock);
+    reader->fill_stop = 1;
+    http_mutex_unlock(&reader->lock);
+    http_thread_join(reader->fill_thread);
+    reader->fill_started = 0;
+  }
+  if (reader->cache) {
+    http_cache_close(reader->cache);
+    free(reader->cache);
+    reader->cache = NULL;
+  }
+  for (int i = 0; i < reader->num_idle_multis; i++) {
+    curl_multi_cleanup(reader->idle_multis[i]);
+  }
+  reader->num_idle_multis = 0;
+  for (int i = 0; i < reader->num_idle_handles; i++) {
+    curl_easy_cleanup(reader->idle_handles[i]);
+  }
+  reader->num_idle_handles = 0;
   if (reader->curl) {
     curl_easy_cleanup(reader->curl);
     reader->curl = NULL;
@@ -186,83 +832,1257 @@ void http_reader_cleanup(http_reader_t *reader) {
     free(reader->user_agent);
     reader->user_agent = NULL;
   }
-}
-
-int http_reader_seek(http_reader_t *reader, uint64_t offset) {
-  if (offset > reader->content_length) {
-    return -1;
+  free(reader->etag);
+  free(reader->last_modified);
+  reader->etag = NULL;
+  reader->last_modified = NULL;
+  for (int i = 0; i < reader->num_mirrors; i++) {
+    free(reader->mirrors[i].url);
+    free(reader->mirrors[i].validator);
   }
-  reader->current_pos = offset;
-  return 0;
+  reader->num_mirrors = 0;
+  http_cond_destroy(&reader->fill_done);
+  http_mutex_destroy(&reader->lock);
 }
 
-int http_reader_read_at(http_reader_t *reader, uint64_t offset, uint8_t *buffer,
-                        size_t size, size_t *bytes_read) {
-  if (offset >= reader->content_length) {
-    *bytes_read = 0;
-    return 0;
-  }
+static size_t stream_write_callback(char *contents, size_t size, size_t nmemb,
+                                    void *userdata) {
+  http_stream_t *stream = userdata;
+  size_t total_size = size * nmemb;
+  size_t written = 0;
 
-  uint64_t remaining = reader->content_length - offset;
-  size_t to_read = (size < remaining) ? size : (size_t)remaining;
+  http_ctl_throttle(http_ctl_get(), total_size);
 
-  if (to_read == 0) {
-    *bytes_read = 0;
-    return 0;
+  while (written < total_size) {
+#ifdef _WIN32
+    int n = _write(stream->write_fd, contents + written,
+                   (unsigned int)(total_size - written));
+#else
+    ssize_t n = write(stream->write_fd, contents + written,
+                      total_size - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+#endif
+    // The consumer closed its end: it has everything it wanted
+    if (n <= 0) {
+      return 0;
+    }
+    written += (size_t)n;
   }
+  return total_size;
+}
 
-  char range_header[256];
-snprintf(range_header, sizeof(range_header), "Range: bytes=%" PRIu64 "-%" PRIu64, offset, offset + to_read - 1);
-
-  struct curl_slist *headers = NULL;
-  headers = curl_slist_append(headers, range_header);
-  curl_easy_setopt(reader->curl, CURLOPT_HTTPHEADER, headers);
-
-  http_response_t response = {0};
-  response.capacity = to_read + 1024;
-  response.data = malloc(response.capacity);
-  if (!response.data) {
-    curl_slist_free_all(headers);
-    return -1;
+static void *stream_thread(void *arg) {
+  http_stream_t *stream = arg;
+  stream->result = curl_easy_perform(stream->curl);
+  note_connections(http_ctl_get(), stream->curl);
+  if (stream->result != CURLE_OK && stream->result != CURLE_WRITE_ERROR) {
+    fprintf(stderr, "\n- Error: Download failed: %s\n",
+            curl_easy_strerror(stream->result));
   }
+#ifdef _WIN32
+  _close(stream->write_fd);
+#else
+  close(stream->write_fd);
+#endif
+  return NULL;
+}
 
-  curl_easy_setopt(reader->curl, CURLOPT_WRITEDATA, &response);
-
-  int retry_count = 0;
-  CURLcode res;
+// Starts a single GET of `url` and returns its body as a pipe to read from
+// front to back. There is no retry: without Range support a failed
+// transfer cannot be resumed.
+http_stream_t *http_stream_open(const char *url, const char *user_agent) {
+  if (!g_curl_initialized) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    http_share_init();
+    g_curl_initialized = 1;
+  }
 
-  while (retry_count < HTTP_MAX_RETRIES) {
-    response.size = 0;
-    res = curl_easy_perform(reader->curl);
+  http_stream_t *stream = calloc(1, sizeof(http_stream_t));
+  if (!stream) {
+    return NULL;
+  }
 
-    if (res == CURLE_OK) {
-      long response_code;
-      curl_easy_getinfo(reader->curl, CURLINFO_RESPONSE_CODE, &response_code);
+  int fds[2];
+#ifdef _WIN32
+  if (_pipe(fds, 1024 * 1024, _O_BINARY) != 0) {
+#else
+  // Writes to a pipe the consumer has closed must fail, not kill us
+  signal(SIGPIPE, SIG_IGN);
+  if (pipe(fds) != 0) {
+#endif
+    free(stream);
+    return NULL;
+  }
+  stream->write_fd = fds[1];
+#ifdef _WIN32
+  stream->file = _fdopen(fds[0], "rb");
+#else
+  stream->file = fdopen(fds[0], "rb");
+#endif
 
-      if (response_code == 200 || response_code == 206) {
-        break;
-      }
+  stream->curl = curl_easy_init();
+  if (!stream->file || !stream->curl) {
+    if (stream->file) {
+      fclose(stream->file);
     }
-
-    retry_count++;
-    if (retry_count < HTTP_MAX_RETRIES) {
-      sleep((unsigned int)(2 * retry_count));
+    if (stream->curl) {
+      curl_easy_cleanup(stream->curl);
     }
+#ifdef _WIN32
+    _close(fds[1]);
+#else
+    close(fds[1]);
+#endif
+    free(stream);
+    return NULL;
   }
 
-  curl_slist_free_all(headers);
-
-  if (res != CURLE_OK || response.size == 0) {
-    free(response.data);
-    return -1;
+  curl_easy_setopt(stream->curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(stream->curl, CURLOPT_URL, url);
+  curl_easy_setopt(stream->curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(stream->curl, CURLOPT_MAXREDIRS, 10L);
+  curl_easy_setopt(stream->curl, CURLOPT_FAILONERROR, 1L);
+  if (g_share) {
+    curl_easy_setopt(stream->curl, CURLOPT_SHARE, g_share);
   }
+  curl_easy_setopt(stream->curl, CURLOPT_USERAGENT,
+                   user_agent ? user_agent
+                              : "Mozilla/5.0 (X11; Linux x86_64) "
+                                "AppleWebKit/537.36 (KHTML, like Gecko) "
+                                "Chrome/124.0.0.0 Safari/537.36");
+  curl_easy_setopt(stream->curl, CURLOPT_WRITEFUNCTION, stream_write_callback);
+  curl_easy_setopt(stream->curl, CURLOPT_WRITEDATA, stream);
 
-  size_t actual_read = (response.size < to_read) ? response.size : to_read;
-  memcpy(buffer, response.data, actual_read);
-  *bytes_read = actual_read;
-
-  free(response.data);
-  return 0;
+  if (http_thread_create(&stream->thread, stream_thread, stream) != 0) {
+    fclose(stream->file);
+    curl_easy_cleanup(stream->curl);
+#ifdef _WIN32
+    _close(fds[1]);
+#else
+    close(fds[1]);
+#endif
+    free(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+// Called once the read end has been closed, which makes the transfer stop
+// at its next write if it has not finished yet.
+void http_stream_close(void *arg) {
+  http_stream_t *stream = arg;
+  http_thread_join(stream->thread);
+  curl_easy_cleanup(stream->curl);
+  free(stream);
+}
+
+int http_reader_seek(http_reader_t *reader, uint64_t offset) {
+  if (offset > reader->content_length) {
+    return -1;
+  }
+  reader->current_pos = offset;
+  return 0;
+}
+
+// Each concurrent transfer needs its own easy handle. Handles are cloned
+// from the one set up by http_reader_init and kept for reuse, so their
+// connections stay alive between requests.
+static CURL *http_handle_acquire(http_reader_t *reader) {
+  CURL *curl = NULL;
+  http_mutex_lock(&reader->lock);
+  if (reader->num_idle_handles > 0) {
+    curl = reader->idle_handles[--reader->num_idle_handles];
+  }
+  http_mutex_unlock(&reader->lock);
+
+  if (!curl) {
+    curl = curl_easy_duphandle(reader->curl);
+  }
+  return curl;
+}
+
+static void http_handle_release(http_reader_t *reader, CURL *curl) {
+  http_mutex_lock(&reader->lock);
+  if (reader->num_idle_handles < HTTP_MAX_INFLIGHT) {
+    reader->idle_handles[reader->num_idle_handles++] = curl;
+    curl = NULL;
+  }
+  http_mutex_unlock(&reader->lock);
+
+  if (curl) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+// Each thread fetching at once drives its own multi handle. They are kept
+// for reuse like the easy handles, since a multi handle closes the
+// connections in its cache when it is cleaned up.
+static CURLM *http_multi_acquire(http_reader_t *reader) {
+  CURLM *multi = NULL;
+  http_mutex_lock(&reader->lock);
+  if (reader->num_idle_multis > 0) {
+    multi = reader->idle_multis[--reader->num_idle_multis];
+  }
+  http_mutex_unlock(&reader->lock);
+
+  if (!multi) {
+    multi = curl_multi_init();
+  }
+  return multi;
+}
+
+static void http_multi_release(http_reader_t *reader, CURLM *multi) {
+  http_mutex_lock(&reader->lock);
+  if (reader->num_idle_multis < HTTP_MAX_INFLIGHT) {
+    reader->idle_multis[reader->num_idle_multis++] = multi;
+    multi = NULL;
+  }
+  http_mutex_unlock(&reader->lock);
+
+  if (multi) {
+    curl_multi_cleanup(multi);
+  }
+}
+
+static http_result_t classify_result(CURLcode res, long response_code,
+                                     uint64_t offset, size_t received,
+                                     size_t expected) {
+  if (res == CURLE_OK || res == CURLE_WRITE_ERROR) {
+    if (response_code == 429 || response_code == 503 ||
+        response_code == 502 || response_code == 504) {
+      return HTTP_RESULT_THROTTLED;
+    }
+    // A 200 carries the object from its start, which is only usable when
+    // that is what was asked for.
+    if ((response_code == 206 || (response_code == 200 && offset == 0)) &&
+        received == expected) {
+      return HTTP_RESULT_OK;
+    }
+    return HTTP_RESULT_FAILED;
+  }
+  return HTTP_RESULT_THROTTLED;
+}
+
+// Reports a finished transfer to the controller. `permanent` is set for
+// client errors that a retry will not fix.
+static http_result_t finish_transfer(http_ctl_t *ctl, CURL *curl,
+                                     CURLcode res, uint64_t offset,
+                                     size_t received, size_t expected,
+                                     int *permanent, long *retry_after) {
+  long response_code = 0;
+  curl_off_t ttfb_us = 0, total_us = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+
+  http_result_t result =
+      classify_result(res, response_code, offset, received, expected);
+  http_ctl_release(ctl, result, received, (double)ttfb_us / 1e6,
+                   (double)total_us / 1e6);
+  note_connections(ctl, curl);
+
+  *permanent = (res == CURLE_OK && response_code >= 400 &&
+                response_code < 500 && response_code != 408 &&
+                response_code != 429);
+  *retry_after = retry_after_of(curl);
+  return result;
+}
+
+static struct curl_slist *range_headers(uint64_t offset, size_t size,
+                                        const char *if_range) {
+  char header[512];
+  snprintf(header, sizeof(header), "Range: bytes=%" PRIu64 "-%" PRIu64,
+           offset, offset + size - 1);
+  struct curl_slist *headers = curl_slist_append(NULL, header);
+  if (headers && if_range) {
+    snprintf(header, sizeof(header), "If-Range: %s", if_range);
+    struct curl_slist *with_validator = curl_slist_append(headers, header);
+    if (!with_validator) {
+      curl_slist_free_all(headers);
+      return NULL;
+    }
+    headers = with_validator;
+  }
+  return headers;
+}
+
+// One sub-range of a fetch. `response.size` counts the bytes received so
+// far across attempts, so a retry only asks for what is still missing.
+typedef struct {
+  uint64_t offset;
+  size_t size;
+  http_buffer_t response;
+  size_t attempt_start;
+  CURL *curl;
+  struct curl_slist *headers;
+  int attempts;
+  double retry_at;
+  int mirror;
+  enum { STRIPE_PENDING, STRIPE_ACTIVE, STRIPE_DONE } state;
+} http_stripe_t;
+
+// Picks the mirror for the next request: the one that would get through
+// its queue soonest at the throughput it has delivered so far. Mirrors not
+// measured yet look fast, so each gets tried. Mirrors backing off after
+// errors are skipped while any other one is usable.
+static int pick_mirror(http_reader_t *reader) {
+  double now = http_now();
+  double best_rate = 0.0;
+  for (int i = 0; i < reader->num_mirrors; i++) {
+    if (!reader->mirrors[i].disabled &&
+        reader->mirrors[i].throughput_ewma > best_rate) {
+      best_rate = reader->mirrors[i].throughput_ewma;
+    }
+  }
+
+  int best = -1;
+  double best_score = 0.0;
+  for (int i = 0; i < reader->num_mirrors; i++) {
+    http_mirror_t *mirror = &reader->mirrors[i];
+    if (mirror->disabled || mirror->avoid_until > now) {
+      continue;
+    }
+    double rate = mirror->throughput_ewma;
+    if (rate <= 0.0) {
+      rate = (best_rate > 0.0) ? 2.0 * best_rate : 1.0;
+    }
+    double score = (double)(mirror->in_flight + 1) / rate;
+    if (best < 0 || score < best_score) {
+      best = i;
+      best_score = score;
+    }
+  }
+
+  if (best >= 0) {
+    return best;
+  }
+  // Everything is backing off: take the mirror that recovers first
+  for (int i = 0; i < reader->num_mirrors; i++) {
+    http_mirror_t *mirror = &reader->mirrors[i];
+    if (!mirror->disabled &&
+        (best < 0 || mirror->avoid_until < reader->mirrors[best].avoid_until)) {
+      best = i;
+    }
+  }
+  return (best < 0) ? 0 : best;
+}
+
+static int acquire_mirror(http_reader_t *reader) {
+  http_mutex_lock(&reader->lock);
+  int index = pick_mirror(reader);
+  reader->mirrors[index].in_flight++;
+  reader->mirrors[index].requests++;
+  http_mutex_unlock(&reader->lock);
+  return index;
+}
+
+// Updates a mirror after a request. A mirror that keeps failing is set
+// aside for a growing backoff and finally dropped, as long as another one
+// is still usable.
+static void note_mirror_result(http_reader_t *reader, int index, CURL *curl,
+                               int ok, size_t received) {
+  if (reader->num_mirrors == 0) {
+    return;
+  }
+  curl_off_t total_us = 0;
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+
+  http_mutex_lock(&reader->lock);
+  http_mirror_t *mirror = &reader->mirrors[index];
+  mirror->in_flight--;
+  mirror->bytes += received;
+  if (ok) {
+    mirror->failures = 0;
+    // Small requests mostly measure latency, not what the mirror can carry
+    if (total_us > 0 && received >= HTTP_MIRROR_MIN_SAMPLE) {
+      double throughput = (double)received / ((double)total_us / 1e6);
+      mirror->throughput_ewma = (mirror->throughput_ewma == 0.0)
+                                    ? throughput
+                                    : 0.7 * mirror->throughput_ewma +
+                                          0.3 * throughput;
+    }
+  } else {
+    mirror->failures++;
+    mirror->avoid_until =
+        http_now() +
+        http_ctl_backoff_ms(http_ctl_get(), mirror->failures, 0) / 1000.0;
+    int usable = 0;
+    for (int i = 0; i < reader->num_mirrors; i++) {
+      usable += (i != index && !reader->mirrors[i].disabled);
+    }
+    if (mirror->failures >= HTTP_MIRROR_MAX_FAILURES && usable > 0 &&
+        !mirror->disabled) {
+      mirror->disabled = 1;
+      fprintf(stderr, "\n- Mirror %s dropped after %d failed requests\n",
+              mirror->url, mirror->failures);
+    }
+  }
+  http_mutex_unlock(&reader->lock);
+}
+
+static int start_stripe(http_reader_t *reader, CURLM *multi,
+                        http_stripe_t *stripe) {
+  if (!stripe->curl) {
+    stripe->curl = http_handle_acquire(reader);
+    if (!stripe->curl) {
+      return -1;
+    }
+  }
+
+  const char *url = reader->url;
+  const char *validator =
+      resume_validator(reader->etag, reader->last_modified);
+  if (reader->num_mirrors > 0) {
+    stripe->mirror = acquire_mirror(reader);
+    url = reader->mirrors[stripe->mirror].url;
+    validator = reader->mirrors[stripe->mirror].validator;
+  }
+  curl_easy_setopt(stripe->curl, CURLOPT_URL, url);
+
+  // Resume after the last byte received, unless there is no validator to
+  // make sure the rest comes from the same version of the file
+  if (!validator) {
+    stripe->response.size = 0;
+  }
+  size_t received = stripe->response.size;
+  curl_slist_free_all(stripe->headers);
+  stripe->headers =
+      range_headers(stripe->offset + received, stripe->size - received,
+                    received > 0 ? validator : NULL);
+  if (!stripe->headers) {
+    return -1;
+  }
+
+  curl_easy_setopt(stripe->curl, CURLOPT_HTTPHEADER, stripe->headers);
+  curl_easy_setopt(stripe->curl, CURLOPT_WRITEFUNCTION,
+                   http_buffer_write_callback);
+  curl_easy_setopt(stripe->curl, CURLOPT_WRITEDATA, &stripe->response);
+  curl_easy_setopt(stripe->curl, CURLOPT_PRIVATE, stripe);
+  stripe->attempt_start = received;
+  stripe->state = STRIPE_ACTIVE;
+  return (curl_multi_add_handle(multi, stripe->curl) == CURLM_OK) ? 0 : -1;
+}
+
+static void finish_stripe(http_reader_t *reader, http_stripe_t *stripe) {
+  if (stripe->curl) {
+    curl_easy_setopt(stripe->curl, CURLOPT_URL, reader->url);
+    curl_easy_setopt(stripe->curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(stripe->curl, CURLOPT_PRIVATE, NULL);
+    http_handle_release(reader, stripe->curl);
+    stripe->curl = NULL;
+  }
+  curl_slist_free_all(stripe->headers);
+  stripe->headers = NULL;
+}
+
+// Fetches a range as one or more stripes on separate connections, each
+// written straight into its part of the buffer. As many stripes run at
+// once as the controller allows (up to HTTP_MAX_STRIPES). Retries are
+// timers on the multi loop, so a stripe that backs off never stalls the
+// others, and they resume from the last byte received. A failure that
+// still delivered data does not count against the retry limit.
+static int http_fetch_striped(http_reader_t *reader, uint64_t offset,
+                              uint8_t *buffer, size_t size,
+                              size_t stripe_size) {
+  http_ctl_t *ctl = http_ctl_get();
+  size_t num_stripes = (size + stripe_size - 1) / stripe_size;
+  http_stripe_t *stripes = calloc(num_stripes, sizeof(http_stripe_t));
+  CURLM *multi = http_multi_acquire(reader);
+  if (!stripes || !multi) {
+    free(stripes);
+    if (multi) {
+      http_multi_release(reader, multi);
+    }
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_stripes; i++) {
+    stripes[i].offset = offset + i * stripe_size;
+    stripes[i].size = (i + 1 < num_stripes) ? stripe_size
+                                            : size - i * stripe_size;
+    stripes[i].response.data = buffer + i * stripe_size;
+    stripes[i].response.capacity = stripes[i].size;
+    stripes[i].state = STRIPE_PENDING;
+  }
+
+  size_t remaining = num_stripes;
+  int active = 0;
+  int failed = 0;
+
+  while (remaining > 0 && !failed) {
+    double now = http_now();
+    double next_retry = 0.0;
+    for (size_t i = 0; i < num_stripes && active < HTTP_MAX_STRIPES; i++) {
+      http_stripe_t *stripe = &stripes[i];
+      if (stripe->state != STRIPE_PENDING) {
+        continue;
+      }
+      if (stripe->retry_at > now) {
+        if (next_retry == 0.0 || stripe->retry_at < next_retry) {
+          next_retry = stripe->retry_at;
+        }
+        continue;
+      }
+      // Block for a slot only when nothing of ours is running
+      if (active == 0) {
+        http_ctl_acquire(ctl);
+      } else if (!http_ctl_try_acquire(ctl)) {
+        break;
+      }
+      if (start_stripe(reader, multi, stripe) != 0) {
+        http_ctl_release(ctl, HTTP_RESULT_FAILED, 0, 0.0, 0.0);
+        stripe->state = STRIPE_PENDING;
+        failed = 1;
+        break;
+      }
+      active++;
+    }
+
+    if (failed) {
+      break;
+    }
+    if (active == 0) {
+      double wait = next_retry - http_now();
+      http_sleep_ms((wait > 0.01) ? (unsigned int)(wait * 1000.0) : 10);
+      continue;
+    }
+
+    int running;
+    curl_multi_perform(multi, &running);
+
+    CURLMsg *msg;
+    int queued;
+    while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
+      }
+      http_stripe_t *stripe = NULL;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&stripe);
+      CURLcode res = msg->data.result;
+      curl_multi_remove_handle(multi, msg->easy_handle);
+      active--;
+
+      long response_code = 0;
+      curl_easy_getinfo(stripe->curl, CURLINFO_RESPONSE_CODE, &response_code);
+      size_t start = stripe->attempt_start;
+      size_t received = stripe->response.size - start;
+
+      int permanent;
+      long retry_after;
+      http_result_t result = finish_transfer(
+          ctl, stripe->curl, res, stripe->offset + start, received,
+          stripe->size - start, &permanent, &retry_after);
+      note_mirror_result(reader, stripe->mirror, stripe->curl,
+                         result == HTTP_RESULT_OK, received);
+
+      if (result != HTTP_RESULT_OK && response_code != 206) {
+        // Whatever arrived is not the requested part of the file
+        stripe->response.size = start;
+        received = 0;
+        if (start > 0 && response_code == 200) {
+          // If-Range did not match: the file changed under us
+          fprintf(stderr, "- Error: Remote file changed during download\n");
+          permanent = 1;
+        }
+      }
+
+      if (result == HTTP_RESULT_OK) {
+        stripe->state = STRIPE_DONE;
+        finish_stripe(reader, stripe);
+        remaining--;
+      } else if (received > 0 && !permanent) {
+        stripe->state = STRIPE_PENDING;
+        stripe->attempts = 0;
+        stripe->retry_at =
+            http_now() + http_ctl_backoff_ms(ctl, 0, retry_after) / 1000.0;
+      } else if (permanent || ++stripe->attempts >= HTTP_MAX_RETRIES) {
+        stripe->state = STRIPE_PENDING;
+        failed = 1;
+      } else {
+        stripe->state = STRIPE_PENDING;
+        stripe->retry_at =
+            http_now() +
+            http_ctl_backoff_ms(ctl, stripe->attempts - 1, retry_after) /
+                1000.0;
+      }
+    }
+
+    if (remaining > 0 && !failed && active > 0) {
+      curl_multi_wait(multi, NULL, 0, 100, NULL);
+    }
+  }
+
+  for (size_t i = 0; i < num_stripes; i++) {
+    if (stripes[i].state == STRIPE_ACTIVE) {
+      curl_multi_remove_handle(multi, stripes[i].curl);
+      http_ctl_release(ctl, HTTP_RESULT_FAILED, 0, 0.0, 0.0);
+      if (reader->num_mirrors > 0) {
+        http_mutex_lock(&reader->lock);
+        reader->mirrors[stripes[i].mirror].in_flight--;
+        http_mutex_unlock(&reader->lock);
+      }
+    }
+    finish_stripe(reader, &stripes[i]);
+  }
+  http_multi_release(reader, multi);
+  free(stripes);
+
+  return failed ? -1 : 0;
+}
+
+// Reads that fit in one stripe go out as a single request; larger ones
+// are striped. The stripe never exceeds the controller's range size.
+static int http_fetch_range(http_reader_t *reader, uint64_t offset,
+                            uint8_t *buffer, size_t to_read,
+                            size_t *bytes_read) {
+  size_t stripe_size = http_ctl_range_size(http_ctl_get());
+  if (g_stripe_size < stripe_size) {
+    stripe_size = g_stripe_size;
+  }
+
+  int result =
+      http_fetch_striped(reader, offset, buffer, to_read, stripe_size);
+  if (result != 0) {
+    return -1;
+  }
+
+  *bytes_read = to_read;
+  return 0;
+}
+
+// Waits while the background fill is fetching bytes in [offset, end).
+// Must be called with the reader lock held.
+static void wait_for_fill(http_reader_t *reader, uint64_t offset,
+                          uint64_t end) {
+  while (reader->fill_end > offset && reader->fill_start < end) {
+    http_cond_wait(&reader->fill_done, &reader->lock);
+  }
+}
+
+// Serves a read from the range cache, fetching only the chunk-aligned gaps
+// that are not on disk yet.
+static int http_read_cached(http_reader_t *reader, uint64_t offset,
+                            uint8_t *buffer, size_t to_read) {
+  http_cache_t *cache = reader->cache;
+  uint64_t end = offset + to_read;
+  uint64_t gap_start, gap_end;
+
+  while (1) {
+    http_mutex_lock(&reader->lock);
+    wait_for_fill(reader, offset, end);
+    int found = http_cache_next_gap(cache, offset, end, &gap_start, &gap_end);
+    http_mutex_unlock(&reader->lock);
+    if (found != 0) {
+      break;
+    }
+
+    size_t gap_size = (size_t)(gap_end - gap_start);
+    uint8_t *gap_data = malloc(gap_size);
+    if (!gap_data) {
+      return -1;
+    }
+
+    size_t fetched;
+    if (http_fetch_range(reader, gap_start, gap_data, gap_size, &fetched) !=
+        0) {
+      free(gap_data);
+      return -1;
+    }
+
+    http_mutex_lock(&reader->lock);
+    int stored = http_cache_store(cache, gap_start, gap_data, gap_size);
+    http_mutex_unlock(&reader->lock);
+    free(gap_data);
+    if (stored != 0) {
+      return -1;
+    }
+  }
+
+  http_mutex_lock(&reader->lock);
+  int result = http_cache_read(cache, offset, buffer, to_read);
+  http_mutex_unlock(&reader->lock);
+  return result;
+}
+
+int http_reader_read_at(http_reader_t *reader, uint64_t offset, uint8_t *buffer,
+                        size_t size, size_t *bytes_read) {
+  if (offset >= reader->content_length) {
+    *bytes_read = 0;
+    return 0;
+  }
+
+  uint64_t remaining = reader->content_length - offset;
+  size_t to_read = (size < remaining) ? size : (size_t)remaining;
+
+  if (to_read == 0) {
+    *bytes_read = 0;
+    return 0;
+  }
+
+  if (reader->cache) {
+    if (http_read_cached(reader, offset, buffer, to_read) == 0) {
+      *bytes_read = to_read;
+      return 0;
+    }
+    fprintf(stderr, "- Warning: Range cache failed, reading directly\n");
+  }
+
+  return http_fetch_range(reader, offset, buffer, to_read, bytes_read);
+}
+
+// A contiguous stretch of the object fetched as one part of a multi-range
+// request. Requested ranges that are close together share a span.
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+  uint8_t *data;
+  uint64_t covered;
+} http_span_t;
+
+typedef struct {
+  http_response_t body;
+  size_t limit;
+  int oversized;
+  long status;
+  char *content_type;
+  char *content_range;
+} http_multipart_t;
+
+static size_t multipart_header_callback(char *buffer, size_t size,
+                                        size_t nitems, void *userdata) {
+  http_multipart_t *multipart = userdata;
+  size_t len = size * nitems;
+
+  if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    const char *code = memchr(buffer, ' ', len);
+    multipart->status = code ? strtol(code + 1, NULL, 10) : 0;
+    free(multipart->content_type);
+    free(multipart->content_range);
+    multipart->content_type = NULL;
+    multipart->content_range = NULL;
+    return len;
+  }
+
+  char *value;
+  if ((value = header_value(buffer, len, "Content-Type")) != NULL) {
+    free(multipart->content_type);
+    multipart->content_type = value;
+  } else if ((value = header_value(buffer, len, "Content-Range")) != NULL) {
+    free(multipart->content_range);
+    multipart->content_range = value;
+  }
+  return len;
+}
+
+// Only partial content is buffered. A 200 means the server ignored the
+// ranges and is about to send the whole object, and a body much larger than
+// the ranges means it merged them across the gaps; both transfers are cut.
+static size_t multipart_write_callback(char *contents, size_t size,
+                                       size_t nmemb, void *userdata) {
+  http_multipart_t *multipart = userdata;
+  size_t total_size = size * nmemb;
+  if (multipart->status != 206) {
+    return 0;
+  }
+  if (total_size > multipart->limit - multipart->body.size) {
+    multipart->oversized = 1;
+    return 0;
+  }
+  http_ctl_throttle(http_ctl_get(), total_size);
+  return http_write_callback(contents, size, nmemb, &multipart->body);
+}
+
+static int parse_content_range(const char *value, uint64_t *start,
+                               uint64_t *end) {
+  unsigned long long first, last;
+  if (!value || sscanf(value, "bytes %llu-%llu", &first, &last) != 2 ||
+      last < first) {
+    return -1;
+  }
+  *start = first;
+  *end = last + 1;
+  return 0;
+}
+
+// Copies one returned part into every span it overlaps. Servers may merge
+// or reorder the requested ranges, so parts are matched by offset only.
+static void distribute_part(http_span_t *spans, size_t num_spans,
+                            uint64_t start, uint64_t end,
+                            const uint8_t *data) {
+  for (size_t i = 0; i < num_spans; i++) {
+    uint64_t lo = (spans[i].start > start) ? spans[i].start : start;
+    uint64_t hi = (spans[i].end < end) ? spans[i].end : end;
+    if (lo < hi) {
+      memcpy(spans[i].data + (lo - spans[i].start), data + (lo - start),
+             (size_t)(hi - lo));
+      spans[i].covered += hi - lo;
+    }
+  }
+}
+
+static const uint8_t *find_bytes(const uint8_t *haystack, size_t size,
+                                 const char *needle, size_t needle_len) {
+  if (needle_len == 0 || size < needle_len) {
+    return NULL;
+  }
+  for (size_t i = 0; i + needle_len <= size; i++) {
+    if (haystack[i] == (uint8_t)needle[0] &&
+        memcmp(haystack + i, needle, needle_len) == 0) {
+      return haystack + i;
+    }
+  }
+  return NULL;
+}
+
+// Parses a multipart/byteranges body. Part lengths come from each part's
+// Content-Range, so binary data that happens to contain the boundary is
+// handled correctly.
+static int parse_multipart(const http_multipart_t *multipart,
+                           http_span_t *spans, size_t num_spans) {
+  const char *param = strstr(multipart->content_type, "boundary=");
+  if (!param) {
+    return -1;
+  }
+  param += strlen("boundary=");
+
+  char delimiter[128];
+  size_t boundary_len = strcspn(param, "\";\r\n ");
+  if (*param == '"') {
+    param++;
+    boundary_len = strcspn(param, "\"");
+  }
+  if (boundary_len == 0 || boundary_len + 2 >= sizeof(delimiter)) {
+    return -1;
+  }
+  snprintf(delimiter, sizeof(delimiter), "--%.*s", (int)boundary_len, param);
+  size_t delimiter_len = strlen(delimiter);
+
+  const uint8_t *pos = multipart->body.data;
+  const uint8_t *end = pos + multipart->body.size;
+
+  while (1) {
+    pos = find_bytes(pos, (size_t)(end - pos), delimiter, delimiter_len);
+    if (!pos) {
+      return -1;
+    }
+    pos += delimiter_len;
+    if (end - pos >= 2 && pos[0] == '-' && pos[1] == '-') {
+      return 0;
+    }
+
+    const uint8_t *headers_end =
+        find_bytes(pos, (size_t)(end - pos), "\r\n\r\n", 4);
+    if (!headers_end) {
+      return -1;
+    }
+
+    uint64_t part_start = 0, part_end = 0;
+    int have_range = 0;
+    const uint8_t *line = pos;
+    while (line < headers_end) {
+      const uint8_t *line_end =
+          find_bytes(line, (size_t)(headers_end + 2 - line), "\r\n", 2);
+      if (!line_end) {
+        break;
+      }
+      char *value = header_value((const char *)line, (size_t)(line_end - line),
+                                 "Content-Range");
+      if (value) {
+        have_range = (parse_content_range(value, &part_start, &part_end) == 0);
+        free(value);
+      }
+      line = line_end + 2;
+    }
+
+    const uint8_t *data = headers_end + 4;
+    if (!have_range || (uint64_t)(end - data) < part_end - part_start) {
+      return -1;
+    }
+    distribute_part(spans, num_spans, part_start, part_end, data);
+    pos = data + (part_end - part_start);
+  }
+}
+
+// Fetches several spans with one request. Returns 1 if the server does not
+// do multi-range requests, so that the caller can fall back to single
+// ranges.
+static int http_fetch_multipart(http_reader_t *reader, http_span_t *spans,
+                                size_t num_spans) {
+  http_ctl_t *ctl = http_ctl_get();
+  CURL *curl = http_handle_acquire(reader);
+  if (!curl) {
+    return -1;
+  }
+
+  size_t header_size = 32 + num_spans * 42;
+  char *range_header = malloc(header_size);
+  if (!range_header) {
+    http_handle_release(reader, curl);
+    return -1;
+  }
+  size_t header_len =
+      (size_t)snprintf(range_header, header_size, "Range: bytes=");
+  size_t payload_bytes = 0;
+  for (size_t i = 0; i < num_spans; i++) {
+    header_len += (size_t)snprintf(
+        range_header + header_len, header_size - header_len,
+        "%s%" PRIu64 "-%" PRIu64, (i > 0) ? "," : "", spans[i].start,
+        spans[i].end - 1);
+    payload_bytes += (size_t)(spans[i].end - spans[i].start);
+  }
+
+  struct curl_slist *headers = NULL;
+  headers = curl_slist_append(headers, range_header);
+  free(range_header);
+
+  http_multipart_t multipart;
+  memset(&multipart, 0, sizeof(multipart));
+  multipart.limit = payload_bytes + 512 * (num_spans + 1);
+
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, multipart_header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &multipart);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, multipart_write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &multipart);
+
+  int result = -1;
+  for (int attempt = 0; attempt < HTTP_MAX_RETRIES; attempt++) {
+    multipart.body.size = 0;
+    multipart.status = 0;
+    multipart.oversized = 0;
+    for (size_t i = 0; i < num_spans; i++) {
+      spans[i].covered = 0;
+    }
+
+    int mirror = 0;
+    if (reader->num_mirrors > 0) {
+      mirror = acquire_mirror(reader);
+      curl_easy_setopt(curl, CURLOPT_URL, reader->mirrors[mirror].url);
+    }
+
+    http_ctl_acquire(ctl);
+    CURLcode res = curl_easy_perform(curl);
+
+    long response_code = 0;
+    curl_off_t ttfb_us = 0, total_us = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+
+    http_result_t outcome = HTTP_RESULT_FAILED;
+    if (response_code == 200 || multipart.oversized ||
+        (res == CURLE_OK && response_code / 100 == 2 &&
+         response_code != 206)) {
+      // Not an error, the server just answers with the whole object
+      http_ctl_release(ctl, HTTP_RESULT_OK, 0, (double)ttfb_us / 1e6,
+                       (double)total_us / 1e6);
+      note_mirror_result(reader, mirror, curl, 1, 0);
+      result = 1;
+      break;
+    }
+
+    if (res == CURLE_OK && response_code == 206) {
+      int parsed;
+      if (multipart.content_type &&
+          strncasecmp(multipart.content_type, "multipart/byteranges", 20) ==
+              0) {
+        parsed = parse_multipart(&multipart, spans, num_spans);
+      } else {
+        // The server merged everything into a single range
+        uint64_t start, end;
+        parsed = parse_content_range(multipart.content_range, &start, &end);
+        if (parsed == 0 && end - start == multipart.body.size) {
+          distribute_part(spans, num_spans, start, end, multipart.body.data);
+        } else {
+          parsed = -1;
+        }
+      }
+
+      int complete = (parsed == 0);
+      for (size_t i = 0; complete && i < num_spans; i++) {
+        complete = (spans[i].covered == spans[i].end - spans[i].start);
+      }
+      outcome = complete ? HTTP_RESULT_OK : HTTP_RESULT_FAILED;
+    } else {
+      outcome = classify_result(res, response_code, 1, 0, 1);
+    }
+
+    http_ctl_release(ctl, outcome, multipart.body.size, (double)ttfb_us / 1e6,
+                     (double)total_us / 1e6);
+    note_connections(ctl, curl);
+    note_mirror_result(reader, mirror, curl, outcome == HTTP_RESULT_OK,
+                       multipart.body.size);
+
+    if (outcome == HTTP_RESULT_OK) {
+      result = 0;
+      break;
+    }
+    if (res == CURLE_OK && response_code >= 400 && response_code < 500 &&
+        response_code != 408 && response_code != 429) {
+      // 416 and friends: let the caller retry the ranges one by one
+      result = 1;
+      break;
+    }
+    if (attempt + 1 < HTTP_MAX_RETRIES) {
+      http_sleep_ms(http_ctl_backoff_ms(ctl, attempt, 0));
+    }
+  }
+
+  curl_easy_setopt(curl, CURLOPT_URL, reader->url);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+  curl_slist_free_all(headers);
+  http_handle_release(reader, curl);
+
+  free(multipart.body.data);
+  free(multipart.content_type);
+  free(multipart.content_range);
+  return result;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+  const http_range_t *ra = *(const http_range_t *const *)a;
+  const http_range_t *rb = *(const http_range_t *const *)b;
+  return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+// Fetches a group of spans, with one multi-range request where possible,
+// then copies the data out to the ranges that were asked for.
+static int fetch_span_group(http_reader_t *reader, http_span_t *spans,
+                            size_t num_spans, http_range_t **sorted,
+                            size_t first_range, size_t num_ranges) {
+  int result = 1;
+  if (num_spans > 1 && !reader->multirange_disabled) {
+    result = http_fetch_multipart(reader, spans, num_spans);
+    if (result == 1) {
+      http_mutex_lock(&reader->lock);
+      reader->multirange_disabled = 1;
+      http_mutex_unlock(&reader->lock);
+    }
+  }
+  if (result == 1) {
+    for (size_t i = 0; i < num_spans; i++) {
+      size_t fetched;
+      if (http_fetch_range(reader, spans[i].start, spans[i].data,
+                           (size_t)(spans[i].end - spans[i].start),
+                           &fetched) != 0) {
+        return -1;
+      }
+    }
+    result = 0;
+  }
+  if (result != 0) {
+    return -1;
+  }
+
+  for (size_t i = first_range; i < first_range + num_ranges; i++) {
+    http_range_t *range = sorted[i];
+    for (size_t j = 0; j < num_spans; j++) {
+      if (range->offset >= spans[j].start &&
+          range->offset + range->size <= spans[j].end) {
+        memcpy(range->buffer, spans[j].data + (range->offset - spans[j].start),
+               range->size);
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// Reads many small ranges with as few requests as possible. Ranges are
+// sorted, ranges close to each other are merged into spans, and up to
+// HTTP_MULTIRANGE_MAX_PARTS spans go into one multi-range request that is
+// no larger than the controller's current range size.
+static int http_fetch_ranges(http_reader_t *reader, http_range_t *ranges,
+                             size_t count) {
+  http_range_t **sorted = malloc(count * sizeof(http_range_t *));
+  http_span_t *spans = malloc(HTTP_MULTIRANGE_MAX_PARTS * sizeof(http_span_t));
+  if (!sorted || !spans) {
+    free(sorted);
+    free(spans);
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    sorted[i] = &ranges[i];
+  }
+  qsort(sorted, count, sizeof(http_range_t *), compare_ranges);
+
+  size_t request_limit = http_ctl_range_size(http_ctl_get());
+  int result = 0;
+  size_t i = 0;
+
+  while (result == 0 && i < count) {
+    size_t first_range = i;
+    size_t num_spans = 0;
+    size_t total = 0;
+
+    while (i < count) {
+      http_range_t *range = sorted[i];
+      uint64_t range_end = range->offset + range->size;
+      if (range->size == 0) {
+        i++;
+        continue;
+      }
+
+      http_span_t *last = (num_spans > 0) ? &spans[num_spans - 1] : NULL;
+      if (last && range->offset <= last->end + HTTP_MULTIRANGE_MERGE_GAP) {
+        uint64_t new_end = (range_end > last->end) ? range_end : last->end;
+        if (total + (size_t)(new_end - last->end) > request_limit) {
+          break;
+        }
+        total += (size_t)(new_end - last->end);
+        last->end = new_end;
+      } else {
+        if (num_spans == HTTP_MULTIRANGE_MAX_PARTS ||
+            (num_spans > 0 && total + range->size > request_limit)) {
+          break;
+        }
+        spans[num_spans].start = range->offset;
+        spans[num_spans].end = range_end;
+        num_spans++;
+        total += range->size;
+      }
+      i++;
+    }
+
+    if (num_spans == 0) {
+      continue;
+    }
+
+    uint8_t *data = malloc(total);
+    if (!data) {
+      result = -1;
+      break;
+    }
+    size_t span_pos = 0;
+    for (size_t j = 0; j < num_spans; j++) {
+      spans[j].data = data + span_pos;
+      span_pos += (size_t)(spans[j].end - spans[j].start);
+    }
+
+    result = fetch_span_group(reader, spans, num_spans, sorted, first_range,
+                              i - first_range);
+    free(data);
+  }
+
+  free(spans);
+  free(sorted);
+  return result;
+}
+
+static int compare_gaps(const void *a, const void *b) {
+  const http_range_t *ga = a;
+  const http_range_t *gb = b;
+  return (ga->offset > gb->offset) - (ga->offset < gb->offset);
+}
+
+// Collects the missing chunks of all ranges, fetches them together and
+// then serves every range from the cache.
+static int http_read_ranges_cached(http_reader_t *reader, http_range_t *ranges,
+                                   size_t count) {
+  http_cache_t *cache = reader->cache;
+  size_t num_gaps = 0, gaps_capacity = count + 1;
+  http_range_t *gaps = malloc(gaps_capacity * sizeof(http_range_t));
+  if (!gaps) {
+    return -1;
+  }
+
+  http_mutex_lock(&reader->lock);
+  for (size_t i = 0; i < count; i++) {
+    uint64_t offset = ranges[i].offset;
+    uint64_t end = offset + ranges[i].size;
+    uint64_t gap_start, gap_end;
+    wait_for_fill(reader, offset, end);
+    while (http_cache_next_gap(cache, offset, end, &gap_start, &gap_end) ==
+           0) {
+      if (num_gaps == gaps_capacity) {
+        gaps_capacity *= 2;
+        http_range_t *grown = realloc(gaps, gaps_capacity * sizeof(*gaps));
+        if (!grown) {
+          http_mutex_unlock(&reader->lock);
+          free(gaps);
+          return -1;
+        }
+        gaps = grown;
+      }
+      gaps[num_gaps].offset = gap_start;
+      gaps[num_gaps].size = (size_t)(gap_end - gap_start);
+      gaps[num_gaps].buffer = NULL;
+      num_gaps++;
+      offset = gap_end;
+    }
+  }
+  http_mutex_unlock(&reader->lock);
+
+  // Neighbouring ranges often miss the same chunk
+  qsort(gaps, num_gaps, sizeof(http_range_t), compare_gaps);
+  size_t merged = 0;
+  for (size_t i = 0; i < num_gaps; i++) {
+    if (merged > 0 && gaps[i].offset <= gaps[merged - 1].offset +
+                                             gaps[merged - 1].size) {
+      uint64_t end = gaps[i].offset + gaps[i].size;
+      uint64_t last_end = gaps[merged - 1].offset + gaps[merged - 1].size;
+      if (end > last_end) {
+        gaps[merged - 1].size += (size_t)(end - last_end);
+      }
+    } else {
+      gaps[merged++] = gaps[i];
+    }
+  }
+  num_gaps = merged;
+
+  size_t total = 0;
+  for (size_t i = 0; i < num_gaps; i++) {
+    total += gaps[i].size;
+  }
+  uint8_t *data = (total > 0) ? malloc(total) : NULL;
+  int result = (total > 0 && !data) ? -1 : 0;
+
+  if (result == 0 && num_gaps > 0) {
+    size_t pos = 0;
+    for (size_t i = 0; i < num_gaps; i++) {
+      gaps[i].buffer = data + pos;
+      pos += gaps[i].size;
+    }
+    result = http_fetch_ranges(reader, gaps, num_gaps);
+
+    http_mutex_lock(&reader->lock);
+    for (size_t i = 0; result == 0 && i < num_gaps; i++) {
+      result = http_cache_store(cache, gaps[i].offset, gaps[i].buffer,
+                                gaps[i].size);
+    }
+    http_mutex_unlock(&reader->lock);
+  }
+  free(data);
+  free(gaps);
+
+  http_mutex_lock(&reader->lock);
+  for (size_t i = 0; result == 0 && i < count; i++) {
+    result = http_cache_read(cache, ranges[i].offset, ranges[i].buffer,
+                             ranges[i].size);
+  }
+  http_mutex_unlock(&reader->lock);
+  return result;
+}
+
+int http_reader_read_ranges(http_reader_t *reader, http_range_t *ranges,
+                            size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (ranges[i].offset + ranges[i].size > reader->content_length) {
+      return -1;
+    }
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  if (reader->cache && http_read_ranges_cached(reader, ranges, count) == 0) {
+    return 0;
+  }
+  return http_fetch_ranges(reader, ranges, count);
 }
 
 int http_reader_read(http_reader_t *reader, uint8_t *buffer, size_t size,
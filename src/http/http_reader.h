@@ -1,12 +1,26 @@
 #ifndef HTTP_READER_H
 #define HTTP_READER_H
 
+#include "http_cache.h"
+#include "http_ctl.h"
 #include <curl/curl.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define HTTP_TIMEOUT 600L
 #define HTTP_MAX_RETRIES 3
+#define HTTP_DEFAULT_STRIPE_SIZE (8 * 1024 * 1024)
+#define HTTP_MAX_STRIPES 8
+#define HTTP_FILL_CHUNK_SIZE (1024 * 1024)
+#define HTTP_FILL_MAX_FAILURES 10
+#define HTTP_MULTIRANGE_MAX_PARTS 32
+#define HTTP_MULTIRANGE_MERGE_GAP (16 * 1024)
+#define HTTP_MAX_MIRRORS 8
+#define HTTP_MIRROR_PROBE_SIZE (64 * 1024)
+#define HTTP_MIRROR_MAX_FAILURES 5
+#define HTTP_MIRROR_MIN_SAMPLE (64 * 1024)
+#define HTTP_LOW_SPEED_LIMIT 4096L
+#define HTTP_LOW_SPEED_TIME 20L
 
 typedef struct {
   uint8_t *data;
@@ -14,28 +28,100 @@ typedef struct {
   size_t capacity;
 } http_response_t;
 
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} http_buffer_t;
+
+typedef struct {
+  uint64_t offset;
+  size_t size;
+  uint8_t *buffer;
+} http_range_t;
+
+// One URL serving the same object. Requests are spread over the mirrors
+// of a reader in proportion to the throughput each one delivers.
+typedef struct {
+  char *url;
+  char *validator; // For If-Range when resuming from this mirror
+  int in_flight;
+  double throughput_ewma;
+  int failures; // Consecutive failed requests
+  double avoid_until;
+  int disabled;
+  uint64_t requests;
+  uint64_t bytes;
+} http_mirror_t;
+
 typedef struct {
   char *url;
   CURL *curl;
+  CURL *idle_handles[HTTP_MAX_INFLIGHT];
+  int num_idle_handles;
+  CURLM *idle_multis[HTTP_MAX_INFLIGHT]; // One per concurrent caller
+  int num_idle_multis;
+  http_mutex_t lock;
   uint64_t content_length;
   uint64_t current_pos;
   int supports_ranges;
+  int multirange_disabled;
   char *user_agent;
+  char *etag;
+  char *last_modified;
+  http_cache_t *cache;
+  int saving_source;
+  http_thread_t fill_thread;
+  int fill_started;
+  int fill_stop;
+  int fill_urgent;
+  int fill_failed;
+  uint64_t fill_start;
+  uint64_t fill_end;
+  http_cond_t fill_done;
+  http_mirror_t mirrors[HTTP_MAX_MIRRORS]; // mirrors[0] is `url` itself
+  int num_mirrors;
 } http_reader_t;
 
+// A plain GET of the whole file, fed into a pipe by a background thread
+// for servers that ignore Range requests.
+typedef struct {
+  CURL *curl;
+  FILE *file; // Read end of the pipe, handed to the consumer
+  int write_fd;
+  http_thread_t thread;
+  CURLcode result;
+} http_stream_t;
+
 size_t http_write_callback(void *contents, size_t size, size_t nmemb,
                            http_response_t *response);
+size_t http_buffer_write_callback(char *contents, size_t size, size_t nmemb,
+                                  void *userdata);
+size_t http_header_callback(char *buffer, size_t size, size_t nitems,
+                            http_reader_t *reader);
+
+void http_set_cache_dir(const char *cache_dir);
+void http_set_stripe_size(size_t stripe_size);
+void http_set_save_source(const char *path);
+int http_add_mirror(const char *url);
+void http_set_max_rate(uint64_t bytes_per_second);
+int http_set_rate_file(const char *path);
+void http_print_stats(void);
+void http_print_mirror_stats(const http_reader_t *reader);
 
 int http_reader_init(http_reader_t *reader, const char *url, int silent);
 void http_reader_cleanup(http_reader_t *reader);
 int http_reader_seek(http_reader_t *reader, uint64_t offset);
 int http_reader_read_at(http_reader_t *reader, uint64_t offset, uint8_t *buffer,
                         size_t size, size_t *bytes_read);
+int http_reader_read_ranges(http_reader_t *reader, http_range_t *ranges,
+                            size_t count);
 int http_reader_read(http_reader_t *reader, uint8_t *buffer, size_t size,
                      size_t *bytes_read);
 uint64_t http_reader_get_size(http_reader_t *reader);
+int http_reader_finish_source(http_reader_t *reader);
 void http_reader_set_user_agent(http_reader_t *reader, const char *user_agent);
-
-char *format_size(uint64_t bytes);
+http_stream_t *http_stream_open(const char *url, const char *user_agent);
+void http_stream_close(void *stream);
 
 #endif
@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include "inflate_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+    #define strdup _strdup
+#endif
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint64_t get_le(const uint8_t *data, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes; i-- > 0;) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+static void free_points(inflate_reader_t *reader) {
+  for (size_t i = 0; i < reader->num_points; i++) {
+    free(reader->points[i].window);
+  }
+  free(reader->points);
+  reader->points = NULL;
+  reader->num_points = 0;
+  reader->points_capacity = 0;
+}
+
+// Returns the last checkpoint at or before `offset`, or NULL if the
+// stream has to be inflated from its start.
+static const inflate_point_t *find_point(const inflate_reader_t *reader,
+                                         uint64_t offset) {
+  size_t low = 0, high = reader->num_points;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (reader->points[mid].out <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return (low > 0) ? &reader->points[low - 1] : NULL;
+}
+
+static void cursor_stop(inflate_cursor_t *cursor) {
+  if (cursor->active) {
+    inflateEnd(&cursor->strm);
+    cursor->active = 0;
+  }
+}
+
+// Positions `cursor` at `point`, or at the start of the stream.
+static int cursor_start(inflate_reader_t *reader, inflate_cursor_t *cursor,
+                        const inflate_point_t *point) {
+  cursor_stop(cursor);
+  if (!cursor->input) {
+    cursor->input = malloc(INFLATE_INPUT_SIZE);
+    cursor->window = malloc(INFLATE_WINDOW_SIZE);
+    if (!cursor->input || !cursor->window) {
+      return -1;
+    }
+  }
+
+  memset(&cursor->strm, 0, sizeof(z_stream));
+  if (inflateInit2(&cursor->strm, -15) != Z_OK) {
+    return -1;
+  }
+  cursor->active = 1;
+  cursor->in_pos = point ? point->in : 0;
+  cursor->out_pos = point ? point->out : 0;
+  cursor->window_pos = 0;
+  if (!point) {
+    return 0;
+  }
+
+  if (point->bits) {
+    uint8_t byte;
+    size_t bytes_read;
+    if (reader->read_at(reader->source, reader->data_offset + point->in - 1,
+                        &byte, 1, &bytes_read) != 0 ||
+        bytes_read != 1) {
+      cursor_stop(cursor);
+      return -1;
+    }
+    inflatePrime(&cursor->strm, point->bits, byte >> (8 - point->bits));
+  }
+  if (point->window_len > 0 &&
+      inflateSetDictionary(&cursor->strm, point->window, point->window_len) !=
+          Z_OK) {
+    cursor_stop(cursor);
+    return -1;
+  }
+  memcpy(cursor->window, point->window, point->window_len);
+  cursor->window_pos = point->window_len;
+  return 0;
+}
+
+// Records a checkpoint at the cursor, which sits at a block boundary, if
+// it is far enough past the last one.
+static void add_point(inflate_reader_t *reader, inflate_cursor_t *cursor) {
+  uint64_t last = reader->num_points
+                      ? reader->points[reader->num_points - 1].out
+                      : 0;
+  if (cursor->out_pos < last + INFLATE_SPAN) {
+    return;
+  }
+
+  if (reader->num_points == reader->points_capacity) {
+    size_t capacity = reader->points_capacity ? reader->points_capacity * 2
+                                              : 64;
+    inflate_point_t *points =
+        realloc(reader->points, capacity * sizeof(inflate_point_t));
+    if (!points) {
+      return;
+    }
+    reader->points = points;
+    reader->points_capacity = capacity;
+  }
+
+  // Until the window first wraps it holds the whole output in order
+  uint32_t window_len = (cursor->out_pos < INFLATE_WINDOW_SIZE)
+                            ? (uint32_t)cursor->out_pos
+                            : INFLATE_WINDOW_SIZE;
+  uint8_t *window = malloc(window_len ? window_len : 1);
+  if (!window) {
+    return;
+  }
+  if (window_len < INFLATE_WINDOW_SIZE) {
+    memcpy(window, cursor->window, window_len);
+  } else {
+    size_t older = INFLATE_WINDOW_SIZE - cursor->window_pos;
+    memcpy(window, cursor->window + cursor->window_pos, older);
+    memcpy(window + older, cursor->window, cursor->window_pos);
+  }
+
+  inflate_point_t *point = &reader->points[reader->num_points++];
+  point->out = cursor->out_pos;
+  point->in = cursor->in_pos - cursor->strm.avail_in;
+  point->bits = cursor->strm.data_type & 7;
+  point->window_len = window_len;
+  point->window = window;
+  reader->points_changed = 1;
+}
+
+// Inflates until the cursor has passed offset + size, copying the part of
+// the output that falls into that range to `buffer`.
+static int cursor_inflate(inflate_reader_t *reader, inflate_cursor_t *cursor,
+                          uint64_t offset, uint8_t *buffer, size_t size) {
+  uint64_t end = offset + size;
+  z_stream *strm = &cursor->strm;
+
+  while (cursor->out_pos < end) {
+    if (strm->avail_in == 0) {
+      if (cursor->in_pos >= reader->compressed_size) {
+        return -1;
+      }
+      uint64_t left = reader->compressed_size - cursor->in_pos;
+      size_t chunk = (left < INFLATE_INPUT_SIZE) ? (size_t)left
+                                                 : INFLATE_INPUT_SIZE;
+      size_t bytes_read;
+      if (reader->read_at(reader->source, reader->data_offset + cursor->in_pos,
+                          cursor->input, chunk, &bytes_read) != 0 ||
+          bytes_read == 0) {
+        return -1;
+      }
+      strm->next_in = cursor->input;
+      strm->avail_in = (uInt)bytes_read;
+      cursor->in_pos += bytes_read;
+    }
+
+    if (cursor->window_pos == INFLATE_WINDOW_SIZE) {
+      cursor->window_pos = 0;
+    }
+    // Stopping at `end` leaves the cursor right where a following read
+    // starts
+    uint8_t *out = cursor->window + cursor->window_pos;
+    size_t space = INFLATE_WINDOW_SIZE - cursor->window_pos;
+    if (space > end - cursor->out_pos) {
+      space = (size_t)(end - cursor->out_pos);
+    }
+    strm->next_out = out;
+    strm->avail_out = (uInt)space;
+
+    int ret = inflate(strm, Z_BLOCK);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      return -1;
+    }
+
+    size_t have = space - strm->avail_out;
+    if (reader->on_data && have > 0) {
+      reader->on_data(reader->on_data_arg, cursor->out_pos, out, have);
+    }
+    uint64_t from = (cursor->out_pos > offset) ? cursor->out_pos : offset;
+    uint64_t to = (cursor->out_pos + have < end) ? cursor->out_pos + have : end;
+    if (from < to) {
+      memcpy(buffer + (from - offset), out + (from - cursor->out_pos),
+             (size_t)(to - from));
+    }
+    cursor->window_pos += have;
+    cursor->out_pos += have;
+
+    if (ret == Z_STREAM_END) {
+      return (cursor->out_pos >= end) ? 0 : -1;
+    }
+    if ((strm->data_type & 128) && !(strm->data_type & 64)) {
+      add_point(reader, cursor);
+    }
+  }
+  return 0;
+}
+
+int inflate_reader_init(inflate_reader_t *reader, inflate_read_fn read_at,
+                        void *source, uint64_t data_offset,
+                        uint64_t compressed_size, uint64_t uncompressed_size,
+                        uint32_t crc32, const char *index_path) {
+  memset(reader, 0, sizeof(inflate_reader_t));
+  reader->read_at = read_at;
+  reader->source = source;
+  reader->data_offset = data_offset;
+  reader->compressed_size = compressed_size;
+  reader->uncompressed_size = uncompressed_size;
+  reader->crc32 = crc32;
+
+  if (index_path) {
+    reader->index_path = strdup(index_path);
+    if (!reader->index_path) {
+      return -1;
+    }
+    // A missing or stale index is simply rebuilt while reading
+    inflate_reader_load_index(reader, index_path);
+  }
+  return 0;
+}
+
+void inflate_reader_cleanup(inflate_reader_t *reader) {
+  if (reader->index_path && reader->points_changed &&
+      inflate_reader_save_index(reader, reader->index_path) != 0) {
+    fprintf(stderr, "- Warning: Failed to save inflate index to %s\n",
+            reader->index_path);
+  }
+  for (int i = 0; i < INFLATE_CURSORS; i++) {
+    cursor_stop(&reader->cursors[i]);
+    free(reader->cursors[i].input);
+    free(reader->cursors[i].window);
+  }
+  free_points(reader);
+  free(reader->index_path);
+  reader->index_path = NULL;
+}
+
+int inflate_reader_seek(inflate_reader_t *reader, uint64_t offset) {
+  reader->current_pos = offset;
+  return 0;
+}
+
+int inflate_reader_read_at(inflate_reader_t *reader, uint64_t offset,
+                           uint8_t *buffer, size_t size, size_t *bytes_read) {
+  *bytes_read = 0;
+  if (offset >= reader->uncompressed_size) {
+    return 0;
+  }
+  if (size > reader->uncompressed_size - offset) {
+    size = (size_t)(reader->uncompressed_size - offset);
+  }
+
+  // Continue a cursor that is already between the nearest checkpoint and
+  // the offset; otherwise restart the least recently used one there.
+  const inflate_point_t *point = find_point(reader, offset);
+  uint64_t point_out = point ? point->out : 0;
+  inflate_cursor_t *cursor = NULL;
+  for (int i = 0; i < INFLATE_CURSORS; i++) {
+    inflate_cursor_t *candidate = &reader->cursors[i];
+    if (candidate->active && candidate->out_pos <= offset &&
+        candidate->out_pos >= point_out &&
+        (!cursor || candidate->out_pos > cursor->out_pos)) {
+      cursor = candidate;
+    }
+  }
+  if (!cursor) {
+    cursor = &reader->cursors[0];
+    for (int i = 1; i < INFLATE_CURSORS && cursor->active; i++) {
+      if (!reader->cursors[i].active ||
+          reader->cursors[i].last_used < cursor->last_used) {
+        cursor = &reader->cursors[i];
+      }
+    }
+    if (cursor_start(reader, cursor, point) != 0) {
+      return -1;
+    }
+  }
+  cursor->last_used = ++reader->clock;
+
+  if (cursor_inflate(reader, cursor, offset, buffer, size) != 0) {
+    fprintf(stderr, "- Error: Failed to inflate payload at offset %llu\n",
+            (unsigned long long)offset);
+    cursor_stop(cursor);
+    return -1;
+  }
+  *bytes_read = size;
+  return 0;
+}
+
+int inflate_reader_read(inflate_reader_t *reader, uint8_t *buffer, size_t size,
+                        size_t *bytes_read) {
+  int result = inflate_reader_read_at(reader, reader->current_pos, buffer, size,
+                                      bytes_read);
+  if (result == 0) {
+    reader->current_pos += *bytes_read;
+  }
+  return result;
+}
+
+// Layout: magic, version, the entry's compressed size, uncompressed size
+// and CRC-32, the span and the number of checkpoints, then per checkpoint
+// its offsets, bit count and window, all little-endian.
+int inflate_reader_save_index(const inflate_reader_t *reader,
+                              const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[40];
+  memcpy(header, INFLATE_INDEX_MAGIC, 4);
+  put_le(&header[4], INFLATE_INDEX_VERSION, 4);
+  put_le(&header[8], reader->compressed_size, 8);
+  put_le(&header[16], reader->uncompressed_size, 8);
+  put_le(&header[24], reader->crc32, 4);
+  put_le(&header[28], INFLATE_SPAN, 4);
+  put_le(&header[32], reader->num_points, 8);
+  int ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+  for (size_t i = 0; ok && i < reader->num_points; i++) {
+    const inflate_point_t *point = &reader->points[i];
+    uint8_t fields[21];
+    put_le(&fields[0], point->out, 8);
+    put_le(&fields[8], point->in, 8);
+    fields[16] = (uint8_t)point->bits;
+    put_le(&fields[17], point->window_len, 4);
+    ok = fwrite(fields, 1, sizeof(fields), file) == sizeof(fields) &&
+         fwrite(point->window, 1, point->window_len, file) ==
+             point->window_len;
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    remove(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Replaces the checkpoints with those saved in `path`. Fails and keeps the
+// current ones if the file is damaged or was made for other data.
+int inflate_reader_load_index(inflate_reader_t *reader, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[40];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, INFLATE_INDEX_MAGIC, 4) != 0 ||
+      get_le(&header[4], 4) != INFLATE_INDEX_VERSION ||
+      get_le(&header[8], 8) != reader->compressed_size ||
+      get_le(&header[16], 8) != reader->uncompressed_size ||
+      get_le(&header[24], 4) != reader->crc32 ||
+      get_le(&header[28], 4) != INFLATE_SPAN) {
+    fclose(file);
+    return -1;
+  }
+  uint64_t num_points = get_le(&header[32], 8);
+  if (num_points > reader->uncompressed_size / INFLATE_SPAN) {
+    fclose(file);
+    return -1;
+  }
+
+  inflate_reader_t loaded;
+  memset(&loaded, 0, sizeof(loaded));
+  loaded.points = calloc(num_points ? num_points : 1, sizeof(inflate_point_t));
+  int ok = loaded.points != NULL;
+  loaded.points_capacity = num_points;
+
+  uint64_t last_out = 0;
+  for (uint64_t i = 0; ok && i < num_points; i++) {
+    inflate_point_t *point = &loaded.points[i];
+    uint8_t fields[21];
+    if (fread(fields, 1, sizeof(fields), file) != sizeof(fields)) {
+      ok = 0;
+      break;
+    }
+    point->out = get_le(&fields[0], 8);
+    point->in = get_le(&fields[8], 8);
+    point->bits = fields[16];
+    point->window_len = (uint32_t)get_le(&fields[17], 4);
+    if (point->out <= last_out || point->out > reader->uncompressed_size ||
+        point->in > reader->compressed_size || point->bits > 7 ||
+        (point->bits && point->in == 0) ||
+        point->window_len > INFLATE_WINDOW_SIZE) {
+      ok = 0;
+      break;
+    }
+    point->window = malloc(point->window_len ? point->window_len : 1);
+    loaded.num_points++;
+    if (!point->window || fread(point->window, 1, point->window_len, file) !=
+                              point->window_len) {
+      ok = 0;
+      break;
+    }
+    last_out = point->out;
+  }
+  fclose(file);
+
+  if (!ok) {
+    free_points(&loaded);
+    return -1;
+  }
+  free_points(reader);
+  reader->points = loaded.points;
+  reader->num_points = loaded.num_points;
+  reader->points_capacity = loaded.points_capacity;
+  reader->points_changed = 0;
+  return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef INFLATE_READER_H
+#define INFLATE_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#define INFLATE_SPAN (4 * 1024 * 1024)
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_INPUT_SIZE (128 * 1024)
+#define INFLATE_CURSORS 4
+#define INFLATE_INDEX_MAGIC "PDIX"
+#define INFLATE_INDEX_VERSION 1
+// Uncompressed size of a stream that does not record it, such as a gzip
+// file over 4 GiB; reads past the end of the data then fail
+#define INFLATE_SIZE_UNKNOWN UINT64_MAX
+
+// A place in the deflate stream where inflating can start over: the
+// uncompressed offset, the compressed offset of the first whole byte after
+// it, and the 32 KiB of output before it that later blocks may refer to.
+typedef struct {
+  uint64_t out;
+  uint64_t in;
+  int bits; // Bits of the byte before `in` that still belong to the stream
+  uint32_t window_len;
+  uint8_t *window;
+} inflate_point_t;
+
+// One live decompression, positioned at `out_pos`. `window` holds the last
+// INFLATE_WINDOW_SIZE bytes of output, wrapping at `window_pos`.
+typedef struct {
+  z_stream strm;
+  int active;
+  uint64_t in_pos;
+  uint64_t out_pos;
+  uint8_t *input;
+  uint8_t *window;
+  size_t window_pos;
+  uint64_t last_used;
+} inflate_cursor_t;
+
+typedef int (*inflate_read_fn)(void *source, uint64_t offset, uint8_t *buffer,
+                               size_t size, size_t *bytes_read);
+typedef void (*inflate_data_fn)(void *arg, uint64_t offset,
+                                const uint8_t *data, size_t size);
+
+// Random access to a raw deflate stream, such as a deflated ZIP entry.
+// Checkpoints are recorded every INFLATE_SPAN bytes of output as the
+// stream is first inflated, so that later reads start from the nearest
+// one instead of from the beginning. A few cursors are kept so readers
+// moving forward through different parts of the data each continue where
+// they left off.
+typedef struct {
+  inflate_read_fn read_at;
+  void *source;
+  uint64_t data_offset; // Start of the deflate stream in the source
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  uint32_t crc32;
+  inflate_point_t *points;
+  size_t num_points;
+  size_t points_capacity;
+  int points_changed;
+  char *index_path;
+  inflate_cursor_t cursors[INFLATE_CURSORS];
+  uint64_t clock;
+  uint64_t current_pos;
+  // Sees all output, including what is inflated only to be skipped over
+  inflate_data_fn on_data;
+  void *on_data_arg;
+} inflate_reader_t;
+
+int inflate_reader_init(inflate_reader_t *reader, inflate_read_fn read_at,
+                        void *source, uint64_t data_offset,
+                        uint64_t compressed_size, uint64_t uncompressed_size,
+                        uint32_t crc32, const char *index_path);
+void inflate_reader_cleanup(inflate_reader_t *reader);
+int inflate_reader_seek(inflate_reader_t *reader, uint64_t offset);
+int inflate_reader_read_at(inflate_reader_t *reader, uint64_t offset,
+                           uint8_t *buffer, size_t size, size_t *bytes_read);
+int inflate_reader_read(inflate_reader_t *reader, uint8_t *buffer, size_t size,
+                        size_t *bytes_read);
+int inflate_reader_save_index(const inflate_reader_t *reader,
+                              const char *path);
+int inflate_reader_load_index(inflate_reader_t *reader, const char *path);
+
+#endif
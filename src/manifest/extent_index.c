@@ -0,0 +1,233 @@
+#include "extent_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int compare_intervals(const void *a, const void *b) {
+  const extent_interval_t *ia = a;
+  const extent_interval_t *ib = b;
+  if (ia->start_block != ib->start_block) {
+    return (ia->start_block < ib->start_block) ? -1 : 1;
+  }
+  return (ia->op < ib->op) ? -1 : (ia->op > ib->op);
+}
+
+// Fills in max_end bottom up. Leaves are the even positions, and the
+// nodes of level k sit at positions ending in k one bits. A tree whose
+// size is not a power of two is missing part of its right edge; the
+// furthest end of the last real subtree stands in for it.
+static int build_tree(extent_interval_t *a, size_t n) {
+  size_t last_i = 0;
+  uint64_t last = 0;
+  for (size_t i = 0; i < n; i += 2) {
+    last_i = i;
+    last = a[i].max_end = a[i].end_block;
+  }
+
+  int k;
+  for (k = 1; ((size_t)1 << k) <= n; k++) {
+    size_t x = (size_t)1 << (k - 1);
+    size_t step = x << 2;
+    for (size_t i = (x << 1) - 1; i < n; i += step) {
+      uint64_t left = a[i - x].max_end;
+      uint64_t right = (i + x < n) ? a[i + x].max_end : last;
+      uint64_t max_end = a[i].end_block;
+      if (left > max_end) {
+        max_end = left;
+      }
+      if (right > max_end) {
+        max_end = right;
+      }
+      a[i].max_end = max_end;
+    }
+    // Move to the parent of the last node
+    last_i = ((last_i >> k) & 1) ? last_i - x : last_i + x;
+    if (last_i < n && a[last_i].max_end > last) {
+      last = a[last_i].max_end;
+    }
+  }
+  return k - 1;
+}
+
+int extent_index_build(extent_index_t *index, const op_table_t *table,
+                       const op_partition_t *partition) {
+  memset(index, 0, sizeof(extent_index_t));
+  size_t count = 0;
+  for (size_t op = partition->first_op;
+       op < partition->first_op + partition->num_ops; op++) {
+    count += table->num_extents[op];
+  }
+  index->intervals = malloc((count ? count : 1) * sizeof(extent_interval_t));
+  if (!index->intervals) {
+    return -1;
+  }
+
+  for (size_t op = partition->first_op;
+       op < partition->first_op + partition->num_ops; op++) {
+    const op_extent_t *extents = &table->extents[table->first_extent[op]];
+    for (uint32_t e = 0; e < table->num_extents[op]; e++) {
+      uint64_t end_block = extents[e].start_block + extents[e].num_blocks;
+      if (extents[e].num_blocks == 0 || end_block < extents[e].start_block) {
+        continue;
+      }
+      extent_interval_t *interval = &index->intervals[index->count++];
+      interval->start_block = extents[e].start_block;
+      interval->end_block = end_block;
+      interval->op = op;
+      if (end_block > index->end_block) {
+        index->end_block = end_block;
+      }
+    }
+  }
+  if (index->count > 1) {
+    qsort(index->intervals, index->count, sizeof(extent_interval_t),
+          compare_intervals);
+  }
+  index->levels = build_tree(index->intervals, index->count);
+  return 0;
+}
+
+void extent_index_free(extent_index_t *index) {
+  free(index->intervals);
+  memset(index, 0, sizeof(extent_index_t));
+}
+
+typedef struct {
+  size_t node;
+  int level;
+  int left_done;
+} tree_step_t;
+
+int extent_index_query(const extent_index_t *index, uint64_t start_block,
+                       uint64_t end_block, extent_visit_fn visit, void *ctx) {
+  const extent_interval_t *a = index->intervals;
+  size_t n = index->count;
+  if (n == 0 || start_block >= end_block) {
+    return 0;
+  }
+
+  // An in-order walk that skips subtrees ending before the range, and
+  // stops at the first node starting after it. Small subtrees are scanned
+  // instead.
+  tree_step_t stack[2 * 64];
+  int top = 0;
+  stack[top++] = (tree_step_t){((size_t)1 << index->levels) - 1,
+                               index->levels, 0};
+  while (top > 0) {
+    tree_step_t step = stack[--top];
+    if (step.level <= 3) {
+      size_t first = step.node >> step.level << step.level;
+      size_t last = first + ((size_t)1 << (step.level + 1)) - 1;
+      if (last > n) {
+        last = n;
+      }
+      for (size_t i = first; i < last && a[i].start_block < end_block; i++) {
+        if (start_block < a[i].end_block) {
+          int ret = visit(&a[i], ctx);
+          if (ret != 0) {
+            return ret;
+          }
+        }
+      }
+    } else if (!step.left_done) {
+      // The left child may lie past the end of a partial tree
+      size_t left = step.node - ((size_t)1 << (step.level - 1));
+      stack[top++] = (tree_step_t){step.node, step.level, 1};
+      if (left >= n || a[left].max_end > start_block) {
+        stack[top++] = (tree_step_t){left, step.level - 1, 0};
+      }
+    } else if (step.node < n && a[step.node].start_block < end_block) {
+      if (start_block < a[step.node].end_block) {
+        int ret = visit(&a[step.node], ctx);
+        if (ret != 0) {
+          return ret;
+        }
+      }
+      stack[top++] = (tree_step_t){
+          step.node + ((size_t)1 << (step.level - 1)), step.level - 1, 0};
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  size_t *ops;
+  size_t count;
+  size_t capacity;
+} op_list_t;
+
+static int add_op(const extent_interval_t *interval, void *ctx) {
+  op_list_t *list = ctx;
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 16;
+    size_t *ops = realloc(list->ops, capacity * sizeof(size_t));
+    if (!ops) {
+      return -1;
+    }
+    list->ops = ops;
+    list->capacity = capacity;
+  }
+  list->ops[list->count++] = interval->op;
+  return 0;
+}
+
+static int compare_ops(const void *a, const void *b) {
+  size_t oa = *(const size_t *)a;
+  size_t ob = *(const size_t *)b;
+  return (oa < ob) ? -1 : (oa > ob);
+}
+
+int extent_index_covering_ops(const extent_index_t *index,
+                              uint64_t start_block, uint64_t end_block,
+                              size_t **ops, size_t *num_ops) {
+  op_list_t list = {NULL, 0, 0};
+  if (extent_index_query(index, start_block, end_block, add_op, &list) != 0) {
+    free(list.ops);
+    return -1;
+  }
+
+  // An operation with several extents in the range is found once for each
+  if (list.count > 1) {
+    qsort(list.ops, list.count, sizeof(size_t), compare_ops);
+  }
+  size_t unique = 0;
+  for (size_t i = 0; i < list.count; i++) {
+    if (unique == 0 || list.ops[unique - 1] != list.ops[i]) {
+      list.ops[unique++] = list.ops[i];
+    }
+  }
+  *ops = list.ops;
+  *num_ops = unique;
+  return 0;
+}
+
+int extent_index_gaps(const extent_index_t *index, uint64_t num_blocks,
+                      op_extent_t **gaps, size_t *num_gaps) {
+  // There is at most one gap before each extent and one after the last
+  *gaps = malloc((index->count + 1) * sizeof(op_extent_t));
+  *num_gaps = 0;
+  if (!*gaps) {
+    return -1;
+  }
+
+  uint64_t covered = 0;
+  for (size_t i = 0; i < index->count && covered < num_blocks; i++) {
+    const extent_interval_t *interval = &index->intervals[i];
+    if (interval->start_block > covered) {
+      uint64_t gap_end = (interval->start_block < num_blocks)
+                             ? interval->start_block
+                             : num_blocks;
+      (*gaps)[*num_gaps].start_block = covered;
+      (*gaps)[*num_gaps].num_blocks = gap_end - covered;
+      (*num_gaps)++;
+    }
+    if (interval->end_block > covered) {
+      covered = interval->end_block;
+    }
+  }
+  if (covered < num_blocks) {
+    (*gaps)[*num_gaps].start_block = covered;
+    (*gaps)[*num_gaps].num_blocks = num_blocks - covered;
+    (*num_gaps)++;
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef EXTENT_INDEX_H
+#define EXTENT_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "op_table.h"
+
+// One destination extent of an operation, as the blocks [start_block,
+// end_block) of the partition
+typedef struct {
+  uint64_t start_block;
+  uint64_t end_block;
+  uint64_t max_end; // Highest end_block in this node's subtree
+  size_t op;        // Row in the op table
+} extent_interval_t;
+
+// The destination extents of one partition's operations, sorted by start
+// block and laid out as an implicit interval tree: the array in sorted
+// order is the in-order walk of a complete binary tree, and each node
+// records the furthest end below it. Finding the extents that overlap a
+// block range then takes O(log n) plus the number found, without storing
+// any pointers.
+typedef struct {
+  extent_interval_t *intervals;
+  size_t count;
+  int levels;         // Height of the tree
+  uint64_t end_block; // One past the highest block written
+} extent_index_t;
+
+int extent_index_build(extent_index_t *index, const op_table_t *table,
+                       const op_partition_t *partition);
+void extent_index_free(extent_index_t *index);
+
+// Called for each extent overlapping a query, in start block order.
+// Returning nonzero stops the query, which then returns that value.
+typedef int (*extent_visit_fn)(const extent_interval_t *interval, void *ctx);
+
+int extent_index_query(const extent_index_t *index, uint64_t start_block,
+                       uint64_t end_block, extent_visit_fn visit, void *ctx);
+
+// The op table rows that write any of the blocks [start_block, end_block),
+// each once and in the order they are applied. `*ops` is malloc()ed.
+int extent_index_covering_ops(const extent_index_t *index,
+                              uint64_t start_block, uint64_t end_block,
+                              size_t **ops, size_t *num_ops);
+
+// The runs of blocks below `num_blocks` that no operation writes, which
+// are left as zeroes in the image. `*gaps` is malloc()ed.
+int extent_index_gaps(const extent_index_t *index, uint64_t num_blocks,
+                      op_extent_t **gaps, size_t *num_gaps);
+
+#endif
@@ -0,0 +1,394 @@
+#include "manifest_scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Field numbers from update_metadata.proto
+#define MANIFEST_BLOCK_SIZE 3
+#define MANIFEST_PARTITIONS 13
+#define PARTITION_NAME 1
+#define PARTITION_NEW_INFO 7
+#define PARTITION_OPERATIONS 8
+#define PARTITION_INFO_SIZE 1
+#define OPERATION_TYPE 1
+#define OPERATION_DATA_OFFSET 2
+#define OPERATION_DATA_LENGTH 3
+#define OPERATION_SRC_EXTENTS 4
+#define OPERATION_SRC_LENGTH 5
+#define OPERATION_DST_EXTENTS 6
+#define OPERATION_DST_LENGTH 7
+#define OPERATION_DATA_SHA256 8
+#define OPERATION_SRC_SHA256 9
+#define EXTENT_START_BLOCK 1
+#define EXTENT_NUM_BLOCKS 2
+
+#define WIRE_VARINT 0
+#define WIRE_FIXED64 1
+#define WIRE_LENGTH 2
+#define WIRE_FIXED32 5
+
+// A position in a message's wire format
+typedef struct {
+  const uint8_t *pos;
+  const uint8_t *end;
+} wire_t;
+
+// The field the cursor was just moved past. Length-delimited fields have
+// their contents in `data`/`size`, varints their value in `value`.
+typedef struct {
+  uint32_t number;
+  int wire_type;
+  uint64_t value;
+  const uint8_t *data;
+  size_t size;
+} wire_field_t;
+
+static int read_varint(wire_t *wire, uint64_t *value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && wire->pos < wire->end; shift += 7) {
+    uint8_t byte = *wire->pos++;
+    result |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Reads the next field. Returns 0 for a field, 1 at the end of the message
+// and -1 if it is cut off or malformed.
+static int next_field(wire_t *wire, wire_field_t *field) {
+  if (wire->pos >= wire->end) {
+    return 1;
+  }
+  uint64_t key;
+  if (read_varint(wire, &key) != 0 || (key >> 3) == 0 ||
+      (key >> 3) > 0xFFFFFFFFu) {
+    return -1;
+  }
+  field->number = (uint32_t)(key >> 3);
+  field->wire_type = (int)(key & 7);
+  field->value = 0;
+  field->data = NULL;
+  field->size = 0;
+
+  size_t left;
+  switch (field->wire_type) {
+  case WIRE_VARINT:
+    return read_varint(wire, &field->value);
+  case WIRE_FIXED64:
+  case WIRE_FIXED32:
+    left = (size_t)(wire->end - wire->pos);
+    field->size = (field->wire_type == WIRE_FIXED64) ? 8 : 4;
+    if (left < field->size) {
+      return -1;
+    }
+    field->data = wire->pos;
+    wire->pos += field->size;
+    return 0;
+  case WIRE_LENGTH:
+    if (read_varint(wire, &field->value) != 0 ||
+        field->value > (uint64_t)(wire->end - wire->pos)) {
+      return -1;
+    }
+    field->data = wire->pos;
+    field->size = (size_t)field->value;
+    wire->pos += field->size;
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+static void wire_init(wire_t *wire, const uint8_t *data, size_t size) {
+  wire->pos = data;
+  wire->end = data + size;
+}
+
+int manifest_scan(const uint8_t *data, size_t size, manifest_scan_t *scan) {
+  memset(scan, 0, sizeof(manifest_scan_t));
+  scan->block_size = 4096;
+
+  // Count the partitions first, so they go into one array
+  wire_t wire;
+  wire_field_t field;
+  int ret;
+  size_t count = 0;
+  wire_init(&wire, data, size);
+  while ((ret = next_field(&wire, &field)) == 0) {
+    if (field.number == MANIFEST_PARTITIONS &&
+        field.wire_type == WIRE_LENGTH) {
+      count++;
+    }
+  }
+  if (ret < 0) {
+    return -1;
+  }
+  scan->partitions = calloc(count ? count : 1, sizeof(manifest_partition_t));
+  if (!scan->partitions) {
+    return -1;
+  }
+
+  wire_init(&wire, data, size);
+  while (next_field(&wire, &field) == 0) {
+    if (field.number == MANIFEST_BLOCK_SIZE && field.wire_type == WIRE_VARINT) {
+      scan->block_size = (uint32_t)field.value;
+      continue;
+    }
+    if (field.number != MANIFEST_PARTITIONS ||
+        field.wire_type != WIRE_LENGTH) {
+      continue;
+    }
+
+    manifest_partition_t *partition =
+        &scan->partitions[scan->num_partitions++];
+    partition->data = field.data;
+    partition->size = field.size;
+    wire_t part_wire;
+    wire_field_t part_field;
+    wire_init(&part_wire, field.data, field.size);
+    while ((ret = next_field(&part_wire, &part_field)) == 0) {
+      if (part_field.wire_type != WIRE_LENGTH) {
+        continue;
+      }
+      if (part_field.number == PARTITION_NAME) {
+        partition->name = (const char *)part_field.data;
+        partition->name_len = part_field.size;
+      } else if (part_field.number == PARTITION_NEW_INFO) {
+        wire_t info_wire;
+        wire_field_t info_field;
+        wire_init(&info_wire, part_field.data, part_field.size);
+        while (next_field(&info_wire, &info_field) == 0) {
+          if (info_field.number == PARTITION_INFO_SIZE &&
+              info_field.wire_type == WIRE_VARINT) {
+            partition->has_new_size = 1;
+            partition->new_size = info_field.value;
+          }
+        }
+      }
+    }
+    if (ret < 0 || !partition->name) {
+      manifest_scan_free(scan);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void manifest_scan_free(manifest_scan_t *scan) {
+  free(scan->partitions);
+  scan->partitions = NULL;
+  scan->num_partitions = 0;
+}
+
+int manifest_partition_selected(const manifest_partition_t *partition,
+                                const char *images_list) {
+  size_t list_len = strlen(images_list);
+  if (partition->name_len == 0 || partition->name_len > list_len) {
+    return 0;
+  }
+  for (size_t i = 0; i + partition->name_len <= list_len; i++) {
+    if (memcmp(images_list + i, partition->name, partition->name_len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Reads an Extent message
+static int decode_extent(const wire_field_t *field, uint64_t *start_block,
+                         uint64_t *num_blocks) {
+  wire_t wire;
+  wire_field_t extent_field;
+  int ret;
+  *start_block = 0;
+  *num_blocks = 0;
+  wire_init(&wire, field->data, field->size);
+  while ((ret = next_field(&wire, &extent_field)) == 0) {
+    if (extent_field.wire_type != WIRE_VARINT) {
+      continue;
+    }
+    if (extent_field.number == EXTENT_START_BLOCK) {
+      *start_block = extent_field.value;
+    } else if (extent_field.number == EXTENT_NUM_BLOCKS) {
+      *num_blocks = extent_field.value;
+    }
+  }
+  return (ret < 0) ? -1 : 0;
+}
+
+int manifest_partition_end_block(const manifest_partition_t *partition,
+                                 uint64_t *end_block) {
+  wire_t wire;
+  wire_field_t field;
+  int ret;
+  *end_block = 0;
+  wire_init(&wire, partition->data, partition->size);
+  while ((ret = next_field(&wire, &field)) == 0) {
+    if (field.number != PARTITION_OPERATIONS ||
+        field.wire_type != WIRE_LENGTH) {
+      continue;
+    }
+    wire_t op_wire;
+    wire_field_t op_field;
+    wire_init(&op_wire, field.data, field.size);
+    while ((ret = next_field(&op_wire, &op_field)) == 0) {
+      if (op_field.number != OPERATION_DST_EXTENTS ||
+          op_field.wire_type != WIRE_LENGTH) {
+        continue;
+      }
+      uint64_t start_block, num_blocks;
+      if (decode_extent(&op_field, &start_block, &num_blocks) != 0) {
+        return -1;
+      }
+      if (start_block + num_blocks > *end_block) {
+        *end_block = start_block + num_blocks;
+      }
+    }
+    if (ret < 0) {
+      return -1;
+    }
+  }
+  return (ret < 0) ? -1 : 0;
+}
+
+int manifest_count_operations(const manifest_partition_t *partition,
+                              size_t *num_ops, size_t *num_extents) {
+  wire_t wire;
+  wire_field_t field;
+  int ret;
+  *num_ops = 0;
+  *num_extents = 0;
+  wire_init(&wire, partition->data, partition->size);
+  while ((ret = next_field(&wire, &field)) == 0) {
+    if (field.number != PARTITION_OPERATIONS ||
+        field.wire_type != WIRE_LENGTH) {
+      continue;
+    }
+    (*num_ops)++;
+    wire_t op_wire;
+    wire_field_t op_field;
+    wire_init(&op_wire, field.data, field.size);
+    while ((ret = next_field(&op_wire, &op_field)) == 0) {
+      if (op_field.number == OPERATION_DST_EXTENTS &&
+          op_field.wire_type == WIRE_LENGTH) {
+        (*num_extents)++;
+      }
+    }
+    if (ret < 0) {
+      return -1;
+    }
+  }
+  return (ret < 0) ? -1 : 0;
+}
+
+// Appends one InstallOperation and its destination extents to the table
+static int decode_operation(const wire_field_t *op_field,
+                            const uint8_t *manifest_data, op_table_t *table) {
+  wire_t wire;
+  wire_field_t field;
+  int ret;
+  uint8_t type = 0;
+  uint64_t data_offset = 0;
+  uint64_t data_length = 0;
+  uint32_t hash_offset = OP_NO_HASH;
+
+  wire_init(&wire, op_field->data, op_field->size);
+  while ((ret = next_field(&wire, &field)) == 0) {
+    if (field.wire_type == WIRE_VARINT && field.number == OPERATION_TYPE) {
+      type = (uint8_t)field.value;
+    } else if (field.wire_type == WIRE_VARINT &&
+               field.number == OPERATION_DATA_OFFSET) {
+      data_offset = field.value;
+    } else if (field.wire_type == WIRE_VARINT &&
+               field.number == OPERATION_DATA_LENGTH) {
+      data_length = field.value;
+    } else if (field.wire_type == WIRE_LENGTH &&
+               field.number == OPERATION_DATA_SHA256) {
+      hash_offset = (uint32_t)(field.data - manifest_data);
+    }
+  }
+  if (ret < 0 ||
+      op_table_add_op(table, type, data_offset, data_length, hash_offset) < 0) {
+    return -1;
+  }
+
+  wire_init(&wire, op_field->data, op_field->size);
+  while (next_field(&wire, &field) == 0) {
+    if (field.number != OPERATION_DST_EXTENTS ||
+        field.wire_type != WIRE_LENGTH) {
+      continue;
+    }
+    uint64_t start_block, num_blocks;
+    if (decode_extent(&field, &start_block, &num_blocks) != 0 ||
+        op_table_add_extent(table, start_block, num_blocks) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int manifest_decode_partition(const manifest_partition_t *partition,
+                              const uint8_t *manifest_data,
+                              op_table_t *table) {
+  op_partition_t *row = op_table_add_partition(table, partition->name,
+                                               partition->name_len);
+  if (!row) {
+    return -1;
+  }
+  row->has_new_size = partition->has_new_size;
+  row->new_size = partition->new_size;
+
+  wire_t wire;
+  wire_field_t field;
+  int ret;
+  wire_init(&wire, partition->data, partition->size);
+  while ((ret = next_field(&wire, &field)) == 0) {
+    if (field.number == PARTITION_OPERATIONS &&
+        field.wire_type == WIRE_LENGTH &&
+        decode_operation(&field, manifest_data, table) != 0) {
+      return -1;
+    }
+  }
+  return (ret < 0) ? -1 : 0;
+}
+
+static int partition_wanted(const manifest_partition_t *partition,
+                            const char *images_list) {
+  return !images_list || images_list[0] == '\0' ||
+         manifest_partition_selected(partition, images_list);
+}
+
+int manifest_build_op_table(const manifest_scan_t *scan,
+                            const uint8_t *manifest_data,
+                            const char *images_list, op_table_t *table) {
+  size_t num_partitions = 0;
+  size_t total_ops = 0;
+  size_t total_extents = 0;
+  for (size_t i = 0; i < scan->num_partitions; i++) {
+    if (!partition_wanted(&scan->partitions[i], images_list)) {
+      continue;
+    }
+    size_t num_ops, num_extents;
+    if (manifest_count_operations(&scan->partitions[i], &num_ops,
+                                  &num_extents) != 0) {
+      return -1;
+    }
+    num_partitions++;
+    total_ops += num_ops;
+    total_extents += num_extents;
+  }
+
+  if (op_table_init(table, num_partitions, total_ops, total_extents) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < scan->num_partitions; i++) {
+    if (partition_wanted(&scan->partitions[i], images_list) &&
+        manifest_decode_partition(&scan->partitions[i], manifest_data,
+                                  table) != 0) {
+      op_table_free(table);
+      return -1;
+    }
+  }
+  return 0;
+}
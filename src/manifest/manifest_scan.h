@@ -0,0 +1,58 @@
+#ifndef MANIFEST_SCAN_H
+#define MANIFEST_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "op_table.h"
+
+// One PartitionUpdate in the raw manifest. The name and message bytes
+// point into the manifest buffer, which must outlive the scan.
+typedef struct {
+  const char *name; // Not NUL-terminated
+  size_t name_len;
+  const uint8_t *data;
+  size_t size;
+  int has_new_size;
+  uint64_t new_size; // new_partition_info.size
+} manifest_partition_t;
+
+// The top level of a DeltaArchiveManifest, read straight from the wire
+// format without decoding any operations. Operations are decoded later,
+// per partition, for only the partitions that are wanted.
+typedef struct {
+  uint32_t block_size;
+  manifest_partition_t *partitions;
+  size_t num_partitions;
+} manifest_scan_t;
+
+int manifest_scan(const uint8_t *data, size_t size, manifest_scan_t *scan);
+void manifest_scan_free(manifest_scan_t *scan);
+
+// Whether the partition's name appears in the --images list
+int manifest_partition_selected(const manifest_partition_t *partition,
+                                const char *images_list);
+
+// One past the highest block any operation writes, found by walking the
+// operations' destination extents without decoding the rest
+int manifest_partition_end_block(const manifest_partition_t *partition,
+                                 uint64_t *end_block);
+
+// Counts the partition's operations and their destination extents, to
+// size an op_table_t
+int manifest_count_operations(const manifest_partition_t *partition,
+                              size_t *num_ops, size_t *num_extents);
+
+// Decodes the partition's operations into the next rows of `table`. Only
+// what extraction uses is kept: the type, the data range, the destination
+// extents and where the data hash sits in `manifest_data`.
+int manifest_decode_partition(const manifest_partition_t *partition,
+                              const uint8_t *manifest_data,
+                              op_table_t *table);
+// Builds the op table for the partitions named in `images_list`, or for
+// all of them when it is NULL or empty
+int manifest_build_op_table(const manifest_scan_t *scan,
+                            const uint8_t *manifest_data,
+                            const char *images_list, op_table_t *table);
+
+#endif
@@ -0,0 +1,91 @@
+#include "op_table.h"
+#include <string.h>
+
+int op_table_init(op_table_t *table, size_t num_partitions, size_t num_ops,
+                  size_t num_extents) {
+  memset(table, 0, sizeof(op_table_t));
+  // Partition names are short; the arena grows if one is not
+  size_t row_size = sizeof(uint8_t) + 2 * sizeof(uint64_t) +
+                    3 * sizeof(uint32_t);
+  size_t size = num_ops * row_size + num_extents * sizeof(op_extent_t) +
+                num_partitions * (sizeof(op_partition_t) + 32) +
+                8 * ARENA_ALIGN;
+  if (arena_init(&table->arena, size) != 0) {
+    return -1;
+  }
+
+  // Empty arrays still get a valid pointer from the arena
+  table->type = arena_alloc(&table->arena, num_ops * sizeof(uint8_t));
+  table->data_offset = arena_alloc(&table->arena, num_ops * sizeof(uint64_t));
+  table->data_length = arena_alloc(&table->arena, num_ops * sizeof(uint64_t));
+  table->first_extent = arena_alloc(&table->arena, num_ops * sizeof(uint32_t));
+  table->num_extents = arena_alloc(&table->arena, num_ops * sizeof(uint32_t));
+  table->hash_offset = arena_alloc(&table->arena, num_ops * sizeof(uint32_t));
+  table->extents =
+      arena_alloc(&table->arena, num_extents * sizeof(op_extent_t));
+  table->partitions =
+      arena_alloc(&table->arena, num_partitions * sizeof(op_partition_t));
+  if (!table->type || !table->data_offset || !table->data_length ||
+      !table->first_extent || !table->num_extents || !table->hash_offset ||
+      !table->extents || !table->partitions) {
+    arena_free(&table->arena);
+    return -1;
+  }
+  table->ops_capacity = num_ops;
+  table->extents_capacity = num_extents;
+  table->partitions_capacity = num_partitions;
+  return 0;
+}
+
+void op_table_free(op_table_t *table) {
+  arena_free(&table->arena);
+  memset(table, 0, sizeof(op_table_t));
+}
+
+op_partition_t *op_table_add_partition(op_table_t *table, const char *name,
+                                       size_t name_len) {
+  if (table->num_partitions == table->partitions_capacity) {
+    return NULL;
+  }
+  char *name_copy = arena_alloc(&table->arena, name_len + 1);
+  if (!name_copy) {
+    return NULL;
+  }
+  memcpy(name_copy, name, name_len);
+  name_copy[name_len] = '\0';
+
+  op_partition_t *partition = &table->partitions[table->num_partitions++];
+  memset(partition, 0, sizeof(op_partition_t));
+  partition->name = name_copy;
+  partition->first_op = table->num_ops;
+  return partition;
+}
+
+int64_t op_table_add_op(op_table_t *table, uint8_t type, uint64_t data_offset,
+                        uint64_t data_length, uint32_t hash_offset) {
+  if (table->num_ops == table->ops_capacity || table->num_partitions == 0) {
+    return -1;
+  }
+  size_t row = table->num_ops++;
+  table->type[row] = type;
+  table->data_offset[row] = data_offset;
+  table->data_length[row] = data_length;
+  table->first_extent[row] = (uint32_t)table->num_extents_total;
+  table->num_extents[row] = 0;
+  table->hash_offset[row] = hash_offset;
+  table->partitions[table->num_partitions - 1].num_ops++;
+  return (int64_t)row;
+}
+
+int op_table_add_extent(op_table_t *table, uint64_t start_block,
+                        uint64_t num_blocks) {
+  if (table->num_extents_total == table->extents_capacity ||
+      table->num_ops == 0 || table->num_extents_total >= UINT32_MAX) {
+    return -1;
+  }
+  op_extent_t *extent = &table->extents[table->num_extents_total++];
+  extent->start_block = start_block;
+  extent->num_blocks = num_blocks;
+  table->num_extents[table->num_ops - 1]++;
+  return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef OP_TABLE_H
+#define OP_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define OP_NO_HASH UINT32_MAX
+
+typedef struct {
+  uint64_t start_block;
+  uint64_t num_blocks;
+} op_extent_t;
+
+// A partition's operations are the `num_ops` table rows from `first_op`
+typedef struct {
+  char *name;
+  size_t first_op;
+  size_t num_ops;
+  int has_new_size;
+  uint64_t new_size;
+} op_partition_t;
+
+// The operations of the partitions being extracted, flattened into
+// parallel arrays with one row per operation, and one array of the
+// destination extents they all write. Extraction walks these in order
+// instead of chasing a pointer per operation and extent. Everything lives
+// in one arena sized up front and is released with it.
+typedef struct {
+  size_t num_ops;
+  uint8_t *type;         // ChromeosUpdateEngine__InstallOperation__Type
+  uint64_t *data_offset; // Relative to the payload data
+  uint64_t *data_length; // 0 for operations without data
+  uint32_t *first_extent;
+  uint32_t *num_extents;
+  uint32_t *hash_offset; // data_sha256_hash in the manifest, or OP_NO_HASH
+
+  op_extent_t *extents;
+  size_t num_extents_total;
+
+  op_partition_t *partitions;
+  size_t num_partitions;
+
+  size_t ops_capacity;
+  size_t extents_capacity;
+  size_t partitions_capacity;
+  arena_t arena;
+} op_table_t;
+
+int op_table_init(op_table_t *table, size_t num_partitions, size_t num_ops,
+                  size_t num_extents);
+void op_table_free(op_table_t *table);
+
+// Starts a partition whose operations are appended next. Returns NULL
+// once the table is full.
+op_partition_t *op_table_add_partition(op_table_t *table, const char *name,
+                                       size_t name_len);
+// Appends an operation to the last partition. Its extents are appended
+// with op_table_add_extent right after. Returns the row, or -1 once the
+// table is full.
+int64_t op_table_add_op(op_table_t *table, uint8_t type, uint64_t data_offset,
+                        uint64_t data_length, uint32_t hash_offset);
+int op_table_add_extent(op_table_t *table, uint64_t start_block,
+                        uint64_t num_blocks);
+
+#endif
@@ -0,0 +1,456 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE
+#endif
+#include "payload_index.h"
+#include "extent_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#define realpath(path, resolved) _fullpath((resolved), (path), 0)
+#endif
+
+#define HEADER_SIZE 96
+#define RECORD_SIZE 64
+#define BYTE_ORDER_MARK 0x01020304u
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint64_t get_le(const uint8_t *data, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+// Where each op table column starts, relative to the first one. The
+// 8-byte columns come first so that every column stays aligned.
+typedef struct {
+  uint64_t data_offset;
+  uint64_t data_length;
+  uint64_t extents;
+  uint64_t first_extent;
+  uint64_t num_extents;
+  uint64_t hash_offset;
+  uint64_t type;
+} column_layout_t;
+
+static void column_layout(uint64_t num_ops, uint64_t num_extents,
+                          column_layout_t *layout) {
+  layout->data_offset = 0;
+  layout->data_length = layout->data_offset + num_ops * sizeof(uint64_t);
+  layout->extents = layout->data_length + num_ops * sizeof(uint64_t);
+  layout->first_extent = layout->extents + num_extents * sizeof(op_extent_t);
+  layout->num_extents = layout->first_extent + num_ops * sizeof(uint32_t);
+  layout->hash_offset = layout->num_extents + num_ops * sizeof(uint32_t);
+  layout->type = layout->hash_offset + num_ops * sizeof(uint32_t);
+}
+
+static int copy_name(payload_index_partition_t *partition, const char *name,
+                     size_t name_len) {
+  partition->name = malloc(name_len + 1);
+  if (!partition->name) {
+    return -1;
+  }
+  memcpy(partition->name, name, name_len);
+  partition->name[name_len] = '\0';
+  return 0;
+}
+
+int payload_index_from_scan(payload_index_t *index,
+                            const manifest_scan_t *scan) {
+  memset(index, 0, sizeof(payload_index_t));
+  index->block_size = scan->block_size;
+  index->partitions = calloc(scan->num_partitions ? scan->num_partitions : 1,
+                             sizeof(payload_index_partition_t));
+  if (!index->partitions) {
+    return -1;
+  }
+  for (size_t i = 0; i < scan->num_partitions; i++) {
+    const manifest_partition_t *part = &scan->partitions[i];
+    payload_index_partition_t *summary = &index->partitions[i];
+    if (copy_name(summary, part->name, part->name_len) != 0) {
+      payload_index_free(index);
+      return -1;
+    }
+    index->num_partitions++;
+    summary->has_new_size = part->has_new_size;
+    summary->new_size = part->new_size;
+    summary->size = part->new_size;
+    if (!part->has_new_size) {
+      uint64_t end_block;
+      if (manifest_partition_end_block(part, &end_block) != 0) {
+        payload_index_free(index);
+        return -1;
+      }
+      summary->size = end_block * scan->block_size;
+    }
+  }
+  return 0;
+}
+
+int payload_index_from_table(payload_index_t *index, const op_table_t *table,
+                             uint32_t block_size,
+                             const payload_index_key_t *key) {
+  memset(index, 0, sizeof(payload_index_t));
+  index->key = *key;
+  index->block_size = block_size;
+  index->num_ops = table->num_ops;
+  index->num_extents = table->num_extents_total;
+  index->partitions = calloc(table->num_partitions ? table->num_partitions : 1,
+                             sizeof(payload_index_partition_t));
+  if (!index->partitions) {
+    return -1;
+  }
+  for (size_t i = 0; i < table->num_partitions; i++) {
+    const op_partition_t *part = &table->partitions[i];
+    payload_index_partition_t *summary = &index->partitions[i];
+    if (copy_name(summary, part->name, strlen(part->name)) != 0) {
+      payload_index_free(index);
+      return -1;
+    }
+    index->num_partitions++;
+    summary->has_new_size = part->has_new_size;
+    summary->new_size = part->new_size;
+    summary->first_op = part->first_op;
+    summary->num_ops = part->num_ops;
+    if (part->num_ops > 0) {
+      size_t last = part->first_op + part->num_ops - 1;
+      summary->first_extent = table->first_extent[part->first_op];
+      summary->num_extents = table->first_extent[last] +
+                             table->num_extents[last] - summary->first_extent;
+    }
+
+    summary->size = part->new_size;
+    if (!part->has_new_size) {
+      extent_index_t extents;
+      if (extent_index_build(&extents, table, part) != 0) {
+        payload_index_free(index);
+        return -1;
+      }
+      summary->size = extents.end_block * block_size;
+      extent_index_free(&extents);
+    }
+  }
+  return 0;
+}
+
+void payload_index_free(payload_index_t *index) {
+  for (size_t i = 0; i < index->num_partitions; i++) {
+    free(index->partitions[i].name);
+  }
+  free(index->partitions);
+  memset(index, 0, sizeof(payload_index_t));
+}
+
+static int write_header(FILE *file, const payload_index_t *index,
+                        uint64_t names_size) {
+  uint8_t header[HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  memcpy(header, PAYLOAD_INDEX_MAGIC, 4);
+  put_le(&header[4], PAYLOAD_INDEX_VERSION, 4);
+  uint32_t byte_order = BYTE_ORDER_MARK;
+  memcpy(&header[8], &byte_order, 4);
+  put_le(&header[12], index->block_size, 4);
+  put_le(&header[16], index->key.payload_offset, 8);
+  put_le(&header[24], index->key.payload_size, 8);
+  put_le(&header[32], index->key.manifest_size, 8);
+  put_le(&header[40], index->key.metadata_signature_size, 4);
+  put_le(&header[44], index->key.payload_crc32, 4);
+  put_le(&header[48], index->key.key_crc, 4);
+  put_le(&header[56], index->num_partitions, 8);
+  put_le(&header[64], index->num_ops, 8);
+  put_le(&header[72], index->num_extents, 8);
+  put_le(&header[80], names_size, 8);
+  return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+int payload_index_save(const payload_index_t *index, const op_table_t *table,
+                       const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+
+  // Names are padded so the columns after them start 8-byte aligned
+  uint64_t names_size = 0;
+  for (size_t i = 0; i < index->num_partitions; i++) {
+    names_size += strlen(index->partitions[i].name);
+  }
+  uint64_t padded_names = (names_size + 7) & ~(uint64_t)7;
+  int ok = write_header(file, index, padded_names);
+
+  uint64_t name_offset = 0;
+  for (size_t i = 0; ok && i < index->num_partitions; i++) {
+    const payload_index_partition_t *part = &index->partitions[i];
+    size_t name_len = strlen(part->name);
+    uint8_t record[RECORD_SIZE];
+    put_le(&record[0], part->first_op, 8);
+    put_le(&record[8], part->num_ops, 8);
+    put_le(&record[16], part->first_extent, 8);
+    put_le(&record[24], part->num_extents, 8);
+    put_le(&record[32], part->size, 8);
+    put_le(&record[40], part->new_size, 8);
+    put_le(&record[48], (uint64_t)part->has_new_size, 4);
+    put_le(&record[52], name_offset, 4);
+    put_le(&record[56], name_len, 4);
+    put_le(&record[60], 0, 4);
+    ok = fwrite(record, 1, sizeof(record), file) == sizeof(record);
+    name_offset += name_len;
+  }
+  for (size_t i = 0; ok && i < index->num_partitions; i++) {
+    size_t name_len = strlen(index->partitions[i].name);
+    ok = fwrite(index->partitions[i].name, 1, name_len, file) == name_len;
+  }
+  static const uint8_t padding[8] = {0};
+  size_t pad = (size_t)(padded_names - names_size);
+  ok = ok && fwrite(padding, 1, pad, file) == pad;
+
+  size_t n = table->num_ops;
+  size_t e = table->num_extents_total;
+  ok = ok &&
+       fwrite(table->data_offset, sizeof(uint64_t), n, file) == n &&
+       fwrite(table->data_length, sizeof(uint64_t), n, file) == n &&
+       fwrite(table->extents, sizeof(op_extent_t), e, file) == e &&
+       fwrite(table->first_extent, sizeof(uint32_t), n, file) == n &&
+       fwrite(table->num_extents, sizeof(uint32_t), n, file) == n &&
+       fwrite(table->hash_offset, sizeof(uint32_t), n, file) == n &&
+       fwrite(table->type, sizeof(uint8_t), n, file) == n;
+
+  if (fclose(file) != 0 || !ok) {
+    remove(path);
+    return -1;
+  }
+  return 0;
+}
+
+int payload_index_load(payload_index_t *index, const char *path,
+                       const payload_index_key_t *key) {
+  memset(index, 0, sizeof(payload_index_t));
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[HEADER_SIZE];
+  uint32_t byte_order;
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, PAYLOAD_INDEX_MAGIC, 4) != 0 ||
+      get_le(&header[4], 4) != PAYLOAD_INDEX_VERSION) {
+    fclose(file);
+    return -1;
+  }
+  memcpy(&byte_order, &header[8], 4);
+  index->block_size = (uint32_t)get_le(&header[12], 4);
+  index->key.payload_offset = get_le(&header[16], 8);
+  index->key.payload_size = get_le(&header[24], 8);
+  index->key.manifest_size = get_le(&header[32], 8);
+  index->key.metadata_signature_size = (uint32_t)get_le(&header[40], 4);
+  index->key.payload_crc32 = (uint32_t)get_le(&header[44], 4);
+  index->key.key_crc = (uint32_t)get_le(&header[48], 4);
+  uint64_t num_partitions = get_le(&header[56], 8);
+  index->num_ops = get_le(&header[64], 8);
+  index->num_extents = get_le(&header[72], 8);
+  uint64_t names_size = get_le(&header[80], 8);
+
+  // Operation and extent counts are bounded by the manifest they came from
+  if (byte_order != BYTE_ORDER_MARK ||
+      index->key.payload_offset != key->payload_offset ||
+      index->key.payload_size != key->payload_size ||
+      index->key.manifest_size != key->manifest_size ||
+      index->key.metadata_signature_size != key->metadata_signature_size ||
+      index->key.payload_crc32 != key->payload_crc32 ||
+      index->key.key_crc != key->key_crc || index->block_size == 0 ||
+      num_partitions > key->manifest_size || index->num_ops > UINT32_MAX ||
+      index->num_extents > UINT32_MAX || names_size > key->manifest_size) {
+    fclose(file);
+    return -1;
+  }
+
+  index->partitions = calloc(num_partitions ? num_partitions : 1,
+                             sizeof(payload_index_partition_t));
+  uint8_t *records = malloc(num_partitions ? num_partitions * RECORD_SIZE : 1);
+  char *names = malloc(names_size + 1);
+  if (!index->partitions || !records || !names ||
+      fread(records, RECORD_SIZE, num_partitions, file) != num_partitions ||
+      fread(names, 1, names_size, file) != names_size) {
+    free(records);
+    free(names);
+    fclose(file);
+    payload_index_free(index);
+    return -1;
+  }
+  fclose(file);
+  index->columns_offset =
+      HEADER_SIZE + num_partitions * RECORD_SIZE + names_size;
+
+  for (uint64_t i = 0; i < num_partitions; i++) {
+    const uint8_t *record = &records[i * RECORD_SIZE];
+    payload_index_partition_t *part = &index->partitions[i];
+    part->first_op = get_le(&record[0], 8);
+    part->num_ops = get_le(&record[8], 8);
+    part->first_extent = get_le(&record[16], 8);
+    part->num_extents = get_le(&record[24], 8);
+    part->size = get_le(&record[32], 8);
+    part->new_size = get_le(&record[40], 8);
+    part->has_new_size = (int)get_le(&record[48], 4);
+    uint64_t name_offset = get_le(&record[52], 4);
+    uint64_t name_len = get_le(&record[56], 4);
+    if (part->first_op > index->num_ops ||
+        part->num_ops > index->num_ops - part->first_op ||
+        part->first_extent > index->num_extents ||
+        part->num_extents > index->num_extents - part->first_extent ||
+        name_offset > names_size || name_len > names_size - name_offset ||
+        copy_name(part, names + name_offset, (size_t)name_len) != 0) {
+      break;
+    }
+    index->num_partitions++;
+  }
+  free(records);
+  free(names);
+
+  if (index->num_partitions != num_partitions) {
+    payload_index_free(index);
+    return -1;
+  }
+  return 0;
+}
+
+static int partition_wanted(const payload_index_partition_t *partition,
+                            const char *images_list) {
+  if (!images_list || images_list[0] == '\0') {
+    return 1;
+  }
+  manifest_partition_t named;
+  memset(&named, 0, sizeof(named));
+  named.name = partition->name;
+  named.name_len = strlen(partition->name);
+  return manifest_partition_selected(&named, images_list);
+}
+
+static int read_column(FILE *file, uint64_t offset, void *out, size_t size,
+                       size_t count) {
+  return fseek(file, (long)offset, SEEK_SET) == 0 &&
+         fread(out, size, count, file) == count;
+}
+
+int payload_index_read_ops(const payload_index_t *index, const char *path,
+                           const char *images_list, op_table_t *table) {
+  size_t num_partitions = 0;
+  size_t total_ops = 0;
+  size_t total_extents = 0;
+  for (size_t i = 0; i < index->num_partitions; i++) {
+    if (partition_wanted(&index->partitions[i], images_list)) {
+      num_partitions++;
+      total_ops += index->partitions[i].num_ops;
+      total_extents += index->partitions[i].num_extents;
+    }
+  }
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  if (op_table_init(table, num_partitions, total_ops, total_extents) != 0) {
+    fclose(file);
+    return -1;
+  }
+
+  column_layout_t layout;
+  column_layout(index->num_ops, index->num_extents, &layout);
+  uint64_t base = index->columns_offset;
+  int ok = 1;
+  for (size_t i = 0; ok && i < index->num_partitions; i++) {
+    const payload_index_partition_t *summary = &index->partitions[i];
+    if (!partition_wanted(summary, images_list)) {
+      continue;
+    }
+    op_partition_t *part =
+        op_table_add_partition(table, summary->name, strlen(summary->name));
+    if (!part) {
+      ok = 0;
+      break;
+    }
+    part->has_new_size = summary->has_new_size;
+    part->new_size = summary->new_size;
+
+    // A partition's rows and extents are contiguous in the index, so each
+    // column is one read
+    size_t row = table->num_ops;
+    size_t extent = table->num_extents_total;
+    size_t n = (size_t)summary->num_ops;
+    size_t e = (size_t)summary->num_extents;
+    uint64_t op = summary->first_op;
+    ok = read_column(file, base + layout.data_offset + op * 8,
+                     &table->data_offset[row], sizeof(uint64_t), n) &&
+         read_column(file, base + layout.data_length + op * 8,
+                     &table->data_length[row], sizeof(uint64_t), n) &&
+         read_column(file,
+                     base + layout.extents +
+                         summary->first_extent * sizeof(op_extent_t),
+                     &table->extents[extent], sizeof(op_extent_t), e) &&
+         read_column(file, base + layout.first_extent + op * 4,
+                     &table->first_extent[row], sizeof(uint32_t), n) &&
+         read_column(file, base + layout.num_extents + op * 4,
+                     &table->num_extents[row], sizeof(uint32_t), n) &&
+         read_column(file, base + layout.hash_offset + op * 4,
+                     &table->hash_offset[row], sizeof(uint32_t), n) &&
+         read_column(file, base + layout.type + op, &table->type[row],
+                     sizeof(uint8_t), n);
+
+    // Extent numbers are rebased onto this table's extents
+    for (size_t r = row; ok && r < row + n; r++) {
+      uint64_t first = table->first_extent[r];
+      if (first < summary->first_extent ||
+          first - summary->first_extent + table->num_extents[r] > e) {
+        ok = 0;
+        break;
+      }
+      table->first_extent[r] =
+          (uint32_t)(first - summary->first_extent + extent);
+    }
+    part->num_ops = n;
+    table->num_ops += n;
+    table->num_extents_total += e;
+  }
+  fclose(file);
+
+  if (!ok) {
+    op_table_free(table);
+    return -1;
+  }
+  return 0;
+}
+
+char *payload_index_path(const char *dir, const char *source) {
+  mkdir(dir, 0755);
+
+  // Local files are known by their full path, URLs as they are
+  char *full = realpath(source, NULL);
+  const char *name = full ? full : source;
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (const uint8_t *p = (const uint8_t *)name; *p; p++) {
+    hash = (hash ^ *p) * 0x100000001B3ULL;
+  }
+  free(full);
+
+  size_t dir_len = strlen(dir);
+  size_t size = dir_len + 1 + 16 + strlen(".payloadidx") + 1;
+  char *path = malloc(size);
+  if (path) {
+    int separator = dir_len > 0 && dir[dir_len - 1] != '/' &&
+                    dir[dir_len - 1] != '\\';
+    snprintf(path, size, "%s%s%016llx.payloadidx", dir, separator ? "/" : "",
+             (unsigned long long)hash);
+  }
+  return path;
+}
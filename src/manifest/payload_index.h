@@ -0,0 +1,90 @@
+#ifndef PAYLOAD_INDEX_H
+#define PAYLOAD_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "manifest_scan.h"
+#include "op_table.h"
+
+#define PAYLOAD_INDEX_MAGIC "PDPI"
+#define PAYLOAD_INDEX_VERSION 1
+// Bytes at the end of the manifest that go into the key, with the payload
+// header and the metadata signature
+#define PAYLOAD_INDEX_KEY_SIZE 4096
+
+// What ties a saved index to the payload it was built from. `key_crc`
+// covers the payload header, the last PAYLOAD_INDEX_KEY_SIZE bytes of the
+// manifest and the metadata signature, which signs the manifest's hash,
+// so it can be checked without reading the whole manifest. A payload in
+// a ZIP also has the entry's CRC-32 of all of it.
+typedef struct {
+  uint64_t payload_offset;
+  uint64_t payload_size;
+  uint64_t manifest_size;
+  uint32_t metadata_signature_size;
+  uint32_t payload_crc32; // 0 when the payload is not in a ZIP
+  uint32_t key_crc;
+} payload_index_key_t;
+
+// One partition in the index. `size` is new_partition_info.size, or the
+// end of the highest extent written when the manifest leaves that out.
+typedef struct {
+  char *name;
+  uint64_t size;
+  int has_new_size;
+  uint64_t new_size;
+  uint64_t first_op;
+  uint64_t num_ops;
+  uint64_t first_extent;
+  uint64_t num_extents;
+} payload_index_partition_t;
+
+// Everything --list and extraction planning need from a payload, saved
+// in a sidecar file so that later runs skip reading and decoding the
+// manifest. Loading reads only the header and the partition summaries;
+// the operations of the partitions being extracted are then read
+// straight into an op_table_t.
+//
+// The file is the header, the partition records and their names, then
+// the op table columns for every partition, each stored as the array it
+// is loaded into: data_offset, data_length, extents, first_extent,
+// num_extents, hash_offset and type. The header fields and records are
+// little-endian; the columns are in host byte order, which the header
+// records, so that they can be mapped or read in place.
+typedef struct {
+  payload_index_key_t key;
+  uint32_t block_size;
+  payload_index_partition_t *partitions;
+  size_t num_partitions;
+  uint64_t num_ops;
+  uint64_t num_extents;
+  uint64_t columns_offset; // Where the op table columns start in the file
+} payload_index_t;
+
+// Summarises the scanned manifest without decoding any operations, for
+// --list when there is nowhere to keep an index
+int payload_index_from_scan(payload_index_t *index,
+                            const manifest_scan_t *scan);
+// Summarises `table`, which must hold every partition of the manifest
+int payload_index_from_table(payload_index_t *index, const op_table_t *table,
+                             uint32_t block_size,
+                             const payload_index_key_t *key);
+void payload_index_free(payload_index_t *index);
+
+int payload_index_save(const payload_index_t *index, const op_table_t *table,
+                       const char *path);
+// Loads the summaries saved by payload_index_save. Fails, so that the
+// caller reads the manifest instead, if the file is missing or damaged or
+// was built from a different payload.
+int payload_index_load(payload_index_t *index, const char *path,
+                       const payload_index_key_t *key);
+// Reads the operations of the partitions named in `images_list`, or of
+// all of them when it is NULL or empty, from the index file at `path`
+int payload_index_read_ops(const payload_index_t *index, const char *path,
+                           const char *images_list, op_table_t *table);
+
+// Returns `<dir>/<hash of source>.payloadidx`, creating `dir` if needed
+char *payload_index_path(const char *dir, const char *source);
+
+#endif
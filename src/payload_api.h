@@ -0,0 +1,63 @@
+#ifndef PAYLOAD_API_H
+#define PAYLOAD_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reads partition images straight out of a payload, without extracting
+// them. Any seekable source payload_dumper takes will do: a local or
+// remote payload.bin, OTA ZIP, tar or tar.gz. A read finds the operations
+// that write the requested bytes through the partition's extent index,
+// fetches their data with one batched read and decodes it. Decoded
+// operations are kept in an LRU cache of bounded size, and reads that
+// continue where the last one stopped fetch a growing window ahead.
+//
+// Partitions of one payload can be read from several threads. Reads
+// share the decoded-data cache but fetch and decode outside its lock.
+// Each payload keeps its own state, so threads may also open, read and
+// close different payloads at once. The exception is the first remote
+// source in the process, which sets up libcurl. Open it before other
+// threads start opening payloads.
+//
+// The library prints nothing unless a log callback is set. The source
+// readers may still report errors on stderr.
+//
+// Built as a static library, payload_dumper.c leaves out main() when
+// PAYLOAD_DUMPER_NO_MAIN is defined.
+
+#define PAYLOAD_CACHE_DEFAULT (64 * 1024 * 1024)
+#define PAYLOAD_READAHEAD_MIN (256 * 1024)
+#define PAYLOAD_READAHEAD_MAX (8 * 1024 * 1024)
+
+typedef struct payload payload_t;
+typedef struct payload_partition payload_partition_t;
+
+// Receives each progress or error message, one line ending in '\n' per
+// call. The callback is process-wide and may be called from any thread
+// reading a partition.
+typedef void (*payload_log_fn)(void *ctx, const char *message);
+void payload_set_log(payload_log_fn log, void *ctx);
+
+// Returns NULL if the source cannot be opened or read at random
+payload_t *payload_open(const char *source, const char *user_agent);
+void payload_close(payload_t *payload);
+// Bytes of decoded data the cache may hold, PAYLOAD_CACHE_DEFAULT unless
+// set. Shrinking it drops the least recently used entries.
+void payload_set_cache_size(payload_t *payload, size_t bytes);
+
+size_t payload_num_partitions(const payload_t *payload);
+const char *payload_partition_name(const payload_t *payload, size_t index);
+// Returns the named partition, or NULL if there is none. Partitions stay
+// valid until the payload is closed.
+payload_partition_t *payload_get_partition(payload_t *payload,
+                                           const char *name);
+
+uint64_t partition_size(const payload_partition_t *part);
+// Reads up to `len` bytes of the image at `off` into `buf`. Returns the
+// number of bytes read, which is less than `len` only at the end of the
+// image, or -1 on error. Blocks that no operation writes read as zeroes;
+// operations that need a source image, such as SOURCE_COPY, are errors.
+int64_t partition_pread(payload_partition_t *part, void *buf, size_t len,
+                        uint64_t off);
+
+#endif
@@ -13,8 +13,8 @@
 #define strdup _strdup
 #define ntohl(x) _byteswap_ulong(x)
 #define be64toh(x) _byteswap_uint64(x)
-HANDLE hConsole;
-CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
+static HANDLE hConsole;
+static CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
 #else
 #define _GNU_SOURCE
 #define _DEFAULT_SOURCE
@@ -29,6 +29,7 @@ CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
 #include <errno.h>
 #include <fcntl.h>
 #include <lzma.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,6 +37,14 @@ CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
 #include <zstd.h>
 
 #include "update_metadata.pb-c.h"
+#include "crc32_hw.h"
+#include "extent_index.h"
+#include "manifest_scan.h"
+#include "payload_api.h"
+#include "payload_index.h"
+#include "tar_parser.h"
+#include "units.h"
+#include "zip_index.h"
 #include "zip_parser.h"
 
 #ifdef ENABLE_HTTP_SUPPORT
@@ -44,6 +53,7 @@ CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
 
 #ifdef _WIN32
 #define PRIu64 "llu"
+#define PRIx64 "llx"
 #else
 #include <inttypes.h>
 #endif
@@ -58,17 +68,25 @@ typedef pthread_mutex_t mutex_t;
 #define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 #endif
 
-void mutex_init(mutex_t *mutex);
-void mutex_destroy(mutex_t *mutex);
-void mutex_lock(mutex_t *mutex);
-void mutex_unlock(mutex_t *mutex);
-int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg);
-void thread_join(thread_t thread);
+static void mutex_init(mutex_t *mutex);
+static void mutex_destroy(mutex_t *mutex);
+static void mutex_lock(mutex_t *mutex);
+static void mutex_unlock(mutex_t *mutex);
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static int thread_create(thread_t *thread, void *(*start_routine)(void *),
+                         void *arg);
+static void thread_join(thread_t thread);
+#endif
 
 #define MAGIC_HEADER "CrAU"
 #define MAGIC_LEN 4
 #define MAX_PARTITIONS 64
 #define MAX_THREADS 8
+#define BATCH_MAX_OP_SIZE (128 * 1024)
+#define BATCH_MAX_BYTES (4 * 1024 * 1024)
+#define BATCH_MAX_OPS 64
+#define MAX_ZIP_NESTING 2
+#define RANGE_WINDOW_SIZE (64 * 1024 * 1024)
 
 typedef struct {
   char partition_name[256];
@@ -78,6 +96,29 @@ typedef struct {
 } progress_info_t;
 
 typedef struct {
+  uint64_t data_offset;
+  uint64_t data_length;
+  size_t op;
+  int partition_idx;
+} ordered_op_t;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t crc;
+} crc_segment_t;
+
+// Where payload.bin sits in an opened source, and the CRC-32 its ZIP entry
+// records when it came from one
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  int has_crc;
+  uint32_t crc32;
+} payload_location_t;
+
+typedef struct {
+  const op_table_t *table;
   reader_t *payload_reader;
   uint64_t data_offset;
   uint32_t block_size;
@@ -85,52 +126,159 @@ typedef struct {
   mutex_t *reader_mutex;
 } thread_data_t;
 
-uint32_t read_u32_be(const uint8_t *data);
-uint64_t read_u64_be(const uint8_t *data);
-void update_progress(int partition_idx);
-int decompress_lzma(const uint8_t *compressed, size_t comp_size,
-                    uint8_t **decompressed, size_t *decomp_size);
-int decompress_zstd(const uint8_t *compressed, size_t comp_size,
-                    uint8_t **decompressed, size_t *decomp_size);
-int decompress_bz2(const uint8_t *compressed, size_t comp_size,
-                   uint8_t **decompressed, size_t *decomp_size);
-int decompress_brotli(const uint8_t *compressed, size_t comp_size,
-                      uint8_t **decompressed, size_t *decomp_size);
-int process_operation(ChromeosUpdateEngine__InstallOperation *op,
-                      reader_t *payload_reader, FILE *out_file,
-                      uint64_t data_offset, uint32_t block_size,
-                      mutex_t *reader_mutex);
-ChromeosUpdateEngine__PartitionUpdate *get_next_partition(int *partition_idx);
-void *process_partition_thread(void *arg);
-void list_partitions(ChromeosUpdateEngine__DeltaArchiveManifest *manifest);
-reader_t *open_payload_source(const char *source_path, const char *user_agent,
-                              uint64_t *payload_offset, uint64_t *payload_size);
-int extract_payload(const char *payload_path, const char *user_agent,
-                    const char *out_dir, const char *images_list, int list_only,
-                    int num_threads);
-void print_usage(const char *program_name);
-
+// One operation's decoded output in a payload's cache, on its LRU list
+typedef struct cached_op {
+  size_t op;
+  uint8_t *data;
+  size_t size;
+  struct cached_op *newer;
+  struct cached_op *older;
+} cached_op_t;
+
+// An operation's decoded output that --range keeps for a later window,
+// because the operation also writes blocks past the current one
+typedef struct {
+  size_t op;
+  uint8_t *data;
+  size_t size;
+} range_carry_t;
+
+struct payload_partition {
+  payload_t *payload;
+  const op_partition_t *part;
+  extent_index_t extents;
+  uint64_t size;
+  uint64_t next_offset; // Where a sequential reader reads next
+  uint64_t readahead;   // Bytes fetched past the end of a sequential read
+};
+
+struct payload {
+  reader_t *reader;
+  uint64_t data_offset;
+  payload_index_t index;
+  op_table_t table;
+  payload_partition_t **partitions; // Set up on first use
+  cached_op_t **cached;             // By op table row
+  cached_op_t *newest;
+  cached_op_t *oldest;
+  size_t cache_used;
+  size_t cache_limit;
+  mutex_t mutex;        // Guards the cache and partition state
+  mutex_t reader_mutex; // Serialises reads of the source
+};
+
+static uint32_t read_u32_be(const uint8_t *data);
+static uint64_t read_u64_be(const uint8_t *data);
+static int decompress_lzma(const uint8_t *compressed, size_t comp_size,
+                           uint8_t **decompressed, size_t *decomp_size);
+static int decompress_zstd(const uint8_t *compressed, size_t comp_size,
+                           uint8_t **decompressed, size_t *decomp_size);
+static int decompress_bz2(const uint8_t *compressed, size_t comp_size,
+                          uint8_t **decompressed, size_t *decomp_size);
+static int operation_output(const op_table_t *table, size_t op,
+                            const uint8_t *op_data, const uint8_t **output,
+                            size_t *output_size, uint8_t **decompressed);
+static void place_operation_output(const op_table_t *table, size_t op,
+                                   const uint8_t *output, size_t output_size,
+                                   uint32_t block_size, uint8_t *image,
+                                   uint64_t range_offset,
+                                   uint64_t range_length);
+static int compare_reader_ranges(const void *a, const void *b);
+static reader_t *open_stream_source(reader_t *reader,
+                                    payload_location_t *location);
+static reader_t *open_followed_source(reader_t *reader, const char *source_path,
+                                      payload_location_t *location);
+static reader_t *open_payload_source(const char *source_path,
+                                     const char *user_agent,
+                                     payload_location_t *location);
+static char *cache_sidecar_path(reader_t *reader, const char *suffix);
+static char *payload_index_location(reader_t *payload_reader,
+                                    const char *payload_path,
+                                    const char *index_dir);
+static int read_payload_index_key(reader_t *payload_reader,
+                                  payload_index_key_t *key);
+static int plan_extraction(reader_t *payload_reader, const char *payload_path,
+                           const char *index_dir,
+                           const payload_index_key_t *key,
+                           const char *images_list, int list_only,
+                           payload_index_t *index, op_table_t *table,
+                           uint8_t **manifest_data);
+static reader_t *find_archive_payload(reader_t *reader, zip_entry_t *entry,
+                                      int depth);
+static reader_t *open_tar_payload(reader_t *reader,
+                                  payload_location_t *location);
+static reader_t *open_zip_payload(reader_t *reader, const zip_entry_t *entry,
+                                  const char *where,
+                                  payload_location_t *location);
+static void block_cache_remove(payload_t *payload, cached_op_t *entry);
+static void block_cache_push(payload_t *payload, cached_op_t *entry);
+static void block_cache_evict(payload_t *payload, size_t limit);
+static void block_cache_insert(payload_t *payload, size_t op, uint8_t *data,
+                               size_t size);
+static int block_cache_decode(payload_t *payload, size_t op, uint8_t *op_data,
+                              uint8_t *image, uint64_t range_offset,
+                              uint64_t range_length);
+static int compare_op_rows(const void *a, const void *b);
+static int add_uncached_ops(payload_partition_t *part, uint64_t start,
+                            uint64_t end, size_t **list, size_t *count);
+static void payload_log(const char *format, ...);
+// The rest only serves the command line tool, which the library leaves out
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static void update_progress(int partition_idx);
+static void apply_operation(const op_table_t *table, size_t op,
+                            const uint8_t *op_data, FILE *out_file,
+                            uint32_t block_size);
+static int process_operation(const op_table_t *table, size_t op,
+                             reader_t *payload_reader, FILE *out_file,
+                             uint64_t data_offset, uint32_t block_size,
+                             mutex_t *reader_mutex);
+static size_t count_batchable_operations(const op_table_t *table,
+                                         const op_partition_t *part,
+                                         size_t first);
+static int process_operation_batch(const op_table_t *table, size_t first_op,
+                                   size_t count, reader_t *payload_reader,
+                                   FILE *out_file, uint64_t data_offset,
+                                   uint32_t block_size, mutex_t *reader_mutex);
+static const op_partition_t *get_next_partition(int *partition_idx);
+static void *process_partition_thread(void *arg);
+static int compare_data_order(const void *a, const void *b);
+static int extract_in_data_order(const op_table_t *table,
+                                 reader_t *payload_reader, uint64_t data_offset,
+                                 uint32_t block_size, const char *out_dir,
+                                 mutex_t *reader_mutex);
+static uint64_t operation_end(const op_table_t *table, size_t op,
+                              uint32_t block_size);
+static int extract_range_window(const op_table_t *table,
+                                const extent_index_t *extents,
+                                reader_t *payload_reader, uint64_t data_offset,
+                                uint32_t block_size, uint8_t *image,
+                                uint64_t window_offset, size_t window_size,
+                                range_carry_t **carry, size_t *num_carry);
+static int extract_range(const op_table_t *table, const payload_index_t *index,
+                         reader_t *payload_reader, uint64_t data_offset,
+                         uint32_t block_size, const char *out_dir);
+static int parse_range(const char *str);
+static int list_partitions(const payload_index_t *index);
+static int extract_payload(const char *payload_path, const char *user_agent,
+                           const char *out_dir, const char *images_list,
+                           int list_only, int num_threads);
+static void payload_crc_add(uint64_t offset, const uint8_t *data,
+                            uint64_t length);
+static void payload_crc_stream(void *arg, uint64_t offset, const uint8_t *data,
+                               size_t size);
+static void track_stream_crc(reader_t *payload_reader, uint64_t payload_offset,
+                             uint64_t payload_size);
+static int compare_crc_segments(const void *a, const void *b);
+static int verify_payload_crc(reader_t *payload_reader, uint64_t payload_offset,
+                              uint64_t payload_size);
+static int verify_stream_crc(reader_t *payload_reader, uint64_t end);
 #ifdef ENABLE_HTTP_SUPPORT
-char *format_size(uint64_t bytes);
-#else
-
-char *format_size(uint64_t bytes) {
-  static char buffer[32];
-  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
-  int unit_idx = 0;
-  double size = (double)bytes;
-
-  while (size >= 1024.0 && unit_idx < 4) {
-    size /= 1024.0;
-    unit_idx++;
-  }
-
-  snprintf(buffer, sizeof(buffer), "%.2f %s", size, units[unit_idx]);
-  return buffer;
-}
+static int finish_saved_source(reader_t *payload_reader);
+#endif
+static void print_usage(const char *program_name);
 #endif
 
-void mutex_init(mutex_t *mutex) {
+static void mutex_init(mutex_t *mutex) {
 #ifdef _WIN32
   InitializeCriticalSection(mutex);
 #else
@@ -138,7 +286,7 @@ void mutex_init(mutex_t *mutex) {
 #endif
 }
 
-void mutex_destroy(mutex_t *mutex) {
+static void mutex_destroy(mutex_t *mutex) {
 #ifdef _WIN32
   DeleteCriticalSection(mutex);
 #else
@@ -146,7 +294,7 @@ void mutex_destroy(mutex_t *mutex) {
 #endif
 }
 
-void mutex_lock(mutex_t *mutex) {
+static void mutex_lock(mutex_t *mutex) {
 #ifdef _WIN32
   EnterCriticalSection(mutex);
 #else
@@ -154,7 +302,7 @@ void mutex_lock(mutex_t *mutex) {
 #endif
 }
 
-void mutex_unlock(mutex_t *mutex) {
+static void mutex_unlock(mutex_t *mutex) {
 #ifdef _WIN32
   LeaveCriticalSection(mutex);
 #else
@@ -163,7 +311,7 @@ void mutex_unlock(mutex_t *mutex) {
 }
 
 #ifdef _WIN32
-DWORD WINAPI windows_thread_wrapper(LPVOID arg) {
+static DWORD WINAPI windows_thread_wrapper(LPVOID arg) {
   void *(*start_routine)(void *) = (void *(*)(void *))((void **)arg)[0];
   void *thread_arg = ((void **)arg)[1];
   start_routine(thread_arg);
@@ -172,7 +320,9 @@ DWORD WINAPI windows_thread_wrapper(LPVOID arg) {
 }
 #endif
 
-int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg) {
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static int thread_create(thread_t *thread, void *(*start_routine)(void *),
+                         void *arg) {
 #ifdef _WIN32
   void **wrapper_args = malloc(2 * sizeof(void *));
   if (!wrapper_args)
@@ -187,7 +337,7 @@ int thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg) {
 #endif
 }
 
-void thread_join(thread_t thread) {
+static void thread_join(thread_t thread) {
 #ifdef _WIN32
   WaitForSingleObject(thread, INFINITE);
   CloseHandle(thread);
@@ -195,31 +345,87 @@ void thread_join(thread_t thread) {
   pthread_join(thread, NULL);
 #endif
 }
+#endif
+
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static progress_info_t g_progress[MAX_PARTITIONS];
+static int g_num_partitions = 0;
+static mutex_t g_progress_mutex;
+
+static const op_partition_t *g_work_queue = NULL;
+static int g_queue_size = 0;
+static int g_current_work_index = 0;
+static mutex_t g_queue_mutex;
+#endif
+
+// --follow, which the library never sets
+static int g_follow = 0;
+static uint64_t g_expected_size = 0;
+
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static const char *g_index_dir = NULL;
+
+// --range: the slice of one partition to extract, and where it goes when
+// that is standard output
+static char *g_range_partition = NULL;
+static uint64_t g_range_offset = 0;
+static uint64_t g_range_length = 0;
+static FILE *g_range_output = NULL;
+
+// --verify-payload: CRC-32s of the payload bytes read while extracting
+static int g_verify_payload = 0;
+static int g_payload_has_crc = 0;
+static uint32_t g_payload_crc32 = 0;
+static crc_segment_t *g_crc_segments = NULL;
+static size_t g_num_crc_segments = 0;
+static size_t g_crc_segments_capacity = 0;
+// A source read front to back has its CRC-32 run over every byte as it
+// goes past, up to g_stream_crc_pos
+static int g_stream_crc_active = 0;
+static uint64_t g_stream_crc_pos = 0;
+static uint64_t g_stream_crc_end = 0;
+static uint32_t g_stream_crc = 0;
+static mutex_t g_crc_mutex;
+#endif
+
+// Where "- " messages go. Nothing is printed until a callback is set; main
+// sends them to stdout.
+static payload_log_fn g_log_fn = NULL;
+static void *g_log_ctx = NULL;
+
+void payload_set_log(payload_log_fn log, void *ctx) {
+  g_log_fn = log;
+  g_log_ctx = ctx;
+}
 
-progress_info_t g_progress[MAX_PARTITIONS];
-int g_num_partitions = 0;
-mutex_t g_progress_mutex;
+static void payload_log(const char *format, ...) {
+  if (!g_log_fn)
+    return;
 
-ChromeosUpdateEngine__PartitionUpdate **g_work_queue = NULL;
-int g_queue_size = 0;
-int g_current_work_index = 0;
-mutex_t g_queue_mutex;
+  char message[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  g_log_fn(g_log_ctx, message);
+}
 
-uint32_t read_u32_be(const uint8_t *data) {
+static uint32_t read_u32_be(const uint8_t *data) {
   uint32_t value;
   memcpy(&value, data, sizeof(value));
   return ntohl(value);
 }
 
-uint64_t read_u64_be(const uint8_t *data) {
+static uint64_t read_u64_be(const uint8_t *data) {
   uint64_t value;
   memcpy(&value, data, sizeof(value));
   return be64toh(value);
 }
 
+#ifndef PAYLOAD_DUMPER_NO_MAIN
 static int progress_initialized = 0;
 
-void update_progress(int partition_idx) {
+static void update_progress(int partition_idx) {
   mutex_lock(&g_progress_mutex);
   g_progress[partition_idx].completed_ops++;
 
@@ -282,9 +488,10 @@ void update_progress(int partition_idx) {
   fflush(stdout);
   mutex_unlock(&g_progress_mutex);
 }
+#endif
 
-int decompress_lzma(const uint8_t *compressed, size_t comp_size,
-                    uint8_t **decompressed, size_t *decomp_size) {
+static int decompress_lzma(const uint8_t *compressed, size_t comp_size,
+                           uint8_t **decompressed, size_t *decomp_size) {
   lzma_stream strm = LZMA_STREAM_INIT;
   lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
   if (ret != LZMA_OK)
@@ -329,8 +536,8 @@ int decompress_lzma(const uint8_t *compressed, size_t comp_size,
   }
 }
 
-int decompress_zstd(const uint8_t *compressed, size_t comp_size,
-                    uint8_t **decompressed, size_t *decomp_size) {
+static int decompress_zstd(const uint8_t *compressed, size_t comp_size,
+                           uint8_t **decompressed, size_t *decomp_size) {
   size_t estimated_size = ZSTD_getFrameContentSize(compressed, comp_size);
   if (estimated_size == ZSTD_CONTENTSIZE_ERROR ||
       estimated_size == ZSTD_CONTENTSIZE_UNKNOWN) {
@@ -350,8 +557,8 @@ int decompress_zstd(const uint8_t *compressed, size_t comp_size,
   return 0;
 }
 
-int decompress_bz2(const uint8_t *compressed, size_t comp_size,
-                   uint8_t **decompressed, size_t *decomp_size) {
+static int decompress_bz2(const uint8_t *compressed, size_t comp_size,
+                          uint8_t **decompressed, size_t *decomp_size) {
   bz_stream strm = {0};
   int ret = BZ2_bzDecompressInit(&strm, 0, 0);
   if (ret != BZ_OK)
@@ -396,78 +603,13 @@ int decompress_bz2(const uint8_t *compressed, size_t comp_size,
   }
 }
 
-int decompress_brotli(const uint8_t *compressed, size_t comp_size,
-                      uint8_t **decompressed, size_t *decomp_size) {
-  size_t out_capacity = comp_size * 4;
-  uint8_t *out_buf = malloc(out_capacity);
-  if (!out_buf)
-    return -1;
-
-  size_t available_in = comp_size;
-  const uint8_t *next_in = compressed;
-  size_t available_out = out_capacity;
-  uint8_t *next_out = out_buf;
-
-  BrotliDecoderState *decoder = BrotliDecoderCreateInstance(NULL, NULL, NULL);
-  if (!decoder) {
-    free(out_buf);
-    return -1;
-  }
-
-  BrotliDecoderResult result = BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
-
-  while (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
-    result = BrotliDecoderDecompressStream(decoder, &available_in, &next_in,
-                                           &available_out, &next_out, NULL);
-    if (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
-      size_t used = out_capacity - available_out;
-      out_capacity *= 2;
-      out_buf = realloc(out_buf, out_capacity);
-      if (!out_buf) {
-        BrotliDecoderDestroyInstance(decoder);
-        return -1;
-      }
-      next_out = out_buf + used;
-      available_out = out_capacity - used;
-    }
-  }
-
-  BrotliDecoderDestroyInstance(decoder);
-
-  if (result == BROTLI_DECODER_RESULT_SUCCESS) {
-    *decompressed = out_buf;
-    *decomp_size = out_capacity - available_out;
-    return 0;
-  } else {
-    free(out_buf);
-    return -1;
-  }
-}
-
-int process_operation(ChromeosUpdateEngine__InstallOperation *op,
-                      reader_t *payload_reader, FILE *out_file,
-                      uint64_t data_offset, uint32_t block_size,
-                      mutex_t *reader_mutex) {
-
-  uint8_t *op_data = NULL;
-  if (op->has_data_length && op->data_length > 0) {
-    op_data = malloc(op->data_length);
-    if (!op_data)
-      return -1;
-
-    mutex_lock(reader_mutex);
-    size_t bytes_read;
-    if (reader_read_at(payload_reader, data_offset + op->data_offset, op_data,
-                       op->data_length, &bytes_read) != 0 ||
-        bytes_read != op->data_length) {
-      mutex_unlock(reader_mutex);
-      free(op_data);
-      return -1;
-    }
-    mutex_unlock(reader_mutex);
-  }
-
-  switch (op->type) {
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static void apply_operation(const op_table_t *table, size_t op,
+                            const uint8_t *op_data, FILE *out_file,
+                            uint32_t block_size) {
+  const op_extent_t *extents = &table->extents[table->first_extent[op]];
+  uint64_t data_length = table->data_length[op];
+  switch ((ChromeosUpdateEngine__InstallOperation__Type)table->type[op]) {
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__MOVE:
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__BSDIFF:
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__SOURCE_COPY:
@@ -479,19 +621,19 @@ int process_operation(ChromeosUpdateEngine__InstallOperation *op,
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__LZ4DIFF_BSDIFF:
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__LZ4DIFF_PUFFDIFF:
   case _CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE_IS_INT_SIZE:
-    printf("- Unsupported operation type: %d\n", op->type);
+    payload_log("- Unsupported operation type: %d\n", table->type[op]);
     break;
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE_XZ: {
     uint8_t *decompressed;
     size_t decomp_size;
-    if (decompress_lzma(op_data, op->data_length, &decompressed,
+    if (decompress_lzma(op_data, data_length, &decompressed,
                         &decomp_size) == 0) {
 #ifdef _WIN32
       _fseeki64(out_file,
-                (__int64)(op->dst_extents[0]->start_block * block_size),
+                (__int64)(extents[0].start_block * block_size),
                 SEEK_SET);
 #else
-      fseek(out_file, (long)(op->dst_extents[0]->start_block * block_size),
+      fseek(out_file, (long)(extents[0].start_block * block_size),
             SEEK_SET);
 #endif
       fwrite(decompressed, 1, decomp_size, out_file);
@@ -502,14 +644,14 @@ int process_operation(ChromeosUpdateEngine__InstallOperation *op,
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__ZSTD: {
     uint8_t *decompressed;
     size_t decomp_size;
-    if (decompress_zstd(op_data, op->data_length, &decompressed,
+    if (decompress_zstd(op_data, data_length, &decompressed,
                         &decomp_size) == 0) {
 #ifdef _WIN32
       _fseeki64(out_file,
-                (__int64)(op->dst_extents[0]->start_block * block_size),
+                (__int64)(extents[0].start_block * block_size),
                 SEEK_SET);
 #else
-      fseek(out_file, (long)(op->dst_extents[0]->start_block * block_size),
+      fseek(out_file, (long)(extents[0].start_block * block_size),
             SEEK_SET);
 #endif
       fwrite(decompressed, 1, decomp_size, out_file);
@@ -520,14 +662,14 @@ int process_operation(ChromeosUpdateEngine__InstallOperation *op,
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE_BZ: {
     uint8_t *decompressed;
     size_t decomp_size;
-    if (decompress_bz2(op_data, op->data_length, &decompressed, &decomp_size) ==
+    if (decompress_bz2(op_data, data_length, &decompressed, &decomp_size) ==
         0) {
 #ifdef _WIN32
       _fseeki64(out_file,
-                (__int64)(op->dst_extents[0]->start_block * block_size),
+                (__int64)(extents[0].start_block * block_size),
                 SEEK_SET);
 #else
-      fseek(out_file, (long)(op->dst_extents[0]->start_block * block_size),
+      fseek(out_file, (long)(extents[0].start_block * block_size),
             SEEK_SET);
 #endif
       fwrite(decompressed, 1, decomp_size, out_file);
@@ -536,22 +678,22 @@ int process_operation(ChromeosUpdateEngine__InstallOperation *op,
     break;
   }
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE: {
-    fseek(out_file, (long)(op->dst_extents[0]->start_block * block_size),
+    fseek(out_file, (long)(extents[0].start_block * block_size),
           SEEK_SET);
-    fwrite(op_data, 1, op->data_length, out_file);
+    fwrite(op_data, 1, data_length, out_file);
     break;
   }
   case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__ZERO: {
-    for (size_t i = 0; i < op->n_dst_extents; i++) {
+    for (size_t i = 0; i < table->num_extents[op]; i++) {
 #ifdef _WIN32
       _fseeki64(out_file,
-                (__int64)(op->dst_extents[0]->start_block * block_size),
+                (__int64)(extents[0].start_block * block_size),
                 SEEK_SET);
 #else
-      fseek(out_file, (long)(op->dst_extents[0]->start_block * block_size),
+      fseek(out_file, (long)(extents[0].start_block * block_size),
             SEEK_SET);
 #endif
-      size_t zero_size = op->dst_extents[i]->num_blocks * block_size;
+      size_t zero_size = extents[i].num_blocks * block_size;
       uint8_t *zero_buf = calloc(1, zero_size);
       if (zero_buf) {
         fwrite(zero_buf, 1, zero_size, out_file);
@@ -561,38 +703,311 @@ int process_operation(ChromeosUpdateEngine__InstallOperation *op,
     break;
   }
   default:
-    printf("- Unsupported operation type: %d\n", op->type);
+    payload_log("- Unsupported operation type: %d\n", table->type[op]);
     break;
   }
+}
+
+static int process_operation(const op_table_t *table, size_t op,
+                             reader_t *payload_reader, FILE *out_file,
+                             uint64_t data_offset, uint32_t block_size,
+                             mutex_t *reader_mutex) {
+
+  uint8_t *op_data = NULL;
+  uint64_t op_offset = data_offset + table->data_offset[op];
+  uint64_t op_length = table->data_length[op];
+  if (op_length > 0) {
+    op_data = malloc(op_length);
+    if (!op_data)
+      return -1;
+
+    int serialize = !reader_supports_concurrent_reads(payload_reader);
+    if (serialize)
+      mutex_lock(reader_mutex);
+    size_t bytes_read;
+    int read_result = reader_read_at(payload_reader, op_offset, op_data,
+                                     op_length, &bytes_read);
+    if (serialize)
+      mutex_unlock(reader_mutex);
+    if (read_result != 0 || bytes_read != op_length) {
+      free(op_data);
+      return -1;
+    }
+    payload_crc_add(op_offset, op_data, op_length);
+  }
+
+  apply_operation(table, op, op_data, out_file, block_size);
 
   if (op_data)
     free(op_data);
   return 0;
 }
 
-ChromeosUpdateEngine__PartitionUpdate *get_next_partition(int *partition_idx) {
+// Records the CRC-32 of payload bytes that were read anyway, so that
+// verify_payload_crc only has to read what extraction skipped.
+static void payload_crc_add(uint64_t offset, const uint8_t *data,
+                            uint64_t length) {
+  if (!g_verify_payload || !g_payload_has_crc || length == 0) {
+    return;
+  }
+  uint32_t crc = crc32_hw(0, data, (size_t)length);
+
+  mutex_lock(&g_crc_mutex);
+  if (g_num_crc_segments == g_crc_segments_capacity) {
+    size_t capacity = g_crc_segments_capacity ? g_crc_segments_capacity * 2
+                                              : 1024;
+    crc_segment_t *segments =
+        realloc(g_crc_segments, capacity * sizeof(crc_segment_t));
+    if (!segments) {
+      // The bytes are read again at the end instead
+      mutex_unlock(&g_crc_mutex);
+      return;
+    }
+    g_crc_segments = segments;
+    g_crc_segments_capacity = capacity;
+  }
+  g_crc_segments[g_num_crc_segments].offset = offset;
+  g_crc_segments[g_num_crc_segments].length = length;
+  g_crc_segments[g_num_crc_segments].crc = crc;
+  g_num_crc_segments++;
+  mutex_unlock(&g_crc_mutex);
+}
+
+// Extends the running CRC-32 of a sequential source with the part of
+// `data` that continues it. Bytes seen again, such as reads from the
+// stream's window, are ignored.
+static void payload_crc_stream(void *arg, uint64_t offset, const uint8_t *data,
+                               size_t size) {
+  (void)arg;
+  uint64_t end = offset + size;
+  if (end > g_stream_crc_end) {
+    end = g_stream_crc_end;
+  }
+  if (offset > g_stream_crc_pos || end <= g_stream_crc_pos) {
+    return;
+  }
+  g_stream_crc = crc32_hw(g_stream_crc, data + (g_stream_crc_pos - offset),
+                          (size_t)(end - g_stream_crc_pos));
+  g_stream_crc_pos = end;
+}
+
+// Bytes a sequential source skips are gone before verify_payload_crc could
+// read them again, so the CRC-32 of such a payload is taken as the reader
+// passes over it instead: on the stream itself for a stored entry, or on
+// the inflated output for a deflated one.
+static void track_stream_crc(reader_t *payload_reader, uint64_t payload_offset,
+                             uint64_t payload_size) {
+  g_stream_crc_active = 1;
+  g_stream_crc_pos = payload_offset;
+  g_stream_crc_end = payload_offset + payload_size;
+  g_stream_crc = 0;
+  if (payload_reader->type == READER_STREAM) {
+    payload_reader->data.stream.on_data = payload_crc_stream;
+  } else if (payload_reader->type == READER_INFLATE) {
+    payload_reader->data.inflate.on_data = payload_crc_stream;
+  } else {
+    g_stream_crc_active = 0;
+  }
+}
+
+static int compare_crc_segments(const void *a, const void *b) {
+  const crc_segment_t *x = (const crc_segment_t *)a;
+  const crc_segment_t *y = (const crc_segment_t *)b;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Reads a sequential source to the end of the payload, which completes its
+// running CRC-32, and checks that.
+static int verify_stream_crc(reader_t *payload_reader, uint64_t end) {
+  uint8_t *buffer = malloc(1024 * 1024);
+  if (!buffer) {
+    return -1;
+  }
+  uint64_t remaining = end - g_stream_crc_pos;
+  while (g_stream_crc_pos < end) {
+    uint64_t left = end - g_stream_crc_pos;
+    size_t chunk = (left < 1024 * 1024) ? (size_t)left : 1024 * 1024;
+    size_t bytes_read;
+    uint64_t pos = g_stream_crc_pos;
+    if (reader_read_at(payload_reader, pos, buffer, chunk, &bytes_read) != 0 ||
+        bytes_read != chunk || g_stream_crc_pos == pos) {
+      payload_log("- Error: Could not read the rest of the payload stream to "
+                  "check the CRC-32\n");
+      free(buffer);
+      return -1;
+    }
+  }
+  free(buffer);
+
+  if (g_stream_crc != g_payload_crc32) {
+    payload_log("- Error: Payload CRC-32 mismatch: expected %08x, got %08x\n",
+                g_payload_crc32, g_stream_crc);
+    return -1;
+  }
+  payload_log("- Payload CRC-32 verified: %08x (%s, %s read past the end of "
+              "extraction)\n",
+              g_stream_crc, crc32_hw_name(), format_size(remaining));
+  return 0;
+}
+
+// Checks the payload against the CRC-32 of its ZIP entry. The CRCs of the
+// pieces read during extraction are combined in offset order, and only
+// the bytes between them are read again.
+static int verify_payload_crc(reader_t *payload_reader, uint64_t payload_offset,
+                              uint64_t payload_size) {
+  if (g_stream_crc_active) {
+    return verify_stream_crc(payload_reader, payload_offset + payload_size);
+  }
+  qsort(g_crc_segments, g_num_crc_segments, sizeof(crc_segment_t),
+        compare_crc_segments);
+  uint8_t *buffer = malloc(1024 * 1024);
+  if (!buffer) {
+    return -1;
+  }
+
+  uint64_t end = payload_offset + payload_size;
+  uint64_t pos = payload_offset;
+  uint64_t reread = 0;
+  uint32_t crc = 0;
+  for (size_t i = 0; i <= g_num_crc_segments; i++) {
+    const crc_segment_t *segment =
+        (i < g_num_crc_segments) ? &g_crc_segments[i] : NULL;
+    uint64_t gap_end = segment ? segment->offset : end;
+    // Data shared by several operations is only counted once
+    if (segment && (segment->offset < pos || gap_end + segment->length > end)) {
+      continue;
+    }
+
+    while (pos < gap_end) {
+      uint64_t left = gap_end - pos;
+      size_t chunk = (left < 1024 * 1024) ? (size_t)left : 1024 * 1024;
+      size_t bytes_read;
+      if (reader_read_at(payload_reader, pos, buffer, chunk, &bytes_read) !=
+              0 ||
+          bytes_read != chunk) {
+        payload_log("- Error: Could not read payload bytes at %" PRIu64
+                    " to check the CRC-32\n",
+                    pos - payload_offset);
+        free(buffer);
+        return -1;
+      }
+      crc = crc32_hw(crc, buffer, chunk);
+      pos += chunk;
+      reread += chunk;
+    }
+    if (segment) {
+      crc = crc32_hw_combine(crc, segment->crc, segment->length);
+      pos += segment->length;
+    }
+  }
+  free(buffer);
+
+  if (crc != g_payload_crc32) {
+    payload_log("- Error: Payload CRC-32 mismatch: expected %08x, got %08x\n",
+                g_payload_crc32, crc);
+    return -1;
+  }
+  payload_log("- Payload CRC-32 verified: %08x (%s, %s read again)\n", crc,
+              crc32_hw_name(), format_size(reread));
+  return 0;
+}
+
+// Returns how many operations starting at `first` should be read together.
+// Runs of small operations are fetched with one batched read, which over
+// HTTP turns into a single multi-range request instead of one per op.
+static size_t count_batchable_operations(const op_table_t *table,
+                                         const op_partition_t *part,
+                                         size_t first) {
+  size_t count = 0;
+  size_t data_ops = 0;
+  uint64_t total = 0;
+
+  while (first + count < part->num_ops && count < BATCH_MAX_OPS) {
+    uint64_t length = table->data_length[part->first_op + first + count];
+    if (length > BATCH_MAX_OP_SIZE || total + length > BATCH_MAX_BYTES)
+      break;
+    if (length > 0)
+      data_ops++;
+    total += length;
+    count++;
+  }
+
+  return (data_ops > 1) ? count : 1;
+}
+
+static int process_operation_batch(const op_table_t *table, size_t first_op,
+                                   size_t count, reader_t *payload_reader,
+                                   FILE *out_file, uint64_t data_offset,
+                                   uint32_t block_size, mutex_t *reader_mutex) {
+  reader_range_t *ranges = calloc(count, sizeof(reader_range_t));
+  uint8_t **op_data = calloc(count, sizeof(uint8_t *));
+  if (!ranges || !op_data) {
+    free(ranges);
+    free(op_data);
+    return -1;
+  }
+
+  size_t num_ranges = 0;
+  int result = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t length = table->data_length[first_op + i];
+    if (length > 0) {
+      op_data[i] = malloc(length);
+      if (!op_data[i]) {
+        result = -1;
+        break;
+      }
+      ranges[num_ranges].offset = data_offset + table->data_offset[first_op + i];
+      ranges[num_ranges].size = length;
+      ranges[num_ranges].buffer = op_data[i];
+      num_ranges++;
+    }
+  }
+
+  if (result == 0) {
+    int serialize = !reader_supports_concurrent_reads(payload_reader);
+    if (serialize)
+      mutex_lock(reader_mutex);
+    result = reader_read_ranges(payload_reader, ranges, num_ranges);
+    if (serialize)
+      mutex_unlock(reader_mutex);
+  }
+
+  for (size_t i = 0; i < num_ranges && result == 0; i++) {
+    payload_crc_add(ranges[i].offset, ranges[i].buffer, ranges[i].size);
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (result == 0)
+      apply_operation(table, first_op + i, op_data[i], out_file, block_size);
+    free(op_data[i]);
+  }
+  free(op_data);
+  free(ranges);
+  return result;
+}
+
+static const op_partition_t *get_next_partition(int *partition_idx) {
   mutex_lock(&g_queue_mutex);
   if (g_current_work_index >= g_queue_size) {
     mutex_unlock(&g_queue_mutex);
     return NULL;
   }
-  ChromeosUpdateEngine__PartitionUpdate *partition =
-      g_work_queue[g_current_work_index];
+  const op_partition_t *partition = &g_work_queue[g_current_work_index];
   *partition_idx = g_current_work_index;
   g_current_work_index++;
   mutex_unlock(&g_queue_mutex);
   return partition;
 }
 
-void *process_partition_thread(void *arg) {
+static void *process_partition_thread(void *arg) {
   thread_data_t *data = (thread_data_t *)arg;
-  ChromeosUpdateEngine__PartitionUpdate *partition;
+  const op_partition_t *partition;
   int partition_idx;
 
   while ((partition = get_next_partition(&partition_idx)) != NULL) {
     char output_path[512];
     snprintf(output_path, sizeof(output_path), "%s/%s.img", data->out_dir,
-             partition->partition_name);
+             partition->name);
 
     FILE *out_file = fopen(output_path, "wb");
     if (!out_file) {
@@ -600,175 +1015,1087 @@ void *process_partition_thread(void *arg) {
       continue;
     }
 
-    for (size_t i = 0; i < partition->n_operations; i++) {
-      process_operation(partition->operations[i], data->payload_reader,
-                        out_file, data->data_offset, data->block_size,
-                        data->reader_mutex);
-      update_progress(partition_idx);
+    size_t i = 0;
+    while (i < partition->num_ops) {
+      size_t count = count_batchable_operations(data->table, partition, i);
+      if (count > 1) {
+        process_operation_batch(data->table, partition->first_op + i, count,
+                                data->payload_reader, out_file,
+                                data->data_offset, data->block_size,
+                                data->reader_mutex);
+      } else {
+        process_operation(data->table, partition->first_op + i,
+                          data->payload_reader, out_file, data->data_offset,
+                          data->block_size, data->reader_mutex);
+      }
+      for (size_t j = 0; j < count; j++) {
+        update_progress(partition_idx);
+      }
+      i += count;
     }
     fclose(out_file);
   }
   return NULL;
 }
 
-void list_partitions(ChromeosUpdateEngine__DeltaArchiveManifest *manifest) {
-  printf("Available partitions:\n");
-  printf("%-50s\n", "─────────────────────────────────────────────────");
-  printf("%-20s %-15s %-15s\n", "Partition Name", "Size", "Size (bytes)");
-  printf("%-50s\n", "─────────────────────────────────────────────────");
+// Operations without data come first, then the rest by where their data
+// sits in the payload.
+static int compare_data_order(const void *a, const void *b) {
+  const ordered_op_t *x = (const ordered_op_t *)a;
+  const ordered_op_t *y = (const ordered_op_t *)b;
+  int x_has_data = x->data_length > 0;
+  int y_has_data = y->data_length > 0;
+  if (x_has_data != y_has_data)
+    return x_has_data - y_has_data;
+  if (x_has_data && x->data_offset != y->data_offset)
+    return (x->data_offset < y->data_offset) ? -1 : 1;
+  return (x->op < y->op) ? -1 : (x->op > y->op);
+}
 
-  uint64_t total_size = 0;
-  for (size_t i = 0; i < manifest->n_partitions; i++) {
-    ChromeosUpdateEngine__PartitionUpdate *part = manifest->partitions[i];
-    uint64_t max_end_block = 0;
-    for (size_t j = 0; j < part->n_operations; j++) {
-      ChromeosUpdateEngine__InstallOperation *op = part->operations[j];
-      for (size_t k = 0; k < op->n_dst_extents; k++) {
-        uint64_t end_block =
-            op->dst_extents[k]->start_block + op->dst_extents[k]->num_blocks;
-        if (end_block > max_end_block)
-          max_end_block = end_block;
-      }
+// Extracts every queued partition in a single forward pass over the
+// payload. Operations from all partitions are applied in data_offset
+// order, so each blob is read exactly once as the source streams past and
+// only one operation's data is held in memory at a time.
+static int extract_in_data_order(const op_table_t *table,
+                                 reader_t *payload_reader, uint64_t data_offset,
+                                 uint32_t block_size, const char *out_dir,
+                                 mutex_t *reader_mutex) {
+  size_t total_ops = table->num_ops;
+
+  ordered_op_t *ordered = malloc((total_ops ? total_ops : 1) *
+                                 sizeof(ordered_op_t));
+  FILE **out_files = calloc((size_t)g_queue_size + 1, sizeof(FILE *));
+  if (!ordered || !out_files) {
+    free(ordered);
+    free(out_files);
+    return -1;
+  }
+
+  int result = 0;
+  size_t count = 0;
+  for (int i = 0; i < g_queue_size; i++) {
+    const op_partition_t *partition = &g_work_queue[i];
+    char output_path[512];
+    snprintf(output_path, sizeof(output_path), "%s/%s.img", out_dir,
+             partition->name);
+    out_files[i] = fopen(output_path, "wb");
+    if (!out_files[i]) {
+      printf("Failed to create output file: %s\n", output_path);
+      result = -1;
+      break;
     }
-    uint64_t size_bytes = max_end_block * manifest->block_size;
-    if (part->new_partition_info && part->new_partition_info->has_size) {
-      size_bytes = part->new_partition_info->size;
+    for (size_t j = 0; j < partition->num_ops; j++) {
+      size_t op = partition->first_op + j;
+      ordered[count].data_offset = table->data_offset[op];
+      ordered[count].data_length = table->data_length[op];
+      ordered[count].op = op;
+      ordered[count].partition_idx = i;
+      count++;
     }
-    total_size += size_bytes;
-    printf("%-20s %-15s %-15" PRIu64 "\n", part->partition_name,
-           format_size(size_bytes), size_bytes);
   }
-  printf("%-50s\n", "─────────────────────────────────────────────────");
-  printf("%-20s %-15s %-15" PRIu64 "\n", "Total", format_size(total_size),
-         total_size);
-  printf("\nTotal partitions: %zu\n", manifest->n_partitions);
-  printf("Block size: %u bytes\n", manifest->block_size);
-}
-
-reader_t *open_payload_source(const char *source_path, const char *user_agent,
-                              uint64_t *payload_offset,
-                              uint64_t *payload_size) {
-  reader_t *reader = malloc(sizeof(reader_t));
-  if (!reader)
-    return NULL;
 
-#ifdef ENABLE_HTTP_SUPPORT
-  if (strncmp(source_path, "http://", 7) == 0 ||
-      strncmp(source_path, "https://", 8) == 0) {
-    printf("- Opening remote ZIP: %s\n", source_path);
-    if (reader_init_http(reader, source_path, user_agent, 0) != 0) {
-      free(reader);
-      return NULL;
-    }
-    zip_entry_t payload_entry;
-    if (find_payload_entry(reader, &payload_entry) == 0) {
-      if (get_data_offset(reader, &payload_entry) == 0) {
-        if (verify_payload_magic(reader, payload_entry.data_offset) == 0) {
-          *payload_offset = payload_entry.data_offset;
-          *payload_size =
-              payload_entry.uncompressed_size; // or compressed_size?
-          printf("- Found payload: offset=%" PRIu64 ", size=%s\n",
-                 *payload_offset, format_size(*payload_size));
-          return reader;
-        }
+  if (result == 0) {
+    qsort(ordered, count, sizeof(ordered_op_t), compare_data_order);
+    for (size_t i = 0; i < count; i++) {
+      int idx = ordered[i].partition_idx;
+      if (process_operation(table, ordered[i].op, payload_reader,
+                            out_files[idx], data_offset, block_size,
+                            reader_mutex) != 0) {
+        payload_log("\n- Failed to read operation data at offset %" PRIu64 "\n",
+                    data_offset + ordered[i].data_offset);
+        result = -1;
+        break;
       }
+      update_progress(idx);
     }
-    reader_cleanup(reader);
-    free(reader);
-    return NULL;
-  } else {
-#else
-  if (strncmp(source_path, "http://", 7) == 0 ||
-      strncmp(source_path, "https://", 8) == 0) {
-    printf("- Error: HTTP support is not enabled in this build.\n");
-    printf(
-        "- Please recompile with HTTP support enabled or use a local file.\n");
-    free(reader);
-    return NULL;
-  } else {
-#endif
+  }
 
-    struct stat st;
-    if (stat(source_path, &st) != 0) {
-      free(reader);
-      return NULL;
-    }
+  for (int i = 0; i < g_queue_size; i++) {
+    if (out_files[i])
+      fclose(out_files[i]);
+  }
+  free(out_files);
+  free(ordered);
+  return result;
+}
+#endif
 
-    if (reader_init_file(reader, source_path) != 0) {
-      free(reader);
-      return NULL;
-    }
+// Points `*output` at the bytes a replace-type operation writes across its
+// destination extents: the data itself, or the data decompressed into
+// `*decompressed`, which the caller frees. Returns 1 for ZERO, which has no
+// data, and -1 for types that cannot be applied without a source image.
+static int operation_output(const op_table_t *table, size_t op,
+                            const uint8_t *op_data, const uint8_t **output,
+                            size_t *output_size, uint8_t **decompressed) {
+  size_t data_length = (size_t)table->data_length[op];
+  int ret;
+  *decompressed = NULL;
+  switch ((ChromeosUpdateEngine__InstallOperation__Type)table->type[op]) {
+  case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE:
+    *output = op_data;
+    *output_size = data_length;
+    return 0;
+  case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE_XZ:
+    ret = decompress_lzma(op_data, data_length, decompressed, output_size);
+    break;
+  case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__ZSTD:
+    ret = decompress_zstd(op_data, data_length, decompressed, output_size);
+    break;
+  case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__REPLACE_BZ:
+    ret = decompress_bz2(op_data, data_length, decompressed, output_size);
+    break;
+  case CHROMEOS_UPDATE_ENGINE__INSTALL_OPERATION__TYPE__ZERO:
+    return 1;
+  default:
+    payload_log("- Unsupported operation type: %d\n", table->type[op]);
+    return -1;
+  }
+  if (ret != 0) {
+    *decompressed = NULL;
+    return -1;
+  }
+  *output = *decompressed;
+  return 0;
+}
 
-    if (verify_payload_magic(reader, 0) == 0) {
-      *payload_offset = 0;
-      *payload_size = (uint64_t)st.st_size;
-      return reader;
+// Copies the part of an operation's output that falls in the range into
+// `image`, which holds bytes [range_offset, range_offset + range_length)
+// of the partition. The output is laid out over the destination extents
+// in order; a NULL `output`, for ZERO, writes zeroes.
+static void place_operation_output(const op_table_t *table, size_t op,
+                                   const uint8_t *output, size_t output_size,
+                                   uint32_t block_size, uint8_t *image,
+                                   uint64_t range_offset,
+                                   uint64_t range_length) {
+  const op_extent_t *extents = &table->extents[table->first_extent[op]];
+  uint64_t range_end = range_offset + range_length;
+  uint64_t output_pos = 0;
+  for (uint32_t i = 0; i < table->num_extents[op]; i++) {
+    uint64_t extent_start = extents[i].start_block * block_size;
+    uint64_t extent_size = extents[i].num_blocks * block_size;
+    uint64_t lo = (extent_start > range_offset) ? extent_start : range_offset;
+    uint64_t hi = (extent_start + extent_size < range_end)
+                      ? extent_start + extent_size
+                      : range_end;
+    if (lo < hi) {
+      uint8_t *dest = image + (lo - range_offset);
+      uint64_t src = output_pos + (lo - extent_start);
+      uint64_t available = (src < output_size) ? output_size - src : 0;
+      uint64_t copy = (hi - lo < available) ? hi - lo : available;
+      // Short output leaves zeroes, as the full image would
+      memset(dest, 0, (size_t)(hi - lo));
+      if (output && copy > 0) {
+        memcpy(dest, output + src, (size_t)copy);
+      }
     }
+    output_pos += extent_size;
+  }
+}
 
-    zip_entry_t payload_entry;
-    if (find_payload_entry(reader, &payload_entry) == 0) {
-      if (get_data_offset(reader, &payload_entry) == 0) {
-        if (verify_payload_magic(reader, payload_entry.data_offset) == 0) {
-          *payload_offset = payload_entry.data_offset;
-          *payload_size =
-              payload_entry.uncompressed_size; // or compressed_size?
-          printf("- Found payload in ZIP: offset=%" PRIu64 ", size=%s\n",
-                 *payload_offset, format_size(*payload_size));
-          return reader;
-        }
-      }
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+// The partition offset just past the last block an operation writes
+static uint64_t operation_end(const op_table_t *table, size_t op,
+                              uint32_t block_size) {
+  const op_extent_t *extents = &table->extents[table->first_extent[op]];
+  uint64_t end = 0;
+  for (uint32_t i = 0; i < table->num_extents[op]; i++) {
+    uint64_t extent_end =
+        (extents[i].start_block + extents[i].num_blocks) * block_size;
+    if (extent_end > end) {
+      end = extent_end;
     }
-    reader_cleanup(reader);
-    free(reader);
-    return NULL;
   }
+  return end;
 }
+#endif
 
-int extract_payload(const char *payload_path, const char *user_agent,
-                    const char *out_dir, const char *images_list, int list_only,
-                    int num_threads) {
-  mutex_init(&g_progress_mutex);
-  mutex_init(&g_queue_mutex);
+static int compare_reader_ranges(const void *a, const void *b) {
+  const reader_range_t *ra = a;
+  const reader_range_t *rb = b;
+  if (ra->offset != rb->offset) {
+    return (ra->offset < rb->offset) ? -1 : 1;
+  }
+  return 0;
+}
 
-  uint64_t payload_offset, payload_size;
-  reader_t *payload_reader = open_payload_source(
-      payload_path, user_agent, &payload_offset, &payload_size);
-  if (!payload_reader) {
-    printf("- Failed to open payload source: %s\n", payload_path);
-    mutex_destroy(&g_queue_mutex);
-    mutex_destroy(&g_progress_mutex);
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+// Fills `image` with bytes [window_offset, window_offset + window_size)
+// of the partition. The extent index finds the operations that write those
+// blocks, their data is fetched with one batched read, which over HTTP is
+// a single multi-range request, and their output is clipped to the window.
+// Blocks no operation writes come out as zeroes.
+//
+// `*carry`, sorted by operation, holds the output of operations an earlier
+// window decoded that write blocks past it. Those are placed from there
+// rather than fetched again, and this window's own such operations are
+// added to it; an entry is freed after the last window it writes to.
+static int extract_range_window(const op_table_t *table,
+                                const extent_index_t *extents,
+                                reader_t *payload_reader, uint64_t data_offset,
+                                uint32_t block_size, uint8_t *image,
+                                uint64_t window_offset, size_t window_size,
+                                range_carry_t **carry, size_t *num_carry) {
+  size_t *ops = NULL;
+  size_t num_ops = 0;
+  if (extent_index_covering_ops(
+          extents, window_offset / block_size,
+          (window_offset + window_size + block_size - 1) / block_size, &ops,
+          &num_ops) != 0) {
     return -1;
   }
+  memset(image, 0, window_size);
+
+  reader_range_t *ranges = calloc(num_ops ? num_ops : 1, sizeof(reader_range_t));
+  uint8_t **op_data = calloc(num_ops ? num_ops : 1, sizeof(uint8_t *));
+  range_carry_t *next = calloc(*num_carry + num_ops + 1, sizeof(range_carry_t));
+  size_t num_ranges = 0;
+  int result = (ranges && op_data && next) ? 0 : -1;
+  size_t c = 0;
+  for (size_t i = 0; result == 0 && i < num_ops; i++) {
+    uint64_t op_length = table->data_length[ops[i]];
+    while (c < *num_carry && (*carry)[c].op < ops[i]) {
+      c++;
+    }
+    if (op_length == 0 || (c < *num_carry && (*carry)[c].op == ops[i])) {
+      continue;
+    }
+    op_data[i] = malloc(op_length);
+    if (!op_data[i]) {
+      result = -1;
+      break;
+    }
+    ranges[num_ranges].offset = data_offset + table->data_offset[ops[i]];
+    ranges[num_ranges].size = op_length;
+    ranges[num_ranges].buffer = op_data[i];
+    num_ranges++;
+  }
 
-  uint8_t magic[MAGIC_LEN];
-  size_t bytes_read;
-  if (reader_read_at(payload_reader, payload_offset, magic, MAGIC_LEN,
-                     &bytes_read) != 0 ||
-      bytes_read != MAGIC_LEN || memcmp(magic, MAGIC_HEADER, MAGIC_LEN) != 0) {
-    printf("- Invalid magic header\n");
-    reader_cleanup(payload_reader);
-    free(payload_reader);
-    mutex_destroy(&g_queue_mutex);
-    mutex_destroy(&g_progress_mutex);
-    return -1;
+  // Sources read front to back need the blobs in payload order
+  if (result == 0) {
+    qsort(ranges, num_ranges, sizeof(reader_range_t), compare_reader_ranges);
+    result = reader_read_ranges(payload_reader, ranges, num_ranges);
+  }
+  for (size_t i = 0; i < num_ranges && result == 0; i++) {
+    payload_crc_add(ranges[i].offset, ranges[i].buffer, ranges[i].size);
   }
 
-  uint8_t version_buf[8];
-  if (reader_read_at(payload_reader, payload_offset + MAGIC_LEN, version_buf, 8,
-                     &bytes_read) != 0 ||
-      bytes_read != 8) {
-    printf("- Failed to read file format version\n");
-    reader_cleanup(payload_reader);
-    free(payload_reader);
-    mutex_destroy(&g_queue_mutex);
+  // The carried entries are moved to `next` as the window's operations
+  // are walked, both in operation order, or freed once fully written
+  uint64_t window_end = window_offset + window_size;
+  size_t num_next = 0;
+  c = 0;
+  for (size_t i = 0; result == 0 && i < num_ops; i++) {
+    size_t op = ops[i];
+    while (c < *num_carry && (*carry)[c].op < op) {
+      next[num_next++] = (*carry)[c++];
+    }
+    if (c < *num_carry && (*carry)[c].op == op) {
+      range_carry_t kept = (*carry)[c++];
+      place_operation_output(table, op, kept.data, kept.size, block_size,
+                             image, window_offset, window_size);
+      if (operation_end(table, op, block_size) > window_end) {
+        next[num_next++] = kept;
+      } else {
+        free(kept.data);
+      }
+      continue;
+    }
+    const uint8_t *output = NULL;
+    size_t output_size = 0;
+    uint8_t *decompressed;
+    int kind = operation_output(table, op, op_data[i], &output, &output_size,
+                                &decompressed);
+    if (kind < 0) {
+      result = -1;
+      break;
+    }
+    place_operation_output(table, op, (kind == 0) ? output : NULL, output_size,
+                           block_size, image, window_offset, window_size);
+    if (kind == 0 && table->data_length[op] > 0 &&
+        operation_end(table, op, block_size) > window_end) {
+      next[num_next].op = op;
+      next[num_next].data = decompressed ? decompressed : op_data[i];
+      next[num_next].size = output_size;
+      num_next++;
+      if (decompressed) {
+        decompressed = NULL;
+      } else {
+        op_data[i] = NULL;
+      }
+    }
+    free(decompressed);
+  }
+  if (next) {
+    while (c < *num_carry) {
+      next[num_next++] = (*carry)[c++];
+    }
+    free(*carry);
+    *carry = next;
+    *num_carry = num_next;
+  }
+
+  for (size_t i = 0; op_data && i < num_ops; i++) {
+    free(op_data[i]);
+  }
+  free(op_data);
+  free(ranges);
+  free(ops);
+  return result;
+}
+
+// --range: writes bytes [offset, offset + length) of one partition image.
+// The range is produced and written RANGE_WINDOW_SIZE bytes at a time, so
+// a large one neither has to fit in memory nor waits for all of its
+// operations before any of it is written. An operation spanning windows
+// is read and decoded once, and its output kept until the last of them.
+// A source read front to back cannot go back for data an earlier window
+// skipped, so it is read in one window.
+static int extract_range(const op_table_t *table, const payload_index_t *index,
+                         reader_t *payload_reader, uint64_t data_offset,
+                         uint32_t block_size, const char *out_dir) {
+  const op_partition_t *part = NULL;
+  for (size_t i = 0; i < table->num_partitions; i++) {
+    if (strcmp(table->partitions[i].name, g_range_partition) == 0) {
+      part = &table->partitions[i];
+    }
+  }
+  const payload_index_partition_t *summary = NULL;
+  for (size_t i = 0; i < index->num_partitions; i++) {
+    if (strcmp(index->partitions[i].name, g_range_partition) == 0) {
+      summary = &index->partitions[i];
+    }
+  }
+  if (!part || !summary) {
+    payload_log("- Error: No partition named %s\n", g_range_partition);
+    return -1;
+  }
+  if (g_range_offset >= summary->size) {
+    payload_log(
+        "- Error: Range starts past the end of %s (%" PRIu64 " bytes)\n",
+        part->name, summary->size);
+    return -1;
+  }
+  uint64_t length = summary->size - g_range_offset;
+  if (g_range_length < length) {
+    length = g_range_length;
+  }
+
+  extent_index_t extents;
+  if (extent_index_build(&extents, table, part) != 0) {
+    return -1;
+  }
+  uint64_t window = length;
+  if (!reader_is_sequential(payload_reader)) {
+    if (window > RANGE_WINDOW_SIZE) {
+      window = RANGE_WINDOW_SIZE;
+    }
+  } else if (window > SIZE_MAX) {
+    payload_log("- Error: Range is too large to read from a stream\n");
+    extent_index_free(&extents);
+    return -1;
+  }
+  payload_log("- Range %" PRIu64 "+%" PRIu64 " of %s\n", g_range_offset,
+              length, part->name);
+
+  FILE *out_file = g_range_output;
+  char output_path[512];
+  if (!out_file) {
+    snprintf(output_path, sizeof(output_path),
+             "%s/%s.%" PRIu64 "-%" PRIu64 ".img", out_dir, part->name,
+             g_range_offset, g_range_offset + length);
+    out_file = fopen(output_path, "wb");
+  }
+  uint8_t *image = malloc((size_t)window);
+  range_carry_t *carry = NULL;
+  size_t num_carry = 0;
+  int result = (out_file && image) ? 0 : -1;
+  if (!out_file) {
+    payload_log("- Error: Failed to write the range\n");
+  }
+  for (uint64_t done = 0; result == 0 && done < length; done += window) {
+    size_t size = (size_t)((length - done < window) ? length - done : window);
+    result = extract_range_window(table, &extents, payload_reader,
+                                  data_offset, block_size, image,
+                                  g_range_offset + done, size, &carry,
+                                  &num_carry);
+    if (result == 0 && fwrite(image, 1, size, out_file) != size) {
+      payload_log("- Error: Failed to write the range\n");
+      result = -1;
+    }
+  }
+  if (result == 0 && fflush(out_file) != 0) {
+    payload_log("- Error: Failed to write the range\n");
+    result = -1;
+  }
+  if (result == 0 && !g_range_output) {
+    payload_log("- Wrote %s\n", output_path);
+  }
+  if (out_file && out_file != g_range_output) {
+    fclose(out_file);
+  }
+  for (size_t i = 0; i < num_carry; i++) {
+    free(carry[i].data);
+  }
+  free(carry);
+  free(image);
+  extent_index_free(&extents);
+  return result;
+}
+
+// Parses --range's partition:offset:length. The offset and length take
+// the same K, M and G suffixes as other sizes.
+static int parse_range(const char *str) {
+  const char *length_sep = strrchr(str, ':');
+  if (!length_sep || length_sep == str) {
+    return -1;
+  }
+  const char *offset_sep = length_sep - 1;
+  while (offset_sep > str && *offset_sep != ':') {
+    offset_sep--;
+  }
+  if (offset_sep == str) {
+    return -1;
+  }
+
+  char offset_str[32];
+  size_t offset_len = (size_t)(length_sep - offset_sep - 1);
+  if (offset_len == 0 || offset_len >= sizeof(offset_str)) {
+    return -1;
+  }
+  memcpy(offset_str, offset_sep + 1, offset_len);
+  offset_str[offset_len] = '\0';
+  uint64_t offset;
+  uint64_t length;
+  if (parse_size(offset_str, &offset) != 0 ||
+      parse_size(length_sep + 1, &length) != 0 || length == 0) {
+    return -1;
+  }
+
+  char *partition = malloc((size_t)(offset_sep - str) + 1);
+  if (!partition) {
+    return -1;
+  }
+  memcpy(partition, str, (size_t)(offset_sep - str));
+  partition[offset_sep - str] = '\0';
+  free(g_range_partition);
+  g_range_partition = partition;
+  g_range_offset = offset;
+  g_range_length = length;
+  return 0;
+}
+
+// Lists the partitions from the index summaries. Sizes come from
+// new_partition_info, or from the destination extents where that is
+// missing.
+static int list_partitions(const payload_index_t *index) {
+  printf("Available partitions:\n");
+  printf("%-50s\n", "─────────────────────────────────────────────────");
+  printf("%-20s %-15s %-15s\n", "Partition Name", "Size", "Size (bytes)");
+  printf("%-50s\n", "─────────────────────────────────────────────────");
+
+  uint64_t total_size = 0;
+  for (size_t i = 0; i < index->num_partitions; i++) {
+    const payload_index_partition_t *part = &index->partitions[i];
+    total_size += part->size;
+    printf("%-20s %-15s %-15" PRIu64 "\n", part->name, format_size(part->size),
+           part->size);
+  }
+  printf("%-50s\n", "─────────────────────────────────────────────────");
+  printf("%-20s %-15s %-15" PRIu64 "\n", "Total", format_size(total_size),
+         total_size);
+  printf("\nTotal partitions: %zu\n", index->num_partitions);
+  printf("Block size: %u bytes\n", index->block_size);
+  return 0;
+}
+#endif
+
+#if defined(ENABLE_HTTP_SUPPORT) && !defined(PAYLOAD_DUMPER_NO_MAIN)
+// Completes the local copy written by --save-source and checks it against
+// the CRCs in its own central directory.
+static int finish_saved_source(reader_t *payload_reader) {
+  http_reader_t *http = &payload_reader->data.http;
+  char *path = strdup(http->cache->data_path);
+  if (!path)
+    return -1;
+
+  payload_log("- Completing saved source: %s\n", path);
+  if (http_reader_finish_source(http) != 0) {
+    payload_log("- Error: Failed to download the rest of the source\n");
+    free(path);
+    return -1;
+  }
+
+  reader_t local;
+  uint64_t verified = 0, skipped = 0;
+  int result = reader_init_file(&local, path);
+  if (result == 0) {
+    result = verify_zip_entries(&local, &verified, &skipped);
+    reader_cleanup(&local);
+  }
+  if (result != 0) {
+    payload_log("- Error: Saved source %s failed verification\n", path);
+  } else {
+    payload_log("- Saved source verified: %" PRIu64 " entries checked, %" PRIu64
+                " compressed entries skipped\n",
+                verified, skipped);
+  }
+  free(path);
+  return result;
+}
+#endif
+
+// Returns `<cache key><suffix>` next to the range cache's copy of a remote
+// archive, where indexes built from it are kept for repeat runs, or NULL
+// if the reader has no range cache. Nested archives add their offset
+// within the outer one to the name.
+static char *cache_sidecar_path(reader_t *reader, const char *suffix) {
+#ifdef ENABLE_HTTP_SUPPORT
+  uint64_t nested_offset = 0;
+  for (reader_t *layer = reader; layer->type == READER_RANGE;
+       layer = layer->data.range.source) {
+    nested_offset += layer->data.range.offset;
+  }
+  reader = reader_base(reader);
+  if (reader->type != READER_HTTP) {
+    return NULL;
+  }
+  http_reader_t *http = &reader->data.http;
+  if (!http->cache || http->saving_source) {
+    return NULL;
+  }
+  const char *data_path = http->cache->data_path;
+  size_t len = strlen(data_path);
+  if (len > 5 && strcmp(data_path + len - 5, ".data") == 0) {
+    len -= 5;
+  }
+  char nested[24] = "";
+  if (nested_offset > 0) {
+    snprintf(nested, sizeof(nested), "-%" PRIx64, nested_offset);
+  }
+  size_t size = len + strlen(nested) + strlen(suffix) + 1;
+  char *path = malloc(size);
+  if (path) {
+    snprintf(path, size, "%.*s%s%s", (int)len, data_path, nested, suffix);
+  }
+  return path;
+#else
+  (void)reader;
+  (void)suffix;
+  return NULL;
+#endif
+}
+
+// Returns where the payload index is kept: in --index-dir, or else next to
+// the range cache of a remote source. Sources that can only be read front
+// to back have none.
+static char *payload_index_location(reader_t *payload_reader,
+                                    const char *payload_path,
+                                    const char *index_dir) {
+  if (reader_is_sequential(payload_reader)) {
+    return NULL;
+  }
+  if (index_dir) {
+    return payload_index_path(index_dir, payload_path);
+  }
+  return cache_sidecar_path(payload_reader, ".payloadidx");
+}
+
+// Fills in the CRC in the key of the payload's index, from one read of the
+// payload header and one of the manifest's tail and the metadata
+// signature after it.
+static int read_payload_index_key(reader_t *payload_reader,
+                                  payload_index_key_t *key) {
+  uint64_t tail = (key->manifest_size > PAYLOAD_INDEX_KEY_SIZE)
+                      ? PAYLOAD_INDEX_KEY_SIZE
+                      : key->manifest_size;
+  uint64_t tail_offset =
+      key->payload_offset + MAGIC_LEN + 20 + key->manifest_size - tail;
+  size_t tail_size = (size_t)tail + key->metadata_signature_size;
+  uint8_t header[MAGIC_LEN + 20];
+  uint8_t *buffer = malloc(tail_size ? tail_size : 1);
+  size_t bytes_read;
+  if (!buffer ||
+      reader_read_at(payload_reader, key->payload_offset, header,
+                     sizeof(header), &bytes_read) != 0 ||
+      bytes_read != sizeof(header) ||
+      reader_read_at(payload_reader, tail_offset, buffer, tail_size,
+                     &bytes_read) != 0 ||
+      bytes_read != tail_size) {
+    free(buffer);
+    return -1;
+  }
+  key->key_crc =
+      crc32_hw(crc32_hw(0, header, sizeof(header)), buffer, tail_size);
+  free(buffer);
+  return 0;
+}
+
+// Fills in the partition summaries and, unless only listing, the op table
+// of the partitions being extracted. A matching saved index supplies both
+// without reading the manifest. Otherwise the manifest is read, and where
+// an index can be kept, every partition is decoded and saved for next
+// time. `manifest_data` is set to the manifest if it was read.
+static int plan_extraction(reader_t *payload_reader, const char *payload_path,
+                           const char *index_dir,
+                           const payload_index_key_t *key,
+                           const char *images_list, int list_only,
+                           payload_index_t *index, op_table_t *table,
+                           uint8_t **manifest_data) {
+  *manifest_data = NULL;
+  payload_index_key_t index_key = *key;
+  char *index_path =
+      payload_index_location(payload_reader, payload_path, index_dir);
+  if (index_path && read_payload_index_key(payload_reader, &index_key) != 0) {
+    free(index_path);
+    index_path = NULL;
+  }
+  if (index_path && payload_index_load(index, index_path, &index_key) == 0) {
+    if (list_only ||
+        payload_index_read_ops(index, index_path, images_list, table) == 0) {
+      free(index_path);
+      return 0;
+    }
+    payload_index_free(index);
+  }
+
+  size_t bytes_read;
+  uint8_t *data = malloc(key->manifest_size ? key->manifest_size : 1);
+  if (!data ||
+      reader_read_at(payload_reader, key->payload_offset + MAGIC_LEN + 20,
+                     data, key->manifest_size, &bytes_read) != 0 ||
+      bytes_read != key->manifest_size) {
+    payload_log("- Failed to read manifest\n");
+    free(data);
+    free(index_path);
+    return -1;
+  }
+
+  // Only the partition boundaries and names are read up front; operations
+  // are decoded just for the partitions being extracted, or for all of
+  // them when they go into an index
+  manifest_scan_t scan;
+  int result = manifest_scan(data, key->manifest_size, &scan);
+  if (result == 0 && !index_path) {
+    result = payload_index_from_scan(index, &scan);
+    if (result == 0 && !list_only &&
+        manifest_build_op_table(&scan, data, images_list, table) != 0) {
+      payload_index_free(index);
+      result = -1;
+    }
+    manifest_scan_free(&scan);
+  } else if (result == 0) {
+    op_table_t all;
+    result = manifest_build_op_table(&scan, data, NULL, &all);
+    if (result == 0 &&
+        payload_index_from_table(index, &all, scan.block_size, &index_key) !=
+            0) {
+      op_table_free(&all);
+      result = -1;
+    }
+    if (result == 0) {
+      if (payload_index_save(index, &all, index_path) != 0) {
+        payload_log("- Warning: Failed to save payload index to %s\n",
+                    index_path);
+      }
+      if (!list_only && images_list[0] == '\0') {
+        *table = all;
+      } else {
+        if (!list_only &&
+            manifest_build_op_table(&scan, data, images_list, table) != 0) {
+          payload_index_free(index);
+          result = -1;
+        }
+        op_table_free(&all);
+      }
+    }
+    manifest_scan_free(&scan);
+  }
+  free(index_path);
+  if (result != 0) {
+    payload_log("- Failed to parse manifest\n");
+    free(data);
+    return -1;
+  }
+  *manifest_data = data;
+  return 0;
+}
+
+// Finds payload.bin in `reader`, or in a stored ZIP inside it such as an
+// OTA package within a factory bundle. Returns the reader the entry
+// belongs to: `reader` itself, or a sub-range reader over the inner ZIP
+// that has taken over `reader`. Returns NULL, leaving `reader` to the
+// caller, if there is no payload.
+static reader_t *find_archive_payload(reader_t *reader, zip_entry_t *entry,
+                                      int depth) {
+  if (!reader->index_path) {
+    reader->index_path = cache_sidecar_path(reader, ".zipidx");
+  }
+  if (find_payload_entry(reader, entry) == 0 &&
+      get_data_offset(reader, entry) == 0) {
+    return reader;
+  }
+  if (depth >= MAX_ZIP_NESTING) {
+    return NULL;
+  }
+
+  const zip_index_t *index = zip_index_get(reader);
+  for (size_t i = 0; index && i < index->num_entries; i++) {
+    zip_entry_t nested = index->entries[i];
+    if (!is_nested_zip_entry(&nested) ||
+        get_data_offset(reader, &nested) != 0) {
+      continue;
+    }
+    reader_t *inner = malloc(sizeof(reader_t));
+    if (!inner) {
+      return NULL;
+    }
+    if (reader_init_range(inner, reader, nested.data_offset,
+                          nested.uncompressed_size, 0) == 0) {
+      payload_log("- Looking inside nested ZIP: %s\n", nested.name);
+      reader_t *found = find_archive_payload(inner, entry, depth + 1);
+      if (found) {
+        inner->data.range.owns_source = 1;
+        return found;
+      }
+      reader_cleanup(inner);
+    }
+    free(inner);
+  }
+  return NULL;
+}
+
+// Opens ZIP entry `entry` of `reader` as the payload: the archive itself
+// for a stored entry, or an inflating reader over it for a deflated one,
+// and checks its magic. Takes over `reader`, and returns NULL, having
+// freed it, if there is no usable payload.
+static reader_t *open_zip_payload(reader_t *reader, const zip_entry_t *entry,
+                                  const char *where,
+                                  payload_location_t *location) {
+  reader_t *payload_reader = reader;
+  location->offset = entry->data_offset;
+  if (entry->compression_method != 0) {
+    payload_reader = malloc(sizeof(reader_t));
+    char *index_path = cache_sidecar_path(reader, ".inflateidx");
+    if (!payload_reader ||
+        reader_init_inflate(payload_reader, reader, entry, index_path) != 0) {
+      payload_log("- Error: Failed to set up inflating of %s\n", entry->name);
+      free(index_path);
+      free(payload_reader);
+      reader_cleanup(reader);
+      free(reader);
+      return NULL;
+    }
+    free(index_path);
+    payload_log("- %s is deflated, inflating it while reading\n", entry->name);
+    location->offset = 0;
+  }
+
+  if (verify_payload_magic(payload_reader, location->offset) != 0) {
+    reader_cleanup(payload_reader);
+    free(payload_reader);
+    return NULL;
+  }
+  location->has_crc = 1;
+  location->crc32 = entry->crc32;
+  location->size = entry->uncompressed_size;
+  payload_log("- Found payload in %s: offset=%" PRIu64 ", size=%s\n", where,
+              entry->data_offset, format_size(location->size));
+  return payload_reader;
+}
+
+// Finds payload.bin in a tar archive, or in a tar.gz through an inflating
+// reader, either as a member of its own or inside an OTA ZIP member. The
+// members are read in place, so only the headers and the payload are
+// fetched. Takes over `reader` and frees it if there is no payload.
+static reader_t *open_tar_payload(reader_t *reader,
+                                  payload_location_t *location) {
+  if (reader_is_gzip(reader)) {
+    reader_t *inflated = malloc(sizeof(reader_t));
+    char *index_path = cache_sidecar_path(reader, ".inflateidx");
+    if (!inflated || reader_init_gzip(inflated, reader, index_path) != 0) {
+      payload_log("- Error: Failed to set up inflating of the gzip file\n");
+      free(index_path);
+      free(inflated);
+      reader_cleanup(reader);
+      free(reader);
+      return NULL;
+    }
+    free(index_path);
+    payload_log("- Source is gzip-compressed, inflating it while reading\n");
+    reader = inflated;
+  }
+
+  uint64_t offset = 0;
+  tar_member_t member;
+  int ret;
+  while ((ret = tar_next_member(reader, &offset, &member)) == 0) {
+    if (member.type != '0') {
+      continue;
+    }
+    const char *base = strrchr(member.name, '/');
+    base = base ? base + 1 : member.name;
+
+    if (strcmp(base, "payload.bin") == 0 &&
+        verify_payload_magic(reader, member.data_offset) == 0) {
+      location->offset = member.data_offset;
+      location->size = member.size;
+      payload_log("- Found payload in tar: %s, offset=%" PRIu64 ", size=%s\n",
+                  member.name, member.data_offset, format_size(member.size));
+      return reader;
+    }
+
+    if (is_zip_name(base) && member.size >= 22) {
+      reader_t *inner = malloc(sizeof(reader_t));
+      if (!inner) {
+        break;
+      }
+      if (reader_init_range(inner, reader, member.data_offset, member.size,
+                            0) != 0) {
+        free(inner);
+        continue;
+      }
+      payload_log("- Looking inside ZIP in tar: %s\n", member.name);
+      zip_entry_t payload_entry;
+      reader_t *archive = find_archive_payload(inner, &payload_entry, 1);
+      if (!archive) {
+        reader_cleanup(inner);
+        free(inner);
+        continue;
+      }
+      inner->data.range.owns_source = 1;
+      reader = open_zip_payload(archive, &payload_entry, "ZIP", location);
+      if (!reader) {
+        payload_log(
+            "- Error: No usable payload.bin found in the tar archive\n");
+      }
+      return reader;
+    }
+  }
+  if (ret < 0) {
+    payload_log("- Error: Damaged tar header at offset %" PRIu64 "\n", offset);
+  } else {
+    payload_log("- Error: No usable payload.bin found in the tar archive\n");
+  }
+  reader_cleanup(reader);
+  free(reader);
+  return NULL;
+}
+
+// Locates the payload in a stream reader, which can only be read front to
+// back. The payload is found from the local file headers, which come
+// before the data they describe.
+static reader_t *open_stream_source(reader_t *reader,
+                                    payload_location_t *location) {
+  if (verify_payload_magic(reader, 0) == 0) {
+    location->offset = 0;
+    location->size = 0;
+    return reader;
+  }
+
+  zip_entry_t payload_entry;
+  if (find_payload_local_header(reader, &payload_entry) == 0) {
+    reader = open_zip_payload(reader, &payload_entry, "ZIP stream", location);
+  } else {
+    reader_cleanup(reader);
+    free(reader);
+    reader = NULL;
+  }
+  if (!reader) {
+    payload_log("- Error: No usable payload.bin found in the stream\n");
+  }
+  return reader;
+}
+
+// Opens a local file that is still being written. The payload is located
+// from the local file headers at the front of the ZIP when possible, so
+// extraction can start before the central directory has been written.
+static reader_t *open_followed_source(reader_t *reader, const char *source_path,
+                                      payload_location_t *location) {
+  payload_log("- Following growing file: %s\n", source_path);
+  if (reader_init_follow(reader, source_path, g_expected_size) != 0) {
+    payload_log("- Error: %s did not appear\n", source_path);
+    free(reader);
+    return NULL;
+  }
+
+  if (verify_payload_magic(reader, 0) == 0) {
+    location->offset = 0;
+    location->size = g_expected_size;
+    return reader;
+  }
+
+  zip_entry_t payload_entry;
+  if (find_payload_local_header(reader, &payload_entry) == 0 ||
+      (find_payload_entry(reader, &payload_entry) == 0 &&
+       get_data_offset(reader, &payload_entry) == 0)) {
+    return open_zip_payload(reader, &payload_entry, "ZIP", location);
+  }
+  reader_cleanup(reader);
+  free(reader);
+  return NULL;
+}
+
+static reader_t *open_payload_source(const char *source_path,
+                                     const char *user_agent,
+                                     payload_location_t *location) {
+  memset(location, 0, sizeof(payload_location_t));
+  reader_t *reader = malloc(sizeof(reader_t));
+  if (!reader)
+    return NULL;
+
+  if (strcmp(source_path, "-") == 0) {
+    payload_log("- Reading payload from standard input\n");
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    if (reader_init_stream(reader, stdin, 0) != 0) {
+      free(reader);
+      return NULL;
+    }
+    return open_stream_source(reader, location);
+  }
+
+#ifdef ENABLE_HTTP_SUPPORT
+  if (strncmp(source_path, "http://", 7) == 0 ||
+      strncmp(source_path, "https://", 8) == 0) {
+    payload_log("- Opening remote ZIP: %s\n", source_path);
+    int silent = g_log_fn == NULL;
+    if (reader_init_http(reader, source_path, user_agent, silent) != 0) {
+      free(reader);
+      return NULL;
+    }
+    if (!reader->data.http.supports_ranges) {
+      reader_cleanup(reader);
+      http_stream_t *stream = http_stream_open(source_path, user_agent);
+      if (!stream) {
+        free(reader);
+        return NULL;
+      }
+      if (reader_init_stream(reader, stream->file, 1) != 0) {
+        fclose(stream->file);
+        http_stream_close(stream);
+        free(reader);
+        return NULL;
+      }
+      reader->data.stream.release = http_stream_close;
+      reader->data.stream.release_arg = stream;
+      return open_stream_source(reader, location);
+    }
+    if (reader_is_gzip(reader) || tar_is_archive(reader)) {
+      return open_tar_payload(reader, location);
+    }
+    zip_entry_t payload_entry;
+    reader_t *archive = find_archive_payload(reader, &payload_entry, 0);
+    if (archive) {
+      return open_zip_payload(archive, &payload_entry, "ZIP", location);
+    }
+    reader_cleanup(reader);
+    free(reader);
+    return NULL;
+  } else {
+#else
+  (void)user_agent;
+  if (strncmp(source_path, "http://", 7) == 0 ||
+      strncmp(source_path, "https://", 8) == 0) {
+    payload_log("- Error: HTTP support is not enabled in this build.\n");
+    payload_log(
+        "- Please recompile with HTTP support enabled or use a local file.\n");
+    free(reader);
+    return NULL;
+  } else {
+#endif
+
+    if (g_follow) {
+      return open_followed_source(reader, source_path, location);
+    }
+
+    struct stat st;
+    if (stat(source_path, &st) != 0) {
+      free(reader);
+      return NULL;
+    }
+
+    if (reader_init_file(reader, source_path) != 0) {
+      free(reader);
+      return NULL;
+    }
+
+    if (verify_payload_magic(reader, 0) == 0) {
+      location->offset = 0;
+      location->size = (uint64_t)st.st_size;
+      return reader;
+    }
+
+    if (reader_is_gzip(reader) || tar_is_archive(reader)) {
+      return open_tar_payload(reader, location);
+    }
+
+    zip_entry_t payload_entry;
+    reader_t *archive = find_archive_payload(reader, &payload_entry, 0);
+    if (archive) {
+      return open_zip_payload(archive, &payload_entry, "ZIP", location);
+    }
+    reader_cleanup(reader);
+    free(reader);
+    return NULL;
+  }
+}
+
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static int extract_payload(const char *payload_path, const char *user_agent,
+                           const char *out_dir, const char *images_list,
+                           int list_only, int num_threads) {
+  mutex_init(&g_progress_mutex);
+  mutex_init(&g_queue_mutex);
+
+  payload_location_t location;
+  reader_t *payload_reader =
+      open_payload_source(payload_path, user_agent, &location);
+  if (!payload_reader) {
+    payload_log("- Failed to open payload source: %s\n", payload_path);
+    mutex_destroy(&g_queue_mutex);
+    mutex_destroy(&g_progress_mutex);
+    return -1;
+  }
+  uint64_t payload_offset = location.offset;
+  uint64_t payload_size = location.size;
+  g_payload_has_crc = location.has_crc;
+  g_payload_crc32 = location.crc32;
+  g_stream_crc_active = 0;
+  if (g_verify_payload && g_payload_has_crc &&
+      reader_is_sequential(payload_reader)) {
+    track_stream_crc(payload_reader, payload_offset, payload_size);
+  }
+
+  uint8_t magic[MAGIC_LEN];
+  size_t bytes_read;
+  if (reader_read_at(payload_reader, payload_offset, magic, MAGIC_LEN,
+                     &bytes_read) != 0 ||
+      bytes_read != MAGIC_LEN || memcmp(magic, MAGIC_HEADER, MAGIC_LEN) != 0) {
+    payload_log("- Invalid magic header\n");
+    reader_cleanup(payload_reader);
+    free(payload_reader);
+    mutex_destroy(&g_queue_mutex);
+    mutex_destroy(&g_progress_mutex);
+    return -1;
+  }
+
+  uint8_t version_buf[8];
+  if (reader_read_at(payload_reader, payload_offset + MAGIC_LEN, version_buf, 8,
+                     &bytes_read) != 0 ||
+      bytes_read != 8) {
+    payload_log("- Failed to read file format version\n");
+    reader_cleanup(payload_reader);
+    free(payload_reader);
+    mutex_destroy(&g_queue_mutex);
     mutex_destroy(&g_progress_mutex);
     return -1;
   }
   uint64_t file_format_version = read_u64_be(version_buf);
 
   if (file_format_version != 2) {
-    printf("- Unsupported file format version: %" PRIu64 "\n",
-           file_format_version);
+    payload_log("- Unsupported file format version: %" PRIu64 "\n",
+                file_format_version);
     reader_cleanup(payload_reader);
     free(payload_reader);
     mutex_destroy(&g_queue_mutex);
@@ -779,7 +2106,7 @@ int extract_payload(const char *payload_path, const char *user_agent,
   uint8_t manifest_size_buf[8];
   if (reader_read_at(payload_reader, payload_offset + MAGIC_LEN + 8,
                      manifest_size_buf, 8, &bytes_read) != 0) {
-    printf("- Failed to read manifest size\n");
+    payload_log("- Failed to read manifest size\n");
     reader_cleanup(payload_reader);
     free(payload_reader);
     mutex_destroy(&g_queue_mutex);
@@ -791,7 +2118,7 @@ int extract_payload(const char *payload_path, const char *user_agent,
   uint8_t metadata_sig_size_buf[4];
   if (reader_read_at(payload_reader, payload_offset + MAGIC_LEN + 16,
                      metadata_sig_size_buf, 4, &bytes_read) != 0) {
-    printf("- Failed to read metadata signature size\n");
+    payload_log("- Failed to read metadata signature size\n");
     reader_cleanup(payload_reader);
     free(payload_reader);
     mutex_destroy(&g_queue_mutex);
@@ -800,30 +2127,23 @@ int extract_payload(const char *payload_path, const char *user_agent,
   }
   uint32_t metadata_signature_size = read_u32_be(metadata_sig_size_buf);
 
-  uint8_t *manifest_data = malloc(manifest_size);
-  if (!manifest_data ||
-      reader_read_at(payload_reader, payload_offset + MAGIC_LEN + 20,
-                     manifest_data, manifest_size, &bytes_read) != 0 ||
-      bytes_read != manifest_size) {
-    printf("- Failed to read manifest\n");
-    free(manifest_data);
-    reader_cleanup(payload_reader);
-    free(payload_reader);
-    mutex_destroy(&g_queue_mutex);
-    mutex_destroy(&g_progress_mutex);
-    return -1;
-  }
-
   uint64_t data_offset =
       payload_offset + MAGIC_LEN + 20 + manifest_size + metadata_signature_size;
 
-  ChromeosUpdateEngine__DeltaArchiveManifest *manifest =
-      chromeos_update_engine__delta_archive_manifest__unpack(
-          NULL, manifest_size, manifest_data);
-
-  if (!manifest) {
-    printf("- Failed to parse manifest\n");
-    free(manifest_data);
+  payload_index_key_t index_key;
+  memset(&index_key, 0, sizeof(index_key));
+  index_key.payload_offset = payload_offset;
+  index_key.payload_size = payload_size;
+  index_key.manifest_size = manifest_size;
+  index_key.metadata_signature_size = metadata_signature_size;
+  index_key.payload_crc32 = g_payload_has_crc ? g_payload_crc32 : 0;
+
+  payload_index_t index;
+  op_table_t op_table;
+  uint8_t *manifest_data;
+  if (plan_extraction(payload_reader, payload_path, g_index_dir, &index_key,
+                      images_list, list_only, &index, &op_table,
+                      &manifest_data) != 0) {
     reader_cleanup(payload_reader);
     free(payload_reader);
     mutex_destroy(&g_queue_mutex);
@@ -832,58 +2152,57 @@ int extract_payload(const char *payload_path, const char *user_agent,
   }
 
   if (list_only) {
-    list_partitions(manifest);
-    chromeos_update_engine__delta_archive_manifest__free_unpacked(manifest,
-                                                                  NULL);
+    int list_result = list_partitions(&index);
+    payload_index_free(&index);
     free(manifest_data);
     reader_cleanup(payload_reader);
     free(payload_reader);
     mutex_destroy(&g_queue_mutex);
     mutex_destroy(&g_progress_mutex);
-    return 0;
+    return list_result;
   }
 
+  if (!g_range_output) {
 #ifdef _WIN32
-  _mkdir(out_dir);
+    _mkdir(out_dir);
 #else
-  mkdir(out_dir, 0755);
+    mkdir(out_dir, 0755);
 #endif
-
-  g_num_partitions = (int)manifest->n_partitions;
-  for (size_t i = 0; i < manifest->n_partitions; i++) {
-#ifdef _MSC_VER
-    strncpy_s(g_progress[i].partition_name,
-              sizeof(g_progress[i].partition_name),
-              manifest->partitions[i]->partition_name, _TRUNCATE);
-#else
-    strncpy(g_progress[i].partition_name,
-            manifest->partitions[i]->partition_name,
-            sizeof(g_progress[i].partition_name) - 1);
-    g_progress[i].partition_name[sizeof(g_progress[i].partition_name) - 1] =
-        '\0';
-#endif
-    g_progress[i].total_ops = manifest->partitions[i]->n_operations;
-    g_progress[i].completed_ops = 0;
-    g_progress[i].thread_id = (int)(i % (size_t)num_threads);
   }
 
+  g_work_queue = op_table.partitions;
+  g_queue_size = (int)op_table.num_partitions;
+  g_current_work_index = 0;
+
   thread_t threads[MAX_THREADS];
   thread_data_t thread_data[MAX_THREADS];
   mutex_t reader_mutex;
   mutex_init(&reader_mutex);
-
-  g_work_queue = malloc(manifest->n_partitions *
-                        sizeof(ChromeosUpdateEngine__PartitionUpdate *));
-  g_queue_size = 0;
-  g_current_work_index = 0;
-
-  for (size_t i = 0; i < manifest->n_partitions; i++) {
-    if (images_list && strlen(images_list) > 0) {
-      if (!strstr(images_list, manifest->partitions[i]->partition_name))
-        continue;
+  mutex_init(&g_crc_mutex);
+
+  if (g_verify_payload && !g_payload_has_crc) {
+    payload_log("- Note: A bare payload.bin has no CRC-32 to verify\n");
+  } else if (g_verify_payload) {
+    // The header and manifest were read before tracking started; the
+    // metadata signature is read now, while a stream still has it
+    payload_crc_add(payload_offset, magic, MAGIC_LEN);
+    payload_crc_add(payload_offset + MAGIC_LEN, version_buf, 8);
+    payload_crc_add(payload_offset + MAGIC_LEN + 8, manifest_size_buf, 8);
+    payload_crc_add(payload_offset + MAGIC_LEN + 16, metadata_sig_size_buf, 4);
+    if (manifest_data) {
+      payload_crc_add(payload_offset + MAGIC_LEN + 20, manifest_data,
+                      manifest_size);
+    }
+    uint8_t *signature = malloc(metadata_signature_size + 1);
+    if (signature &&
+        reader_read_at(payload_reader,
+                       payload_offset + MAGIC_LEN + 20 + manifest_size,
+                       signature, metadata_signature_size, &bytes_read) == 0 &&
+        bytes_read == metadata_signature_size) {
+      payload_crc_add(payload_offset + MAGIC_LEN + 20 + manifest_size,
+                      signature, metadata_signature_size);
     }
-    g_work_queue[g_queue_size] = manifest->partitions[i];
-    g_queue_size++;
+    free(signature);
   }
 
   progress_initialized = 0;
@@ -892,25 +2211,38 @@ int extract_payload(const char *payload_path, const char *user_agent,
 #ifdef _MSC_VER
     strncpy_s(g_progress[i].partition_name,
               sizeof(g_progress[i].partition_name),
-              g_work_queue[i]->partition_name, _TRUNCATE);
+              g_work_queue[i].name, _TRUNCATE);
 #else
-    strncpy(g_progress[i].partition_name, g_work_queue[i]->partition_name,
+    strncpy(g_progress[i].partition_name, g_work_queue[i].name,
             sizeof(g_progress[i].partition_name) - 1);
     g_progress[i].partition_name[sizeof(g_progress[i].partition_name) - 1] =
         '\0';
 #endif
-    g_progress[i].total_ops = g_work_queue[i]->n_operations;
+    g_progress[i].total_ops = g_work_queue[i].num_ops;
     g_progress[i].completed_ops = 0;
     g_progress[i].thread_id = i % num_threads;
   }
 
   int active_threads =
       (g_queue_size < num_threads) ? g_queue_size : num_threads;
+  if (reader_is_sequential(payload_reader) || g_range_partition) {
+    active_threads = 0;
+  }
+
+  int result = 0;
+  if (g_range_partition) {
+    result = extract_range(&op_table, &index, payload_reader, data_offset,
+                           index.block_size, out_dir);
+  } else if (active_threads == 0 && g_queue_size > 0) {
+    result = extract_in_data_order(&op_table, payload_reader, data_offset,
+                                   index.block_size, out_dir, &reader_mutex);
+  }
 
   for (int i = 0; i < active_threads; i++) {
+    thread_data[i].table = &op_table;
     thread_data[i].payload_reader = payload_reader;
     thread_data[i].data_offset = data_offset;
-    thread_data[i].block_size = manifest->block_size;
+    thread_data[i].block_size = index.block_size;
     thread_data[i].out_dir = (char *)(uintptr_t)out_dir;
     thread_data[i].reader_mutex = &reader_mutex;
     thread_create(&threads[i], process_partition_thread, &thread_data[i]);
@@ -920,43 +2252,504 @@ int extract_payload(const char *payload_path, const char *user_agent,
     thread_join(threads[i]);
   }
 
-  free(g_work_queue);
-  printf("\nExtraction completed!\n");
+  g_work_queue = NULL;
+  if (result != 0) {
+    printf("\nExtraction failed!\n");
+  } else {
+    printf("\nExtraction completed!\n");
+  }
+  if (result == 0 && g_verify_payload && g_payload_has_crc &&
+      verify_payload_crc(payload_reader, payload_offset, payload_size) != 0) {
+    result = -1;
+  }
+  free(g_crc_segments);
+  g_crc_segments = NULL;
+  g_num_crc_segments = 0;
+  g_crc_segments_capacity = 0;
+#ifdef ENABLE_HTTP_SUPPORT
+  reader_t *base_reader = reader_base(payload_reader);
+  if (base_reader->type == READER_HTTP) {
+    if (base_reader->data.http.saving_source &&
+        finish_saved_source(base_reader) != 0) {
+      result = -1;
+    }
+    http_print_stats();
+    http_print_mirror_stats(&base_reader->data.http);
+  }
+#endif
 
-  chromeos_update_engine__delta_archive_manifest__free_unpacked(manifest, NULL);
+  op_table_free(&op_table);
+  payload_index_free(&index);
   free(manifest_data);
   reader_cleanup(payload_reader);
   free(payload_reader);
   mutex_destroy(&reader_mutex);
+  mutex_destroy(&g_crc_mutex);
   mutex_destroy(&g_queue_mutex);
   mutex_destroy(&g_progress_mutex);
 
+  return result;
+}
+#endif
+
+// payload_api.h: partitions read in place. Decoded operations are cached
+// by op table row, with the most recently used at the head of the list.
+static void block_cache_remove(payload_t *payload, cached_op_t *entry) {
+  if (entry->newer) {
+    entry->newer->older = entry->older;
+  } else {
+    payload->newest = entry->older;
+  }
+  if (entry->older) {
+    entry->older->newer = entry->newer;
+  } else {
+    payload->oldest = entry->newer;
+  }
+  entry->newer = NULL;
+  entry->older = NULL;
+}
+
+static void block_cache_push(payload_t *payload, cached_op_t *entry) {
+  entry->older = payload->newest;
+  entry->newer = NULL;
+  if (payload->newest) {
+    payload->newest->newer = entry;
+  } else {
+    payload->oldest = entry;
+  }
+  payload->newest = entry;
+}
+
+static void block_cache_evict(payload_t *payload, size_t limit) {
+  while (payload->oldest && payload->cache_used > limit) {
+    cached_op_t *entry = payload->oldest;
+    block_cache_remove(payload, entry);
+    payload->cached[entry->op] = NULL;
+    payload->cache_used -= entry->size;
+    free(entry->data);
+    free(entry);
+  }
+}
+
+// Takes over `data`. Output larger than the whole cache is not kept, nor
+// output another read has cached meanwhile.
+static void block_cache_insert(payload_t *payload, size_t op, uint8_t *data,
+                               size_t size) {
+  cached_op_t *entry =
+      (size <= payload->cache_limit && !payload->cached[op])
+          ? malloc(sizeof(cached_op_t))
+          : NULL;
+  if (!entry) {
+    free(data);
+    return;
+  }
+  block_cache_evict(payload, payload->cache_limit - size);
+  entry->op = op;
+  entry->data = data;
+  entry->size = size;
+  block_cache_push(payload, entry);
+  payload->cached[op] = entry;
+  payload->cache_used += size;
+}
+
+// Decodes an operation from its data, which it takes over, places its
+// output in `image` when one is given, and keeps the output in the cache.
+// Only the cache insert takes the payload's lock.
+static int block_cache_decode(payload_t *payload, size_t op, uint8_t *op_data,
+                              uint8_t *image, uint64_t range_offset,
+                              uint64_t range_length) {
+  const uint8_t *output = NULL;
+  size_t output_size = 0;
+  uint8_t *decompressed;
+  int kind = operation_output(&payload->table, op, op_data, &output,
+                              &output_size, &decompressed);
+  if (kind < 0) {
+    free(op_data);
+    return -1;
+  }
+  if (image) {
+    place_operation_output(&payload->table, op, (kind == 0) ? output : NULL,
+                           output_size, payload->index.block_size, image,
+                           range_offset, range_length);
+  }
+  if (kind != 0) {
+    free(op_data);
+    return 0;
+  }
+  if (decompressed) {
+    free(op_data);
+  } else {
+    decompressed = op_data;
+  }
+  mutex_lock(&payload->mutex);
+  block_cache_insert(payload, op, decompressed, output_size);
+  mutex_unlock(&payload->mutex);
+  return 0;
+}
+
+payload_t *payload_open(const char *source, const char *user_agent) {
+  payload_t *payload = calloc(1, sizeof(payload_t));
+  if (!payload) {
+    return NULL;
+  }
+  payload_location_t location;
+  payload->reader = open_payload_source(source, user_agent, &location);
+  if (!payload->reader) {
+    payload_log("- Failed to open payload source: %s\n", source);
+    free(payload);
+    return NULL;
+  }
+  if (reader_is_sequential(payload->reader)) {
+    payload_log("- Error: Reading partitions needs a source that can be read "
+                "at any offset\n");
+    reader_cleanup(payload->reader);
+    free(payload->reader);
+    free(payload);
+    return NULL;
+  }
+
+  uint8_t header[MAGIC_LEN + 20];
+  size_t bytes_read;
+  if (reader_read_at(payload->reader, location.offset, header, sizeof(header),
+                     &bytes_read) != 0 ||
+      bytes_read != sizeof(header) ||
+      memcmp(header, MAGIC_HEADER, MAGIC_LEN) != 0 ||
+      read_u64_be(&header[MAGIC_LEN]) != 2) {
+    payload_log("- Invalid payload header\n");
+    reader_cleanup(payload->reader);
+    free(payload->reader);
+    free(payload);
+    return NULL;
+  }
+
+  payload_index_key_t key;
+  memset(&key, 0, sizeof(key));
+  key.payload_offset = location.offset;
+  key.payload_size = location.size;
+  key.manifest_size = read_u64_be(&header[MAGIC_LEN + 8]);
+  key.metadata_signature_size = read_u32_be(&header[MAGIC_LEN + 16]);
+  key.payload_crc32 = location.has_crc ? location.crc32 : 0;
+  payload->data_offset = location.offset + MAGIC_LEN + 20 +
+                         key.manifest_size + key.metadata_signature_size;
+
+  uint8_t *manifest_data;
+  if (plan_extraction(payload->reader, source, NULL, &key, "", 0,
+                      &payload->index, &payload->table,
+                      &manifest_data) != 0) {
+    reader_cleanup(payload->reader);
+    free(payload->reader);
+    free(payload);
+    return NULL;
+  }
+  free(manifest_data);
+
+  payload->partitions = calloc(payload->table.num_partitions + 1,
+                               sizeof(payload_partition_t *));
+  payload->cached =
+      calloc(payload->table.num_ops + 1, sizeof(cached_op_t *));
+  if (!payload->partitions || !payload->cached) {
+    free(payload->partitions);
+    free(payload->cached);
+    op_table_free(&payload->table);
+    payload_index_free(&payload->index);
+    reader_cleanup(payload->reader);
+    free(payload->reader);
+    free(payload);
+    return NULL;
+  }
+  payload->cache_limit = PAYLOAD_CACHE_DEFAULT;
+  mutex_init(&payload->mutex);
+  mutex_init(&payload->reader_mutex);
+  return payload;
+}
+
+void payload_close(payload_t *payload) {
+  if (!payload) {
+    return;
+  }
+  block_cache_evict(payload, 0);
+  for (size_t i = 0; i < payload->table.num_partitions; i++) {
+    if (payload->partitions[i]) {
+      extent_index_free(&payload->partitions[i]->extents);
+      free(payload->partitions[i]);
+    }
+  }
+  free(payload->partitions);
+  free(payload->cached);
+  op_table_free(&payload->table);
+  payload_index_free(&payload->index);
+  reader_cleanup(payload->reader);
+  free(payload->reader);
+  mutex_destroy(&payload->mutex);
+  mutex_destroy(&payload->reader_mutex);
+  free(payload);
+}
+
+void payload_set_cache_size(payload_t *payload, size_t bytes) {
+  mutex_lock(&payload->mutex);
+  payload->cache_limit = bytes;
+  block_cache_evict(payload, bytes);
+  mutex_unlock(&payload->mutex);
+}
+
+size_t payload_num_partitions(const payload_t *payload) {
+  return payload->table.num_partitions;
+}
+
+const char *payload_partition_name(const payload_t *payload, size_t index) {
+  return (index < payload->table.num_partitions)
+             ? payload->table.partitions[index].name
+             : NULL;
+}
+
+payload_partition_t *payload_get_partition(payload_t *payload,
+                                           const char *name) {
+  size_t i;
+  for (i = 0; i < payload->table.num_partitions; i++) {
+    if (strcmp(payload->table.partitions[i].name, name) == 0) {
+      break;
+    }
+  }
+  if (i == payload->table.num_partitions) {
+    return NULL;
+  }
+
+  mutex_lock(&payload->mutex);
+  payload_partition_t *part = payload->partitions[i];
+  if (!part) {
+    part = calloc(1, sizeof(payload_partition_t));
+    if (part && extent_index_build(&part->extents, &payload->table,
+                                   &payload->table.partitions[i]) != 0) {
+      free(part);
+      part = NULL;
+    }
+    if (part) {
+      part->payload = payload;
+      part->part = &payload->table.partitions[i];
+      for (size_t j = 0; j < payload->index.num_partitions; j++) {
+        if (strcmp(payload->index.partitions[j].name, name) == 0) {
+          part->size = payload->index.partitions[j].size;
+        }
+      }
+      payload->partitions[i] = part;
+    }
+  }
+  mutex_unlock(&payload->mutex);
+  return part;
+}
+
+uint64_t partition_size(const payload_partition_t *part) {
+  return part->size;
+}
+
+static int compare_op_rows(const void *a, const void *b) {
+  size_t x = *(const size_t *)a;
+  size_t y = *(const size_t *)b;
+  return (x < y) ? -1 : (x > y);
+}
+
+// Adds the operations writing [start, end) of the partition that are
+// neither cached nor in `list` yet to the end of it, in row order. Rows
+// already in `list` are looked up by binary search, so they must be
+// sorted, as a single earlier call leaves them.
+static int add_uncached_ops(payload_partition_t *part, uint64_t start,
+                            uint64_t end, size_t **list, size_t *count) {
+  payload_t *payload = part->payload;
+  uint32_t block_size = payload->index.block_size;
+  size_t *ops;
+  size_t num_ops;
+  if (extent_index_covering_ops(&part->extents, start / block_size,
+                                (end + block_size - 1) / block_size, &ops,
+                                &num_ops) != 0) {
+    return -1;
+  }
+  size_t *grown = realloc(*list, (*count + num_ops + 1) * sizeof(size_t));
+  if (!grown) {
+    free(ops);
+    return -1;
+  }
+  *list = grown;
+  size_t known = *count;
+  for (size_t i = 0; i < num_ops; i++) {
+    size_t op = ops[i];
+    if (!bsearch(&op, *list, known, sizeof(size_t), compare_op_rows) &&
+        !payload->cached[op] &&
+        payload->table.data_length[op] > 0) {
+      (*list)[(*count)++] = op;
+    }
+  }
+  free(ops);
   return 0;
 }
 
-void print_usage(const char *program_name) {
+int64_t partition_pread(payload_partition_t *part, void *buf, size_t len,
+                        uint64_t off) {
+  payload_t *payload = part->payload;
+  const op_table_t *table = &payload->table;
+  uint32_t block_size = payload->index.block_size;
+  if (off >= part->size || len == 0) {
+    return 0;
+  }
+  uint64_t length = part->size - off;
+  if (len < length) {
+    length = len;
+  }
+  uint64_t end = off + length;
+
+  mutex_lock(&payload->mutex);
+  // Reads that carry on from the last one double the readahead window
+  if (off == part->next_offset && off > 0) {
+    part->readahead = part->readahead ? part->readahead * 2
+                                      : PAYLOAD_READAHEAD_MIN;
+    if (part->readahead > PAYLOAD_READAHEAD_MAX) {
+      part->readahead = PAYLOAD_READAHEAD_MAX;
+    }
+  } else {
+    part->readahead = 0;
+  }
+  part->next_offset = end;
+
+  size_t *ops = NULL;
+  size_t num_ops = 0;
+  size_t *fetch = NULL;
+  size_t num_fetch = 0;
+  uint64_t ahead_end =
+      (part->readahead < part->size - end) ? end + part->readahead : part->size;
+  int result = extent_index_covering_ops(&part->extents, off / block_size,
+                                         (end + block_size - 1) / block_size,
+                                         &ops, &num_ops);
+  if (result == 0) {
+    result = add_uncached_ops(part, off, end, &fetch, &num_fetch);
+  }
+  size_t num_needed = num_fetch;
+  if (result == 0 && ahead_end > end) {
+    result = add_uncached_ops(part, end, ahead_end, &fetch, &num_fetch);
+  }
+
+  // Cached operations this read needs are marked as used and copied out
+  // while the lock is held, so no other read can evict them first. Ops
+  // without data write zeroes; those that need a source image fail.
+  uint8_t *image = buf;
+  if (result == 0) {
+    memset(image, 0, (size_t)length);
+  }
+  for (size_t i = 0; result == 0 && i < num_ops; i++) {
+    size_t op = ops[i];
+    cached_op_t *entry = payload->cached[op];
+    if (entry) {
+      block_cache_remove(payload, entry);
+      block_cache_push(payload, entry);
+      place_operation_output(table, op, entry->data, entry->size, block_size,
+                             image, off, length);
+    } else if (table->data_length[op] == 0) {
+      const uint8_t *output;
+      size_t output_size;
+      uint8_t *decompressed;
+      if (operation_output(table, op, NULL, &output, &output_size,
+                           &decompressed) < 0) {
+        result = -1;
+      }
+    }
+  }
+  mutex_unlock(&payload->mutex);
+
+  // Everything missing, including the readahead, comes in one read. The
+  // data is decoded without the lock, so other reads of the payload only
+  // wait for each other's cache updates.
+  reader_range_t *ranges = calloc(num_fetch + 1, sizeof(reader_range_t));
+  uint8_t **fetched = calloc(num_fetch + 1, sizeof(uint8_t *));
+  if (result == 0 && (!ranges || !fetched)) {
+    result = -1;
+  }
+  for (size_t i = 0; result == 0 && i < num_fetch; i++) {
+    size_t op = fetch[i];
+    fetched[i] = malloc(table->data_length[op]);
+    if (!fetched[i]) {
+      result = -1;
+      break;
+    }
+    ranges[i].offset = payload->data_offset + table->data_offset[op];
+    ranges[i].size = table->data_length[op];
+    ranges[i].buffer = fetched[i];
+  }
+  if (result == 0 && num_fetch > 0) {
+    qsort(ranges, num_fetch, sizeof(reader_range_t), compare_reader_ranges);
+    mutex_lock(&payload->reader_mutex);
+    result = reader_read_ranges(payload->reader, ranges, num_fetch);
+    mutex_unlock(&payload->reader_mutex);
+  }
+
+  for (size_t i = 0; result == 0 && i < num_needed; i++) {
+    uint8_t *op_data = fetched[i];
+    fetched[i] = NULL;
+    result = block_cache_decode(payload, fetch[i], op_data, image, off, length);
+  }
+  for (size_t i = num_needed; result == 0 && i < num_fetch; i++) {
+    uint8_t *op_data = fetched[i];
+    fetched[i] = NULL;
+    block_cache_decode(payload, fetch[i], op_data, NULL, 0, 0);
+  }
+  for (size_t i = 0; fetched && i < num_fetch; i++) {
+    free(fetched[i]);
+  }
+  free(fetched);
+  free(ranges);
+  free(fetch);
+  free(ops);
+  return (result == 0) ? (int64_t)length : -1;
+}
+
+#ifndef PAYLOAD_DUMPER_NO_MAIN
+static void print_usage(const char *program_name) {
   printf("Usage: %s <payload_source> [options]\n", program_name);
   printf("Sources:\n");
-  printf("  <file_path>          Local payload.bin or ZIP file\n");
+  printf("  <file_path>          Local payload.bin, ZIP, tar or tar.gz file\n");
+  printf("  -                    payload.bin or stored ZIP read from stdin\n");
 #ifdef ENABLE_HTTP_SUPPORT
-  printf("  <http_url>           Remote ZIP file URL\n");
+  printf("  <http_url>           Remote ZIP, tar or tar.gz file URL\n");
 #else
-  printf("  <http_url>           Remote ZIP file URL (not available in this "
-         "build)\n");
+  printf("  <http_url>           Remote ZIP, tar or tar.gz file URL (not "
+         "available in this build)\n");
 #endif
   printf("Options:\n");
   printf("  --out <dir>          Output directory (default: output)\n");
   printf("  --images <list>      Comma-separated list of images to extract\n");
   printf("  --list               List all partitions and exit\n");
+  printf("  --range <part:offset:length> Extract only these bytes of one "
+         "partition; --out - writes them to stdout\n");
   printf("  --threads <num>      Number of threads to use\n");
+  printf("  --follow             Extract from a local file that is still being "
+         "written\n");
+  printf("  --expected-size <size> Final size of the followed file (default: "
+         "read from the ZIP)\n");
 #ifdef ENABLE_HTTP_SUPPORT
   printf("  --user-agent <ua>    Custom User-Agent for HTTP requests\n");
+  printf("  --cache-dir <dir>    Cache fetched ranges of remote files in <dir>\n");
+  printf("  --stripe-size <size> Split large remote reads into parallel stripes "
+         "of <size> (default: 8M)\n");
+  printf("  --save-source <path> Also save the remote file to <path>\n");
+  printf("  --mirror <url>       Another URL serving the same file (repeatable)"
+         "\n");
+  printf("  --max-rate <size>    Limit total download rate to <size> per "
+         "second\n");
+  printf("  --max-rate-file <path> Read the rate limit from <path>, re-read "
+         "every second or on SIGHUP\n");
 #endif
+  printf("  --index-dir <dir>    Keep payload indexes in <dir> for faster repeat "
+         "runs\n");
+  printf("  --verify-payload     Check payload.bin against the CRC-32 in the "
+         "ZIP\n");
   printf("  --help               Show this help message\n");
 }
 
+static void log_to_stdout(void *ctx, const char *message) {
+  (void)ctx;
+  fputs(message, stdout);
+}
+
 int main(int argc, char *argv[]) {
   const char *user_agent = NULL;
+  payload_set_log(log_to_stdout, NULL);
   if (argc < 2) {
     print_usage(argv[0]);
     return -1;
@@ -985,17 +2778,68 @@ int main(int argc, char *argv[]) {
       images_list = argv[++i];
     } else if (strcmp(argv[i], "--list") == 0) {
       list_only = 1;
+    } else if (strcmp(argv[i], "--range") == 0 && i + 1 < argc) {
+      if (parse_range(argv[++i]) != 0) {
+        fprintf(stderr,
+                "- Error: Invalid range '%s', expected partition:offset:length"
+                "\n",
+                argv[i]);
+        return -1;
+      }
     } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
       num_threads = atoi(argv[++i]);
       if (num_threads <= 0 || num_threads > MAX_THREADS) {
         num_threads = 4;
       }
+    } else if (strcmp(argv[i], "--index-dir") == 0 && i + 1 < argc) {
+      g_index_dir = argv[++i];
+    } else if (strcmp(argv[i], "--verify-payload") == 0) {
+      g_verify_payload = 1;
+    } else if (strcmp(argv[i], "--follow") == 0) {
+      g_follow = 1;
+    } else if (strcmp(argv[i], "--expected-size") == 0 && i + 1 < argc) {
+      if (parse_size(argv[++i], &g_expected_size) != 0 ||
+          g_expected_size == 0) {
+        fprintf(stderr, "- Error: Invalid expected size '%s'\n", argv[i]);
+        return -1;
+      }
     } else if (strcmp(argv[i], "--user-agent") == 0 && i + 1 < argc) {
       user_agent = argv[++i];
+#ifdef ENABLE_HTTP_SUPPORT
+    } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+      http_set_cache_dir(argv[++i]);
+    } else if (strcmp(argv[i], "--stripe-size") == 0 && i + 1 < argc) {
+      uint64_t stripe_size;
+      if (parse_size(argv[++i], &stripe_size) != 0 || stripe_size == 0 ||
+          stripe_size > SIZE_MAX) {
+        fprintf(stderr, "- Error: Invalid stripe size '%s'\n", argv[i]);
+        return -1;
+      }
+      http_set_stripe_size((size_t)stripe_size);
+    } else if (strcmp(argv[i], "--save-source") == 0 && i + 1 < argc) {
+      http_set_save_source(argv[++i]);
+    } else if (strcmp(argv[i], "--max-rate") == 0 && i + 1 < argc) {
+      uint64_t max_rate;
+      if (parse_size(argv[++i], &max_rate) != 0 || max_rate == 0) {
+        fprintf(stderr, "- Error: Invalid rate '%s'\n", argv[i]);
+        return -1;
+      }
+      http_set_max_rate(max_rate);
+    } else if (strcmp(argv[i], "--max-rate-file") == 0 && i + 1 < argc) {
+      if (http_set_rate_file(argv[++i]) != 0) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--mirror") == 0 && i + 1 < argc) {
+      if (http_add_mirror(argv[++i]) != 0) {
+        fprintf(stderr, "- Error: Too many mirrors (at most %d)\n",
+                HTTP_MAX_MIRRORS - 1);
+        return -1;
+      }
+#endif
     } else if (strcmp(argv[i], "--help") == 0) {
       print_usage(argv[0]);
       return 0;
-    } else if (argv[i][0] != '-') {
+    } else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0) {
       if (payload_path == NULL) {
         payload_path = argv[i];
       } else {
@@ -1017,12 +2861,38 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
-  printf("- Payload Dumper\n");
+  if (g_range_partition) {
+    images_list = g_range_partition;
+    if (strcmp(out_dir, "-") == 0) {
+      // The range goes to standard output, so messages go to standard error
+      fflush(stdout);
+#ifdef _WIN32
+      int data_fd = _dup(_fileno(stdout));
+      if (data_fd >= 0) {
+        _setmode(data_fd, _O_BINARY);
+        g_range_output = _fdopen(data_fd, "wb");
+      }
+      int redirected = _dup2(_fileno(stderr), _fileno(stdout));
+#else
+      int data_fd = dup(fileno(stdout));
+      if (data_fd >= 0) {
+        g_range_output = fdopen(data_fd, "wb");
+      }
+      int redirected = dup2(fileno(stderr), fileno(stdout));
+#endif
+      if (!g_range_output || redirected < 0) {
+        fprintf(stderr, "- Error: Cannot write the range to standard output\n");
+        return -1;
+      }
+    }
+  }
+
+  payload_log("- Payload Dumper\n");
   if (!list_only) {
-    printf("- Output directory: %s\n", out_dir);
-    printf("- Threads: %d\n", num_threads);
+    payload_log("- Output directory: %s\n", out_dir);
+    payload_log("- Threads: %d\n", num_threads);
     if (strlen(images_list) > 0) {
-      printf("- Selected images: %s\n", images_list);
+      payload_log("- Selected images: %s\n", images_list);
     }
     printf("\n");
   }
@@ -1030,3 +2900,4 @@ int main(int argc, char *argv[]) {
   return extract_payload(payload_path, user_agent, out_dir, images_list,
                          list_only, num_threads);
 }
+#endif
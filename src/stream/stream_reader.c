@@ -0,0 +1,127 @@
+#include "stream_reader.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t stream_end(const stream_reader_t *reader) {
+  return reader->window_start + reader->window_len;
+}
+
+// Keeps the newest bytes taken from the stream in the window.
+static void remember(stream_reader_t *reader, const uint8_t *data, size_t size) {
+  if (size >= STREAM_WINDOW_SIZE) {
+    reader->window_start = stream_end(reader) + size - STREAM_WINDOW_SIZE;
+    memcpy(reader->window, data + size - STREAM_WINDOW_SIZE,
+           STREAM_WINDOW_SIZE);
+    reader->window_len = STREAM_WINDOW_SIZE;
+    return;
+  }
+  if (reader->window_len + size > STREAM_WINDOW_SIZE) {
+    size_t drop = reader->window_len + size - STREAM_WINDOW_SIZE;
+    memmove(reader->window, reader->window + drop, reader->window_len - drop);
+    reader->window_start += drop;
+    reader->window_len -= drop;
+  }
+  memcpy(reader->window + reader->window_len, data, size);
+  reader->window_len += size;
+}
+
+// Consumes the stream up to `offset` without handing the bytes to anyone.
+static int skip_to(stream_reader_t *reader, uint64_t offset) {
+  while (stream_end(reader) < offset && !reader->at_eof) {
+    if (reader->window_len == STREAM_WINDOW_SIZE) {
+      reader->window_start += reader->window_len;
+      reader->window_len = 0;
+    }
+    uint64_t gap = offset - stream_end(reader);
+    size_t space = STREAM_WINDOW_SIZE - reader->window_len;
+    size_t chunk = (gap < space) ? (size_t)gap : space;
+    size_t got =
+        fread(reader->window + reader->window_len, 1, chunk, reader->file);
+    if (reader->on_data && got > 0) {
+      reader->on_data(reader->on_data_arg, stream_end(reader),
+                      reader->window + reader->window_len, got);
+    }
+    reader->window_len += got;
+    if (got < chunk) {
+      reader->at_eof = 1;
+    }
+  }
+  return (stream_end(reader) >= offset) ? 0 : -1;
+}
+
+int stream_reader_init(stream_reader_t *reader, FILE *file, int owns_file) {
+  memset(reader, 0, sizeof(stream_reader_t));
+  reader->window = malloc(STREAM_WINDOW_SIZE);
+  if (!reader->window) {
+    return -1;
+  }
+  reader->file = file;
+  reader->owns_file = owns_file;
+  return 0;
+}
+
+void stream_reader_cleanup(stream_reader_t *reader) {
+  if (reader->file && reader->owns_file) {
+    fclose(reader->file);
+  }
+  reader->file = NULL;
+  if (reader->release) {
+    reader->release(reader->release_arg);
+    reader->release = NULL;
+  }
+  free(reader->window);
+  reader->window = NULL;
+}
+
+int stream_reader_seek(stream_reader_t *reader, uint64_t offset) {
+  reader->current_pos = offset;
+  return 0;
+}
+
+int stream_reader_read_at(stream_reader_t *reader, uint64_t offset,
+                          uint8_t *buffer, size_t size, size_t *bytes_read) {
+  *bytes_read = 0;
+  if (offset < reader->window_start) {
+    fprintf(stderr,
+            "- Error: Stream offset %llu was already consumed (now at %llu)\n",
+            (unsigned long long)offset, (unsigned long long)stream_end(reader));
+    return -1;
+  }
+
+  size_t copied = 0;
+  if (offset < stream_end(reader)) {
+    uint64_t buffered = stream_end(reader) - offset;
+    copied = (size < buffered) ? size : (size_t)buffered;
+    memcpy(buffer, reader->window + (offset - reader->window_start), copied);
+    if (reader->on_data) {
+      reader->on_data(reader->on_data_arg, offset, buffer, copied);
+    }
+  } else if (skip_to(reader, offset) != 0) {
+    return 0;
+  }
+
+  if (copied < size && !reader->at_eof) {
+    size_t got = fread(buffer + copied, 1, size - copied, reader->file);
+    if (got < size - copied) {
+      reader->at_eof = 1;
+    }
+    if (reader->on_data && got > 0) {
+      reader->on_data(reader->on_data_arg, stream_end(reader), buffer + copied,
+                      got);
+    }
+    remember(reader, buffer + copied, got);
+    copied += got;
+  }
+  *bytes_read = copied;
+  return (copied == size || reader->at_eof) ? 0 : -1;
+}
+
+int stream_reader_read(stream_reader_t *reader, uint8_t *buffer, size_t size,
+                       size_t *bytes_read) {
+  int result = stream_reader_read_at(reader, reader->current_pos, buffer, size,
+                                     bytes_read);
+  if (result == 0) {
+    reader->current_pos += *bytes_read;
+  }
+  return result;
+}
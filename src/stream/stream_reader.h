@@ -0,0 +1,42 @@
+#ifndef STREAM_READER_H
+#define STREAM_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STREAM_WINDOW_SIZE (256 * 1024)
+
+// Reads a source that can only be consumed front to back, such as stdin or
+// a pipe. Reads at increasing offsets skip the bytes in between. The last
+// STREAM_WINDOW_SIZE bytes are kept so that small reads can go back over
+// data that was just consumed; anything older is gone.
+typedef void (*stream_data_fn)(void *arg, uint64_t offset, const uint8_t *data,
+                               size_t size);
+
+typedef struct {
+  FILE *file;
+  int owns_file;
+  uint8_t *window;
+  uint64_t window_start; // Stream offset of window[0]
+  size_t window_len;
+  uint64_t current_pos;
+  int at_eof;
+  // Called after the file is closed, for sources fed by another thread
+  void (*release)(void *arg);
+  void *release_arg;
+  // Sees every byte read or skipped over, at least once and in order, for
+  // checks over data that is gone by the time they run
+  stream_data_fn on_data;
+  void *on_data_arg;
+} stream_reader_t;
+
+int stream_reader_init(stream_reader_t *reader, FILE *file, int owns_file);
+void stream_reader_cleanup(stream_reader_t *reader);
+int stream_reader_seek(stream_reader_t *reader, uint64_t offset);
+int stream_reader_read_at(stream_reader_t *reader, uint64_t offset,
+                          uint8_t *buffer, size_t size, size_t *bytes_read);
+int stream_reader_read(stream_reader_t *reader, uint8_t *buffer, size_t size,
+                       size_t *bytes_read);
+
+#endif
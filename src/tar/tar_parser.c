@@ -0,0 +1,188 @@
+#include "tar_parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAR_MAX_EXTENDED_HEADER (64 * 1024)
+
+// Numeric header fields are octal text, or base-256 with the top bit of
+// the first byte set when the value does not fit.
+static uint64_t parse_number(const uint8_t *field, size_t len) {
+  uint64_t value = 0;
+  if (field[0] & 0x80) {
+    value = field[0] & 0x7F;
+    for (size_t i = 1; i < len; i++) {
+      value = (value << 8) | field[i];
+    }
+    return value;
+  }
+
+  size_t i = 0;
+  while (i < len && (field[i] == ' ' || field[i] == '\0')) {
+    i++;
+  }
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+    value = value * 8 + (uint64_t)(field[i] - '0');
+  }
+  return value;
+}
+
+static int is_zero_block(const uint8_t *header) {
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+    if (header[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// The checksum is the sum of the header bytes with the checksum field
+// itself counted as spaces.
+static int checksum_ok(const uint8_t *header) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+    sum += (i >= 148 && i < 156) ? ' ' : header[i];
+  }
+  return sum == parse_number(&header[148], 8);
+}
+
+static void copy_name(char *dest, size_t dest_size, const char *src,
+                      size_t src_len) {
+  size_t len = 0;
+  while (len < src_len && len < dest_size - 1 && src[len] != '\0') {
+    len++;
+  }
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+// Picks the path and size out of a pax extended header, a list of
+// "<length> <key>=<value>\n" records.
+static void parse_pax(const char *data, size_t len, char *path,
+                      size_t path_size, int *has_path, uint64_t *size,
+                      int *has_size) {
+  size_t pos = 0;
+  while (pos < len) {
+    size_t record_len = 0;
+    size_t p = pos;
+    while (p < len && data[p] >= '0' && data[p] <= '9') {
+      record_len = record_len * 10 + (size_t)(data[p] - '0');
+      p++;
+    }
+    if (record_len == 0 || record_len > len - pos || p >= len ||
+        data[p] != ' ') {
+      return;
+    }
+
+    const char *key = data + p + 1;
+    const char *record_end = data + pos + record_len - 1;
+    const char *eq = (key < record_end) ? memchr(key, '=', record_end - key)
+                                        : NULL;
+    if (eq) {
+      size_t key_len = (size_t)(eq - key);
+      const char *value = eq + 1;
+      size_t value_len = (size_t)(record_end - value);
+      if (key_len == 4 && memcmp(key, "path", 4) == 0) {
+        copy_name(path, path_size, value, value_len);
+        *has_path = 1;
+      } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+        *size = 0;
+        for (size_t i = 0; i < value_len && value[i] >= '0' && value[i] <= '9';
+             i++) {
+          *size = *size * 10 + (uint64_t)(value[i] - '0');
+        }
+        *has_size = 1;
+      }
+    }
+    pos += record_len;
+  }
+}
+
+// A tar archive starts with a header block whose checksum matches.
+int tar_is_archive(reader_t *reader) {
+  uint8_t header[TAR_BLOCK_SIZE];
+  size_t bytes_read;
+  return reader_read_at(reader, 0, header, sizeof(header), &bytes_read) == 0 &&
+         bytes_read == sizeof(header) && !is_zero_block(header) &&
+         checksum_ok(header);
+}
+
+// Reads the member whose header is at `*offset` and moves `*offset` on to
+// the next header, without reading the member's data. GNU long names and
+// pax extended headers are applied to the member they precede. Returns 0
+// for a member, 1 at the end of the archive and -1 on a damaged header.
+int tar_next_member(reader_t *reader, uint64_t *offset, tar_member_t *member) {
+  char long_name[sizeof(member->name)];
+  int has_long_name = 0;
+  uint64_t pax_size = 0;
+  int has_pax_size = 0;
+
+  for (;;) {
+    uint8_t header[TAR_BLOCK_SIZE];
+    size_t bytes_read;
+    if (reader_read_at(reader, *offset, header, sizeof(header), &bytes_read) !=
+            0 ||
+        bytes_read != sizeof(header)) {
+      return -1;
+    }
+    if (is_zero_block(header)) {
+      return 1;
+    }
+    if (!checksum_ok(header)) {
+      return -1;
+    }
+
+    uint64_t size = parse_number(&header[124], 12);
+    char type = (char)header[156];
+    uint64_t data_offset = *offset + TAR_BLOCK_SIZE;
+
+    if (type == 'L' || type == 'x') {
+      size_t len = (size < TAR_MAX_EXTENDED_HEADER) ? (size_t)size
+                                                    : TAR_MAX_EXTENDED_HEADER;
+      char *data = malloc(len + 1);
+      if (!data || reader_read_at(reader, data_offset, (uint8_t *)data, len,
+                                  &bytes_read) != 0 ||
+          bytes_read != len) {
+        free(data);
+        return -1;
+      }
+      if (type == 'L') {
+        copy_name(long_name, sizeof(long_name), data, len);
+        has_long_name = 1;
+      } else {
+        parse_pax(data, len, long_name, sizeof(long_name), &has_long_name,
+                  &pax_size, &has_pax_size);
+      }
+      free(data);
+    }
+    if (type == 'L' || type == 'x' || type == 'g' || type == 'K') {
+      *offset = data_offset + ((size + TAR_BLOCK_SIZE - 1) &
+                               ~(uint64_t)(TAR_BLOCK_SIZE - 1));
+      continue;
+    }
+
+    memset(member, 0, sizeof(tar_member_t));
+    if (has_long_name) {
+      memcpy(member->name, long_name, sizeof(member->name));
+    } else if (memcmp(&header[257], "ustar", 5) == 0 && header[345] != '\0') {
+      char prefix[156];
+      char name[101];
+      copy_name(prefix, sizeof(prefix), (const char *)&header[345], 155);
+      copy_name(name, sizeof(name), (const char *)header, 100);
+      snprintf(member->name, sizeof(member->name), "%s/%s", prefix, name);
+    } else {
+      copy_name(member->name, sizeof(member->name), (const char *)header, 100);
+    }
+    if (has_pax_size) {
+      size = pax_size;
+    }
+
+    member->header_offset = *offset;
+    member->data_offset = data_offset;
+    member->size = size;
+    member->type = (type == '\0') ? '0' : type;
+    *offset = data_offset +
+              ((size + TAR_BLOCK_SIZE - 1) & ~(uint64_t)(TAR_BLOCK_SIZE - 1));
+    return 0;
+  }
+}
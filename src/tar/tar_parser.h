@@ -0,0 +1,22 @@
+#ifndef TAR_PARSER_H
+#define TAR_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zip_parser.h"
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct {
+  char name[512];
+  uint64_t header_offset;
+  uint64_t data_offset;
+  uint64_t size;
+  char type; // '0' for a regular file, as in the header's typeflag
+} tar_member_t;
+
+int tar_is_archive(reader_t *reader);
+int tar_next_member(reader_t *reader, uint64_t *offset, tar_member_t *member);
+
+#endif
@@ -0,0 +1,60 @@
+#include "units.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+char *format_size(uint64_t bytes) {
+  static THREAD_LOCAL char buffer[32];
+  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  int unit_idx = 0;
+  double size = (double)bytes;
+
+  while (size >= 1024.0 && unit_idx < 4) {
+    size /= 1024.0;
+    unit_idx++;
+  }
+
+  snprintf(buffer, sizeof(buffer), "%.2f %s", size, units[unit_idx]);
+  return buffer;
+}
+
+int parse_size(const char *str, uint64_t *size) {
+  if (*str < '0' || *str > '9') {
+    return -1;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno == ERANGE) {
+    return -1;
+  }
+  unsigned long long scale = 1;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    scale = 1024ULL;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    scale = 1024ULL * 1024;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    scale = 1024ULL * 1024 * 1024;
+    end++;
+    break;
+  }
+  if (*end != '\0' || value > UINT64_MAX / scale) {
+    return -1;
+  }
+  *size = (uint64_t)(value * scale);
+  return 0;
+}
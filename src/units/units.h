@@ -0,0 +1,14 @@
+#ifndef UNITS_H
+#define UNITS_H
+
+#include <stdint.h>
+
+// Byte count as text with a binary unit, such as "1.50 MB". The result
+// lives in a buffer of the calling thread that the next call overwrites.
+char *format_size(uint64_t bytes);
+
+// Parses a byte count with an optional K, M or G suffix into `*size`.
+// Returns -1 for anything else, including counts that do not fit.
+int parse_size(const char *str, uint64_t *size);
+
+#endif
@@ -0,0 +1,274 @@
+#include "zip_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const uint8_t *p = (const uint8_t *)name; *p; p++) {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+static int build_buckets(zip_index_t *index) {
+  size_t num_buckets = 16;
+  while (num_buckets < index->num_entries * 2) {
+    num_buckets *= 2;
+  }
+  index->buckets = calloc(num_buckets, sizeof(uint32_t));
+  if (!index->buckets) {
+    return -1;
+  }
+  index->num_buckets = num_buckets;
+
+  for (size_t i = 0; i < index->num_entries; i++) {
+    size_t bucket = hash_name(index->entries[i].name) & (num_buckets - 1);
+    while (index->buckets[bucket] != 0) {
+      // A repeated name keeps its first entry, like the linear scan did
+      if (strcmp(index->entries[index->buckets[bucket] - 1].name,
+                 index->entries[i].name) == 0) {
+        break;
+      }
+      bucket = (bucket + 1) & (num_buckets - 1);
+    }
+    if (index->buckets[bucket] == 0) {
+      index->buckets[bucket] = (uint32_t)(i + 1);
+    }
+  }
+  return 0;
+}
+
+// Finds the end-of-central-directory record and the CRC that identifies
+// the archive.
+static int read_key(reader_t *reader, uint64_t *eocd_offset,
+                    uint32_t *key_crc) {
+  uint16_t num_entries_16;
+  if (find_eocd(reader, eocd_offset, &num_entries_16) != 0) {
+    return -1;
+  }
+
+  uint64_t start = (*eocd_offset > ZIP_INDEX_KEY_SIZE)
+                       ? *eocd_offset - ZIP_INDEX_KEY_SIZE
+                       : 0;
+  size_t size = (size_t)(*eocd_offset - start) + 22;
+  uint8_t *buffer = malloc(size);
+  size_t bytes_read;
+  if (!buffer ||
+      reader_read_at(reader, start, buffer, size, &bytes_read) != 0 ||
+      bytes_read != size) {
+    free(buffer);
+    return -1;
+  }
+  *key_crc = zip_crc32(0, buffer, size);
+  free(buffer);
+  return 0;
+}
+
+int zip_index_build(zip_index_t *index, reader_t *reader) {
+  memset(index, 0, sizeof(zip_index_t));
+
+  uint64_t eocd_offset, cd_offset, num_entries;
+  if (read_key(reader, &eocd_offset, &index->key_crc) != 0 ||
+      get_central_directory_info(reader, &cd_offset, &num_entries) != 0 ||
+      cd_offset > eocd_offset) {
+    return -1;
+  }
+  index->archive_size = reader_get_size(reader);
+
+  // The directory ends at the zip64 records or the EOCD record; reading up
+  // to the latter covers it either way.
+  size_t cd_size = (size_t)(eocd_offset - cd_offset);
+  uint8_t *cd = malloc(cd_size ? cd_size : 1);
+  index->entries = calloc(num_entries ? num_entries : 1, sizeof(zip_entry_t));
+  size_t bytes_read;
+  if (!cd || !index->entries ||
+      (cd_size > 0 && (reader_read_at(reader, cd_offset, cd, cd_size,
+                                      &bytes_read) != 0 ||
+                       bytes_read != cd_size))) {
+    free(cd);
+    zip_index_free(index);
+    return -1;
+  }
+
+  size_t pos = 0;
+  for (uint64_t i = 0; i < num_entries; i++) {
+    size_t record_size;
+    if (parse_central_directory_entry(cd + pos, cd_size - pos,
+                                      &index->entries[index->num_entries],
+                                      &record_size) != 0) {
+      break;
+    }
+    index->num_entries++;
+    pos += record_size;
+  }
+  free(cd);
+
+  if (index->num_entries != num_entries || build_buckets(index) != 0) {
+    zip_index_free(index);
+    return -1;
+  }
+  return 0;
+}
+
+void zip_index_free(zip_index_t *index) {
+  free(index->entries);
+  free(index->buckets);
+  index->entries = NULL;
+  index->buckets = NULL;
+  index->num_entries = 0;
+  index->num_buckets = 0;
+}
+
+const zip_entry_t *zip_index_find(const zip_index_t *index, const char *name) {
+  if (index->num_buckets == 0) {
+    return NULL;
+  }
+  size_t bucket = hash_name(name) & (index->num_buckets - 1);
+  while (index->buckets[bucket] != 0) {
+    const zip_entry_t *entry = &index->entries[index->buckets[bucket] - 1];
+    if (strcmp(entry->name, name) == 0) {
+      return entry;
+    }
+    bucket = (bucket + 1) & (index->num_buckets - 1);
+  }
+  return NULL;
+}
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+// Layout: magic, version, archive size, key CRC and entry count, then per
+// entry its name length and name followed by the fixed-size fields, all
+// little-endian.
+int zip_index_save(const zip_index_t *index, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[28];
+  memcpy(header, ZIP_INDEX_MAGIC, 4);
+  put_le(&header[4], ZIP_INDEX_VERSION, 4);
+  put_le(&header[8], index->archive_size, 8);
+  put_le(&header[16], index->key_crc, 4);
+  put_le(&header[20], index->num_entries, 8);
+  int ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+  for (size_t i = 0; ok && i < index->num_entries; i++) {
+    const zip_entry_t *entry = &index->entries[i];
+    uint16_t name_len = (uint16_t)strlen(entry->name);
+    uint8_t fields[40];
+    put_le(&fields[0], name_len, 2);
+    put_le(&fields[2], entry->compressed_size, 8);
+    put_le(&fields[10], entry->uncompressed_size, 8);
+    put_le(&fields[18], entry->local_header_offset, 8);
+    put_le(&fields[26], entry->data_offset, 8);
+    put_le(&fields[34], entry->crc32, 4);
+    put_le(&fields[38], entry->compression_method, 2);
+    ok = fwrite(fields, 1, sizeof(fields), file) == sizeof(fields) &&
+         fwrite(entry->name, 1, name_len, file) == name_len;
+  }
+
+  if (fclose(file) != 0 || !ok) {
+    remove(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Loads an index saved by zip_index_save. Fails, so that the caller
+// rebuilds it, if the file is missing or damaged or was built from a
+// different archive.
+int zip_index_load(zip_index_t *index, const char *path, reader_t *reader) {
+  memset(index, 0, sizeof(zip_index_t));
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[28];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, ZIP_INDEX_MAGIC, 4) != 0 ||
+      read_u32_le(&header[4]) != ZIP_INDEX_VERSION) {
+    fclose(file);
+    return -1;
+  }
+  index->archive_size = read_u64_le(&header[8]);
+  index->key_crc = read_u32_le(&header[16]);
+  uint64_t num_entries = read_u64_le(&header[20]);
+
+  uint64_t eocd_offset;
+  uint32_t key_crc;
+  if (index->archive_size != reader_get_size(reader) ||
+      read_key(reader, &eocd_offset, &key_crc) != 0 ||
+      key_crc != index->key_crc || num_entries > eocd_offset / 46 + 1) {
+    fclose(file);
+    return -1;
+  }
+
+  index->entries = calloc(num_entries ? num_entries : 1, sizeof(zip_entry_t));
+  if (!index->entries) {
+    fclose(file);
+    return -1;
+  }
+  for (uint64_t i = 0; i < num_entries; i++) {
+    zip_entry_t *entry = &index->entries[i];
+    uint8_t fields[40];
+    if (fread(fields, 1, sizeof(fields), file) != sizeof(fields)) {
+      break;
+    }
+    size_t name_len = read_u16_le(&fields[0]);
+    if (name_len >= sizeof(entry->name) ||
+        fread(entry->name, 1, name_len, file) != name_len) {
+      break;
+    }
+    entry->name[name_len] = '\0';
+    entry->compressed_size = read_u64_le(&fields[2]);
+    entry->uncompressed_size = read_u64_le(&fields[10]);
+    entry->local_header_offset = read_u64_le(&fields[18]);
+    entry->data_offset = read_u64_le(&fields[26]);
+    entry->crc32 = read_u32_le(&fields[34]);
+    entry->compression_method = read_u16_le(&fields[38]);
+    index->num_entries++;
+  }
+  fclose(file);
+
+  if (index->num_entries != num_entries || build_buckets(index) != 0) {
+    zip_index_free(index);
+    return -1;
+  }
+  return 0;
+}
+
+// Returns the reader's index, building it on first use. When the reader
+// has an index path, a matching saved index is used instead of parsing the
+// directory, and a freshly built one is saved there.
+const zip_index_t *zip_index_get(reader_t *reader) {
+  if (reader->index) {
+    return reader->index;
+  }
+
+  zip_index_t *index = malloc(sizeof(zip_index_t));
+  if (!index) {
+    return NULL;
+  }
+  if (reader->index_path &&
+      zip_index_load(index, reader->index_path, reader) == 0) {
+    reader->index = index;
+    return index;
+  }
+  if (zip_index_build(index, reader) != 0) {
+    free(index);
+    return NULL;
+  }
+  if (reader->index_path && zip_index_save(index, reader->index_path) != 0) {
+    fprintf(stderr, "- Warning: Failed to save ZIP index to %s\n",
+            reader->index_path);
+  }
+  reader->index = index;
+  return index;
+}
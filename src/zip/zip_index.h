@@ -0,0 +1,34 @@
+#ifndef ZIP_INDEX_H
+#define ZIP_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zip_parser.h"
+
+#define ZIP_INDEX_MAGIC "PDZI"
+#define ZIP_INDEX_VERSION 1
+#define ZIP_INDEX_KEY_SIZE 1024
+
+// Every entry of a ZIP's central directory, read with a single request and
+// looked up by name through an open-addressing hash table. The key ties a
+// saved index to the archive it was built from: the archive size and a
+// CRC of the bytes just before the end-of-central-directory record plus
+// the record itself.
+typedef struct zip_index {
+  zip_entry_t *entries;
+  size_t num_entries;
+  uint32_t *buckets; // Entry index + 1, 0 for an empty bucket
+  size_t num_buckets;
+  uint64_t archive_size;
+  uint32_t key_crc;
+} zip_index_t;
+
+int zip_index_build(zip_index_t *index, reader_t *reader);
+void zip_index_free(zip_index_t *index);
+const zip_entry_t *zip_index_find(const zip_index_t *index, const char *name);
+int zip_index_save(const zip_index_t *index, const char *path);
+int zip_index_load(zip_index_t *index, const char *path, reader_t *reader);
+const zip_index_t *zip_index_get(reader_t *reader);
+
+#endif
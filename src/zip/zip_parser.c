@@ -2,6 +2,8 @@
     #include <io.h>
 #endif
 #include "zip_parser.h"
+#include "crc32_hw.h"
+#include "zip_index.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +24,11 @@ uint64_t read_u64_le(const uint8_t *data) {
          ((uint64_t)data[6] << 48) | ((uint64_t)data[7] << 56);
 }
 
+// CRC-32 as used by ZIP (reflected, polynomial 0xEDB88320)
+uint32_t zip_crc32(uint32_t crc, const uint8_t *data, size_t size) {
+  return crc32_hw(crc, data, size);
+}
+
 int reader_init_file(reader_t *reader, const char *path) {
   FILE *file = fopen(path, "rb");
   if (!file) {
@@ -47,15 +54,157 @@ int reader_init_file(reader_t *reader, const char *path) {
 #endif
 
   reader->type = READER_FILE;
+  reader->index = NULL;
+  reader->index_path = NULL;
   reader->data.file = file;
   reader->size = size;
   return 0;
 }
 
+int reader_init_follow(reader_t *reader, const char *path,
+                       uint64_t expected_size) {
+  reader->type = READER_FOLLOW;
+  reader->index = NULL;
+  reader->index_path = NULL;
+  if (follow_reader_init(&reader->data.follow, path, expected_size) != 0) {
+    return -1;
+  }
+  reader->size = expected_size;
+  return 0;
+}
+
+int reader_init_stream(reader_t *reader, FILE *file, int owns_file) {
+  reader->type = READER_STREAM;
+  reader->index = NULL;
+  reader->index_path = NULL;
+  if (stream_reader_init(&reader->data.stream, file, owns_file) != 0) {
+    return -1;
+  }
+  reader->size = 0;
+  return 0;
+}
+
+static int read_source(void *source, uint64_t offset, uint8_t *buffer,
+                       size_t size, size_t *bytes_read) {
+  return reader_read_at((reader_t *)source, offset, buffer, size, bytes_read);
+}
+
+// Presents the uncompressed data of a deflated entry at offset 0. On
+// success the reader takes over `source`, which must be heap-allocated.
+int reader_init_inflate(reader_t *reader, reader_t *source,
+                        const zip_entry_t *entry, const char *index_path) {
+  reader->type = READER_INFLATE;
+  reader->index = NULL;
+  reader->index_path = NULL;
+  if (entry->compression_method != 8 ||
+      inflate_reader_init(&reader->data.inflate, read_source, source,
+                          entry->data_offset, entry->compressed_size,
+                          entry->uncompressed_size, entry->crc32,
+                          index_path) != 0) {
+    return -1;
+  }
+  reader->size = entry->uncompressed_size;
+  return 0;
+}
+
+// Whether the reader starts with the magic of a deflate-compressed gzip file
+int reader_is_gzip(reader_t *reader) {
+  uint8_t magic[3];
+  size_t bytes_read;
+  return reader_read_at(reader, 0, magic, 3, &bytes_read) == 0 &&
+         bytes_read == 3 && magic[0] == 0x1F && magic[1] == 0x8B &&
+         magic[2] == 8;
+}
+
+// Presents the uncompressed contents of a gzip file at offset 0, like
+// reader_init_inflate does for a deflated ZIP entry. Only the first gzip
+// member is read. The size is left unknown, as the trailer only has it
+// modulo 4 GiB. On success the reader takes over `source`.
+int reader_init_gzip(reader_t *reader, reader_t *source,
+                     const char *index_path) {
+  uint8_t header[10];
+  uint8_t trailer[8];
+  size_t bytes_read;
+  uint64_t source_size = reader_get_size(source);
+  if (source_size < sizeof(header) + sizeof(trailer) ||
+      reader_read_at(source, 0, header, sizeof(header), &bytes_read) != 0 ||
+      bytes_read != sizeof(header) || header[0] != 0x1F || header[1] != 0x8B ||
+      header[2] != 8 ||
+      reader_read_at(source, source_size - sizeof(trailer), trailer,
+                     sizeof(trailer), &bytes_read) != 0 ||
+      bytes_read != sizeof(trailer)) {
+    return -1;
+  }
+
+  // Optional fields: extra data, file name, comment and header CRC
+  uint8_t flags = header[3];
+  uint64_t offset = sizeof(header);
+  if (flags & 0x04) {
+    uint8_t extra_len[2];
+    if (reader_read_at(source, offset, extra_len, 2, &bytes_read) != 0 ||
+        bytes_read != 2) {
+      return -1;
+    }
+    offset += 2 + read_u16_le(extra_len);
+  }
+  for (uint8_t field = 0x08; field <= 0x10; field <<= 1) {
+    if (!(flags & field)) {
+      continue;
+    }
+    uint8_t c = 1;
+    while (c != 0) {
+      if (offset >= source_size ||
+          reader_read_at(source, offset++, &c, 1, &bytes_read) != 0 ||
+          bytes_read != 1) {
+        return -1;
+      }
+    }
+  }
+  if (flags & 0x02) {
+    offset += 2;
+  }
+  if (offset + sizeof(trailer) > source_size) {
+    return -1;
+  }
+
+  reader->type = READER_INFLATE;
+  reader->index = NULL;
+  reader->index_path = NULL;
+  if (inflate_reader_init(&reader->data.inflate, read_source, source, offset,
+                          source_size - sizeof(trailer) - offset,
+                          INFLATE_SIZE_UNKNOWN, read_u32_le(trailer),
+                          index_path) != 0) {
+    return -1;
+  }
+  reader->size = INFLATE_SIZE_UNKNOWN;
+  return 0;
+}
+
+// Presents `size` bytes of `source` starting at `offset` as a reader of
+// their own, without copying them.
+int reader_init_range(reader_t *reader, reader_t *source, uint64_t offset,
+                      uint64_t size, int owns_source) {
+  reader->type = READER_RANGE;
+  reader->index = NULL;
+  reader->index_path = NULL;
+  if (offset > reader_get_size(source) ||
+      size > reader_get_size(source) - offset) {
+    return -1;
+  }
+  reader->data.range.source = source;
+  reader->data.range.owns_source = owns_source;
+  reader->data.range.offset = offset;
+  reader->data.range.current_pos = 0;
+  reader->size = size;
+  return 0;
+}
+
 #ifdef ENABLE_HTTP_SUPPORT
 int reader_init_http(reader_t *reader, const char *url, const char *user_agent,
                      int silent) {
   reader->type = READER_HTTP;
+  reader->index = NULL;
+  reader->index_path = NULL;
   if (http_reader_init(&reader->data.http, url, silent) != 0) {
     return -1;
   }
@@ -71,12 +220,31 @@ void reader_cleanup(reader_t *reader) {
   if (reader->type == READER_FILE && reader->data.file) {
     fclose(reader->data.file);
     reader->data.file = NULL;
+  } else if (reader->type == READER_FOLLOW) {
+    follow_reader_cleanup(&reader->data.follow);
+  } else if (reader->type == READER_STREAM) {
+    stream_reader_cleanup(&reader->data.stream);
+  } else if (reader->type == READER_INFLATE) {
+    reader_t *source = reader->data.inflate.source;
+    inflate_reader_cleanup(&reader->data.inflate);
+    reader_cleanup(source);
+    free(source);
+  } else if (reader->type == READER_RANGE && reader->data.range.owns_source) {
+    reader_cleanup(reader->data.range.source);
+    free(reader->data.range.source);
   }
 #ifdef ENABLE_HTTP_SUPPORT
   else if (reader->type == READER_HTTP) {
     http_reader_cleanup(&reader->data.http);
   }
 #endif
+  if (reader->index) {
+    zip_index_free(reader->index);
+    free(reader->index);
+    reader->index = NULL;
+  }
+  free(reader->index_path);
+  reader->index_path = NULL;
 }
 
 int reader_seek(reader_t *reader, uint64_t offset) {
@@ -86,6 +254,15 @@ int reader_seek(reader_t *reader, uint64_t offset) {
 #else
     return fseek(reader->data.file, (long)offset, SEEK_SET);
 #endif
+  } else if (reader->type == READER_FOLLOW) {
+    return follow_reader_seek(&reader->data.follow, offset);
+  } else if (reader->type == READER_STREAM) {
+    return stream_reader_seek(&reader->data.stream, offset);
+  } else if (reader->type == READER_INFLATE) {
+    return inflate_reader_seek(&reader->data.inflate, offset);
+  } else if (reader->type == READER_RANGE) {
+    reader->data.range.current_pos = offset;
+    return 0;
   }
 #ifdef ENABLE_HTTP_SUPPORT
   else if (reader->type == READER_HTTP) {
@@ -100,6 +277,20 @@ int reader_read(reader_t *reader, uint8_t *buffer, size_t size,
   if (reader->type == READER_FILE) {
     *bytes_read = fread(buffer, 1, size, reader->data.file);
     return (*bytes_read > 0 || feof(reader->data.file)) ? 0 : -1;
+  } else if (reader->type == READER_FOLLOW) {
+    return follow_reader_read(&reader->data.follow, buffer, size, bytes_read);
+  } else if (reader->type == READER_STREAM) {
+    return stream_reader_read(&reader->data.stream, buffer, size, bytes_read);
+  } else if (reader->type == READER_INFLATE) {
+    return inflate_reader_read(&reader->data.inflate, buffer, size,
+                               bytes_read);
+  } else if (reader->type == READER_RANGE) {
+    int result = reader_read_at(reader, reader->data.range.current_pos, buffer,
+                                size, bytes_read);
+    if (result == 0) {
+      reader->data.range.current_pos += *bytes_read;
+    }
+    return result;
   }
 #ifdef ENABLE_HTTP_SUPPORT
   else if (reader->type == READER_HTTP) {
@@ -123,6 +314,26 @@ int reader_read_at(reader_t *reader, uint64_t offset, uint8_t *buffer,
 #endif
     *bytes_read = fread(buffer, 1, size, reader->data.file);
     return (*bytes_read > 0 || feof(reader->data.file)) ? 0 : -1;
+  } else if (reader->type == READER_FOLLOW) {
+    return follow_reader_read_at(&reader->data.follow, offset, buffer, size,
+                                 bytes_read);
+  } else if (reader->type == READER_STREAM) {
+    return stream_reader_read_at(&reader->data.stream, offset, buffer, size,
+                                 bytes_read);
+  } else if (reader->type == READER_INFLATE) {
+    return inflate_reader_read_at(&reader->data.inflate, offset, buffer, size,
+                                  bytes_read);
+  } else if (reader->type == READER_RANGE) {
+    *bytes_read = 0;
+    if (offset >= reader->size) {
+      return 0;
+    }
+    if (size > reader->size - offset) {
+      size = (size_t)(reader->size - offset);
+    }
+    return reader_read_at(reader->data.range.source,
+                          reader->data.range.offset + offset, buffer, size,
+                          bytes_read);
   }
 #ifdef ENABLE_HTTP_SUPPORT
   else if (reader->type == READER_HTTP) {
@@ -133,7 +344,97 @@ int reader_read_at(reader_t *reader, uint64_t offset, uint8_t *buffer,
   return -1;
 }
 
-uint64_t reader_get_size(reader_t *reader) { return reader->size; }
+// Reads several ranges at once. Over HTTP they are batched into
+// multi-range requests; every range must be satisfied in full.
+int reader_read_ranges(reader_t *reader, reader_range_t *ranges,
+                       size_t count) {
+#ifdef ENABLE_HTTP_SUPPORT
+  if (reader->type == READER_HTTP) {
+    http_range_t *http_ranges = malloc(count * sizeof(http_range_t));
+    if (!http_ranges) {
+      return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+      http_ranges[i].offset = ranges[i].offset;
+      http_ranges[i].size = ranges[i].size;
+      http_ranges[i].buffer = ranges[i].buffer;
+    }
+    int result = http_reader_read_ranges(&reader->data.http, http_ranges, count);
+    free(http_ranges);
+    return result;
+  }
+#endif
+
+  if (reader->type == READER_RANGE) {
+    reader_range_t *shifted = malloc(count * sizeof(reader_range_t));
+    if (!shifted) {
+      return -1;
+    }
+    int result = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (ranges[i].offset > reader->size ||
+          ranges[i].size > reader->size - ranges[i].offset) {
+        result = -1;
+      }
+      shifted[i] = ranges[i];
+      shifted[i].offset += reader->data.range.offset;
+    }
+    if (result == 0) {
+      result = reader_read_ranges(reader->data.range.source, shifted, count);
+    }
+    free(shifted);
+    return result;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    size_t bytes_read;
+    if (reader_read_at(reader, ranges[i].offset, ranges[i].buffer,
+                       ranges[i].size, &bytes_read) != 0 ||
+        bytes_read != ranges[i].size) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+uint64_t reader_get_size(reader_t *reader) {
+  if (reader->type == READER_FOLLOW && reader->size == 0) {
+    reader->size = follow_reader_get_size(&reader->data.follow);
+  }
+  return reader->size;
+}
+
+// File readers share one FILE position, so reader_read_at must be
+// serialized by the caller. HTTP readers give every transfer its own
+// handle and can be read from several threads at once.
+int reader_supports_concurrent_reads(reader_t *reader) {
+  if (reader->type == READER_RANGE) {
+    return reader_supports_concurrent_reads(reader->data.range.source);
+  }
+#ifdef ENABLE_HTTP_SUPPORT
+  if (reader->type == READER_HTTP) {
+    return 1;
+  }
+#endif
+  (void)reader;
+  return 0;
+}
+
+// Stream readers only move forward, so data has to be read in the order
+// it appears in the source.
+int reader_is_sequential(reader_t *reader) {
+  return reader_base(reader)->type == READER_STREAM;
+}
+
+// Returns the reader that fetches the bytes, below any inflating or
+// sub-range readers.
+reader_t *reader_base(reader_t *reader) {
+  while (reader->type == READER_INFLATE || reader->type == READER_RANGE) {
+    reader = (reader->type == READER_INFLATE) ? reader->data.inflate.source
+                                              : reader->data.range.source;
+  }
+  return reader;
+}
 
 int find_eocd(reader_t *reader, uint64_t *eocd_offset, uint16_t *num_entries) {
   uint64_t file_size = reader_get_size(reader);
@@ -289,128 +590,128 @@ int get_central_directory_info(reader_t *reader, uint64_t *cd_offset,
   }
 }
 
-int read_central_directory_entry(reader_t *reader, zip_entry_t *entry) {
-  uint8_t entry_header[46];
-  size_t bytes_read;
-
-  if (reader_read(reader, entry_header, 46, &bytes_read) != 0 ||
-      bytes_read < 46) {
+// Parses one central directory record from memory. `*record_size` is set
+// to the length of the whole record, including its name, extra field and
+// comment.
+int parse_central_directory_entry(const uint8_t *data, size_t size,
+                                  zip_entry_t *entry, size_t *record_size) {
+  if (size < 46 || read_u32_le(data) != CENTRAL_DIR_HEADER_SIG) {
     return -1;
   }
 
-  uint32_t sig = read_u32_le(entry_header);
-  if (sig != CENTRAL_DIR_HEADER_SIG) {
+  entry->compression_method = read_u16_le(&data[10]);
+  entry->crc32 = read_u32_le(&data[16]);
+  uint16_t filename_len = read_u16_le(&data[28]);
+  uint16_t extra_len = read_u16_le(&data[30]);
+  uint16_t comment_len = read_u16_le(&data[32]);
+
+  uint64_t local_header_offset = read_u32_le(&data[42]);
+  uint64_t compressed_size = read_u32_le(&data[20]);
+  uint64_t uncompressed_size = read_u32_le(&data[24]);
+
+  *record_size = 46 + (size_t)filename_len + extra_len + comment_len;
+  if (*record_size > size) {
     return -1;
   }
 
-  entry->compression_method = read_u16_le(&entry_header[10]);
-  uint16_t filename_len = read_u16_le(&entry_header[28]);
-  uint16_t extra_len = read_u16_le(&entry_header[30]);
-  uint16_t comment_len = read_u16_le(&entry_header[32]);
+  size_t name_len = filename_len;
+  if (name_len >= sizeof(entry->name)) {
+    name_len = sizeof(entry->name) - 1;
+  }
+  memcpy(entry->name, &data[46], name_len);
+  entry->name[name_len] = '\0';
 
-  uint64_t local_header_offset = read_u32_le(&entry_header[42]);
-  uint64_t compressed_size = read_u32_le(&entry_header[20]);
-  uint64_t uncompressed_size = read_u32_le(&entry_header[24]);
+  const uint8_t *extra_data = &data[46 + filename_len];
+  if (local_header_offset == 0xFFFFFFFF || compressed_size == 0xFFFFFFFF ||
+      uncompressed_size == 0xFFFFFFFF) {
+    uint32_t pos = 0;
+    while (pos + 4 <= extra_len) {
+      uint16_t header_id = read_u16_le(&extra_data[pos]);
+      uint16_t data_size = read_u16_le(&extra_data[pos + 2]);
 
-  if (filename_len >= sizeof(entry->name)) {
-    filename_len = sizeof(entry->name) - 1;
-  }
+      if (header_id == 0x0001 && (uint32_t)(pos + 4 + data_size) <= extra_len) {
+        uint32_t field_pos = pos + 4;
+        uint32_t section_end = pos + 4 + data_size;
 
-  if (reader_read(reader, (uint8_t *)entry->name, filename_len, &bytes_read) !=
-      0) {
-    return -1;
-  }
-  entry->name[filename_len] = '\0';
-
-  uint8_t *extra_data = NULL;
-  if (extra_len > 0) {
-    extra_data = malloc(extra_len);
-    if (extra_data &&
-        reader_read(reader, extra_data, extra_len, &bytes_read) == 0) {
-      if (local_header_offset == 0xFFFFFFFF || compressed_size == 0xFFFFFFFF ||
-          uncompressed_size == 0xFFFFFFFF) {
-
-        uint32_t pos = 0;
-        while (pos + 4 <= extra_len) {
-          uint16_t header_id = read_u16_le(&extra_data[pos]);
-          uint16_t data_size = read_u16_le(&extra_data[pos + 2]);
-
-          if (header_id == 0x0001 &&
-              (uint32_t)(pos + 4 + data_size) <= extra_len) {
-            uint32_t field_pos = pos + 4;
-            uint32_t section_end = pos + 4 + data_size;
-
-            if (uncompressed_size == 0xFFFFFFFF &&
-                field_pos + 8 <= section_end) {
-              uncompressed_size = read_u64_le(&extra_data[field_pos]);
-              field_pos += 8;
-            }
-
-            if (compressed_size == 0xFFFFFFFF && field_pos + 8 <= section_end) {
-              compressed_size = read_u64_le(&extra_data[field_pos]);
-              field_pos += 8;
-            }
-
-            if (local_header_offset == 0xFFFFFFFF &&
-                field_pos + 8 <= section_end) {
-              local_header_offset = read_u64_le(&extra_data[field_pos]);
-            }
-            break;
-          }
+        if (uncompressed_size == 0xFFFFFFFF && field_pos + 8 <= section_end) {
+          uncompressed_size = read_u64_le(&extra_data[field_pos]);
+          field_pos += 8;
+        }
 
-          if ((uint32_t)(4 + data_size) > UINT32_MAX - pos)
-            break; // Prevent overflow
-          pos += (uint32_t)(4 + data_size);
+        if (compressed_size == 0xFFFFFFFF && field_pos + 8 <= section_end) {
+          compressed_size = read_u64_le(&extra_data[field_pos]);
+          field_pos += 8;
         }
-      }
-    }
-    free(extra_data);
-  }
 
-  // Skip comment
-  if (comment_len > 0) {
-    if (reader->type == READER_FILE) {
-      fseek(reader->data.file, comment_len, SEEK_CUR);
-    }
-#ifdef ENABLE_HTTP_SUPPORT
-    else if (reader->type == READER_HTTP) {
-      reader->data.http.current_pos += comment_len;
+        if (local_header_offset == 0xFFFFFFFF && field_pos + 8 <= section_end) {
+          local_header_offset = read_u64_le(&extra_data[field_pos]);
+        }
+        break;
+      }
+      pos += (uint32_t)(4 + data_size);
     }
-#endif
   }
 
   entry->compressed_size = compressed_size;
   entry->uncompressed_size = uncompressed_size;
   entry->local_header_offset = local_header_offset;
   entry->data_offset = 0;
-
   return 0;
 }
 
-int find_payload_entry(reader_t *reader, zip_entry_t *payload_entry) {
-  uint64_t cd_offset, num_entries;
+int read_central_directory_entry(reader_t *reader, zip_entry_t *entry) {
+  uint8_t entry_header[46];
+  size_t bytes_read;
 
-  if (get_central_directory_info(reader, &cd_offset, &num_entries) != 0) {
+  if (reader_read(reader, entry_header, 46, &bytes_read) != 0 ||
+      bytes_read < 46 || read_u32_le(entry_header) != CENTRAL_DIR_HEADER_SIG) {
     return -1;
   }
 
-  if (reader_seek(reader, cd_offset) != 0) {
+  size_t variable_len = (size_t)read_u16_le(&entry_header[28]) +
+                        read_u16_le(&entry_header[30]) +
+                        read_u16_le(&entry_header[32]);
+  uint8_t *record = malloc(46 + variable_len);
+  if (!record) {
     return -1;
   }
+  memcpy(record, entry_header, 46);
 
-  for (uint64_t i = 0; i < num_entries; i++) {
-    zip_entry_t entry;
-    if (read_central_directory_entry(reader, &entry) != 0) {
-      continue;
-    }
+  size_t record_size;
+  int result = -1;
+  if (variable_len == 0 ||
+      (reader_read(reader, record + 46, variable_len, &bytes_read) == 0 &&
+       bytes_read == variable_len)) {
+    result = parse_central_directory_entry(record, 46 + variable_len, entry,
+                                           &record_size);
+  }
+  free(record);
+  return result;
+}
 
-    if (entry.compression_method != 0) {
-      continue;
-    }
+// payload.bin can be read when stored, or deflated through an inflating
+// reader.
+static int payload_method_supported(uint16_t method) {
+  return method == 0 || method == 8;
+}
 
-    if (strcmp(entry.name, "payload.bin") == 0 ||
-        strstr(entry.name, "/payload.bin") != NULL) {
-      *payload_entry = entry;
+int find_payload_entry(reader_t *reader, zip_entry_t *payload_entry) {
+  const zip_index_t *index = zip_index_get(reader);
+  if (!index) {
+    return -1;
+  }
+
+  const zip_entry_t *entry = zip_index_find(index, "payload.bin");
+  if (entry && payload_method_supported(entry->compression_method)) {
+    *payload_entry = *entry;
+    return 0;
+  }
+
+  for (size_t i = 0; i < index->num_entries; i++) {
+    entry = &index->entries[i];
+    if (payload_method_supported(entry->compression_method) &&
+        strstr(entry->name, "/payload.bin") != NULL) {
+      *payload_entry = *entry;
       return 0;
     }
   }
@@ -418,6 +719,110 @@ int find_payload_entry(reader_t *reader, zip_entry_t *payload_entry) {
   return -1;
 }
 
+// A stored .zip inside the archive, which may hold payload.bin itself.
+int is_nested_zip_entry(const zip_entry_t *entry) {
+  return entry->compression_method == 0 && entry->uncompressed_size >= 22 &&
+         is_zip_name(entry->name);
+}
+
+// Whether a file name ends in .zip, in any case
+int is_zip_name(const char *name) {
+  size_t len = strlen(name);
+  if (len < 4) {
+    return 0;
+  }
+  const char *ext = name + len - 4;
+  return ext[0] == '.' && (ext[1] == 'z' || ext[1] == 'Z') &&
+         (ext[2] == 'i' || ext[2] == 'I') && (ext[3] == 'p' || ext[3] == 'P');
+}
+
+// Finds payload.bin by walking the local file headers from the start of
+// the archive instead of reading the central directory at its end. This
+// works on archives that are not complete yet. Entries whose size is only
+// given in a trailing data descriptor cannot be skipped, so the walk stops
+// there.
+int find_payload_local_header(reader_t *reader, zip_entry_t *payload_entry) {
+  uint64_t offset = 0;
+
+  while (1) {
+    uint8_t header[30];
+    size_t bytes_read;
+    if (reader_read_at(reader, offset, header, 30, &bytes_read) != 0 ||
+        bytes_read < 30 || read_u32_le(header) != LOCAL_FILE_HEADER_SIG) {
+      return -1;
+    }
+
+    uint16_t flags = read_u16_le(&header[6]);
+    uint16_t compression = read_u16_le(&header[8]);
+    uint32_t crc = read_u32_le(&header[14]);
+    uint64_t compressed_size = read_u32_le(&header[18]);
+    uint64_t uncompressed_size = read_u32_le(&header[22]);
+    uint16_t filename_len = read_u16_le(&header[26]);
+    uint16_t extra_len = read_u16_le(&header[28]);
+
+    uint8_t *names = malloc((size_t)filename_len + extra_len + 1);
+    if (!names) {
+      return -1;
+    }
+    if (reader_read_at(reader, offset + 30, names,
+                       (size_t)filename_len + extra_len, &bytes_read) != 0 ||
+        bytes_read != (size_t)filename_len + extra_len) {
+      free(names);
+      return -1;
+    }
+
+    // Zip64 extra field: sizes that did not fit in 32 bits
+    uint8_t *extra = names + filename_len;
+    uint32_t pos = 0;
+    while (pos + 4 <= extra_len) {
+      uint16_t header_id = read_u16_le(&extra[pos]);
+      uint16_t data_size = read_u16_le(&extra[pos + 2]);
+      uint32_t field_end = pos + 4 + data_size;
+      if (header_id == 0x0001 && field_end <= extra_len) {
+        uint32_t field_pos = pos + 4;
+        if (uncompressed_size == 0xFFFFFFFF && field_pos + 8 <= field_end) {
+          uncompressed_size = read_u64_le(&extra[field_pos]);
+          field_pos += 8;
+        }
+        if (compressed_size == 0xFFFFFFFF && field_pos + 8 <= field_end) {
+          compressed_size = read_u64_le(&extra[field_pos]);
+        }
+        break;
+      }
+      pos += 4 + data_size;
+    }
+
+    names[filename_len] = '\0';
+    int is_payload = (strcmp((char *)names, "payload.bin") == 0 ||
+                      strstr((char *)names, "/payload.bin") != NULL);
+    uint64_t data_offset = offset + 30 + filename_len + extra_len;
+
+    // A deflated entry's end is only known once its sizes are
+    if (is_payload && (compression == 0 ||
+                       (compression == 8 && compressed_size > 0))) {
+      size_t name_len = filename_len < sizeof(payload_entry->name) - 1
+                            ? filename_len
+                            : sizeof(payload_entry->name) - 1;
+      memcpy(payload_entry->name, names, name_len);
+      payload_entry->name[name_len] = '\0';
+      payload_entry->compressed_size = compressed_size;
+      payload_entry->uncompressed_size = uncompressed_size;
+      payload_entry->local_header_offset = offset;
+      payload_entry->data_offset = data_offset;
+      payload_entry->crc32 = crc;
+      payload_entry->compression_method = compression;
+      free(names);
+      return 0;
+    }
+    free(names);
+
+    if ((flags & 0x08) && compressed_size == 0) {
+      return -1;
+    }
+    offset = data_offset + compressed_size;
+  }
+}
+
 int get_data_offset(reader_t *reader, zip_entry_t *entry) {
   uint8_t local_header[30];
   size_t bytes_read;
@@ -434,7 +839,7 @@ int get_data_offset(reader_t *reader, zip_entry_t *entry) {
   }
 
   uint16_t local_compression = read_u16_le(&local_header[8]);
-  if (local_compression != 0) {
+  if (local_compression != entry->compression_method) {
     return -1;
   }
 
@@ -460,4 +865,62 @@ int verify_payload_magic(reader_t *reader, uint64_t offset) {
   }
 
   return 0;
-}
\ No newline at end of file
+}
+
+// Walks the central directory and checks the CRC-32 of every stored entry.
+// Compressed entries are counted in `skipped`. Returns -1 if the directory
+// is unreadable or any stored entry does not match.
+int verify_zip_entries(reader_t *reader, uint64_t *verified,
+                       uint64_t *skipped) {
+  *verified = 0;
+  *skipped = 0;
+
+  const zip_index_t *index = zip_index_get(reader);
+  if (!index || index->num_entries == 0) {
+    return -1;
+  }
+
+  uint8_t *buffer = malloc(1024 * 1024);
+  if (!buffer) {
+    return -1;
+  }
+
+  int result = 0;
+  for (size_t i = 0; i < index->num_entries && result == 0; i++) {
+    zip_entry_t entry_copy = index->entries[i];
+    zip_entry_t *entry = &entry_copy;
+    if (entry->compression_method != 0) {
+      (*skipped)++;
+      continue;
+    }
+    if (get_data_offset(reader, entry) != 0) {
+      result = -1;
+      break;
+    }
+
+    uint32_t crc = 0;
+    uint64_t pos = 0;
+    while (pos < entry->uncompressed_size) {
+      uint64_t left = entry->uncompressed_size - pos;
+      size_t chunk = (left < 1024 * 1024) ? (size_t)left : 1024 * 1024;
+      size_t bytes_read;
+      if (reader_read_at(reader, entry->data_offset + pos, buffer, chunk,
+                         &bytes_read) != 0 ||
+          bytes_read != chunk) {
+        result = -1;
+        break;
+      }
+      crc = zip_crc32(crc, buffer, chunk);
+      pos += chunk;
+    }
+    if (result == 0 && crc != entry->crc32) {
+      result = -1;
+    }
+    if (result == 0) {
+      (*verified)++;
+    }
+  }
+
+  free(buffer);
+  return result;
+}
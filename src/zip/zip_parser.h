@@ -5,6 +5,9 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "follow_reader.h"
+#include "inflate_reader.h"
+#include "stream_reader.h"
 #ifdef ENABLE_HTTP_SUPPORT
 #include "http_reader.h"
 #endif
@@ -21,12 +24,33 @@ typedef struct {
   uint64_t uncompressed_size;
   uint64_t local_header_offset;
   uint64_t data_offset;
+  uint32_t crc32;
   uint16_t compression_method;
 } zip_entry_t;
 
 typedef struct {
+  uint64_t offset;
+  size_t size;
+  uint8_t *buffer;
+} reader_range_t;
+
+struct zip_index;
+
+// A window onto another reader, such as a ZIP stored inside a ZIP
+typedef struct {
+  struct reader *source;
+  int owns_source;
+  uint64_t offset;
+  uint64_t current_pos;
+} range_reader_t;
+
+typedef struct reader {
   enum {
-    READER_FILE
+    READER_FILE,
+    READER_FOLLOW,
+    READER_STREAM,
+    READER_INFLATE,
+    READER_RANGE
 #ifdef ENABLE_HTTP_SUPPORT
     ,
     READER_HTTP
@@ -34,15 +58,31 @@ typedef struct {
   } type;
   union {
     FILE *file;
+    follow_reader_t follow;
+    stream_reader_t stream;
+    inflate_reader_t inflate; // Its source is a reader_t the reader owns
+    range_reader_t range;
 #ifdef ENABLE_HTTP_SUPPORT
     http_reader_t http;
 #endif
   } data;
   uint64_t size;
+  struct zip_index *index; // Built on first use by zip_index_get
+  char *index_path;        // Where the index is saved between runs, if set
 } reader_t;
 
 // Reader functions
 int reader_init_file(reader_t *reader, const char *path);
+int reader_init_follow(reader_t *reader, const char *path,
+                       uint64_t expected_size);
+int reader_init_stream(reader_t *reader, FILE *file, int owns_file);
+int reader_init_inflate(reader_t *reader, reader_t *source,
+                        const zip_entry_t *entry, const char *index_path);
+int reader_init_gzip(reader_t *reader, reader_t *source,
+                     const char *index_path);
+int reader_is_gzip(reader_t *reader);
+int reader_init_range(reader_t *reader, reader_t *source, uint64_t offset,
+                      uint64_t size, int owns_source);
 #ifdef ENABLE_HTTP_SUPPORT
 int reader_init_http(reader_t *reader, const char *url, const char *user_agent,
                      int silent);
@@ -53,7 +93,12 @@ int reader_read(reader_t *reader, uint8_t *buffer, size_t size,
                 size_t *bytes_read);
 int reader_read_at(reader_t *reader, uint64_t offset, uint8_t *buffer,
                    size_t size, size_t *bytes_read);
+int reader_read_ranges(reader_t *reader, reader_range_t *ranges,
+                       size_t count);
 uint64_t reader_get_size(reader_t *reader);
+int reader_supports_concurrent_reads(reader_t *reader);
+int reader_is_sequential(reader_t *reader);
+reader_t *reader_base(reader_t *reader);
 
 // ZIP parsing functions
 int find_eocd(reader_t *reader, uint64_t *eocd_offset, uint16_t *num_entries);
@@ -61,14 +106,22 @@ int read_zip64_eocd(reader_t *reader, uint64_t eocd_offset, uint64_t *cd_offset,
                     uint64_t *num_entries);
 int get_central_directory_info(reader_t *reader, uint64_t *cd_offset,
                                uint64_t *num_entries);
+int parse_central_directory_entry(const uint8_t *data, size_t size,
+                                  zip_entry_t *entry, size_t *record_size);
 int read_central_directory_entry(reader_t *reader, zip_entry_t *entry);
 int find_payload_entry(reader_t *reader, zip_entry_t *payload_entry);
+int is_zip_name(const char *name);
+int is_nested_zip_entry(const zip_entry_t *entry);
+int find_payload_local_header(reader_t *reader, zip_entry_t *payload_entry);
 int get_data_offset(reader_t *reader, zip_entry_t *entry);
 int verify_payload_magic(reader_t *reader, uint64_t offset);
+int verify_zip_entries(reader_t *reader, uint64_t *verified,
+                       uint64_t *skipped);
 
 // Utility functions
 uint32_t read_u32_le(const uint8_t *data);
 uint16_t read_u16_le(const uint8_t *data);
 uint64_t read_u64_le(const uint8_t *data);
+uint32_t zip_crc32(uint32_t crc, const uint8_t *data, size_t size);
 
 #endif
\ No newline at end of file